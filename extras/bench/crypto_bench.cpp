@@ -0,0 +1,314 @@
+/*
+ * Host-side benchmark of the primitives in src/crypto, gated by the
+ * RFC 8032 (Ed25519), RFC 7748 (X25519) and RFC 8439 (ChaCha20-Poly1305) test vectors: timings are only
+ * printed if every vector passes, and the exit status is 1 otherwise.
+ * Build and run from this directory, once per limb size, with:
+ *  for l in 8 16 32 64; do
+ *    g++ -O2 -DBIGNUMBER_LIMB=$l -I../../src -I../../src/crypto \
+ *      -o crypto_bench crypto_bench.cpp ../../src/DomoticCrypto.cpp ../../src/DomoticStorage.cpp \
+ *      ../../src/RNG.cpp ../../src/crypto/[A-Z]*.cpp && ./crypto_bench || break
+ *  done
+ *
+ * Cycles come from the TSC on x86 (0 elsewhere): they are reference cycles,
+ * so compare them across runs on the same machine only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "DomoticCrypto.h"
+#include "SHA512.h"
+#include "ChaChaPoly.h"
+#include "BigNumberUtil.h"
+#include "utility/LimbUtil.h"
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+struct Timing {
+  double ns;	// Per call
+  double cyc;
+};
+
+// Run op() for about half a second
+template <typename T>
+static Timing timeit(T op)
+{
+  unsigned rounds=0;
+  double start=now(), elapsed;
+  uint64_t c0=cycles();
+  do {
+    op();
+    ++rounds;
+    elapsed=now()-start;
+  } while(elapsed<0.5);
+  Timing t={ elapsed*1e9/rounds, (double)(cycles()-c0)/rounds };
+  return t;
+}
+
+static void report(const char *name, Timing t, double per=1, const char *unit="op")
+{
+  printf("  %-28s %12.1f ns/%s %12.1f cycles/%s\n", name, t.ns/per, unit, t.cyc/per, unit);
+}
+
+static void unhex(uint8_t *out, const char *hex)
+{
+  for(size_t t=0; hex[2*t]; ++t) {
+    unsigned v;
+    sscanf(hex+2*t, "%2x", &v);
+    out[t]=v;
+  }
+}
+
+static int fails=0;
+
+static void gate(bool ok, const char *what)
+{
+  if(!ok) {
+    printf("FAILED: %s\n", what);
+    ++fails;
+  }
+}
+
+// RFC 8032, section 7.1, tests 1-3
+static const struct {
+  const char *priv, *pub, *msg, *sig;
+} edVectors[]={
+  { "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60",
+    "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a",
+    "",
+    "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e06522490155"
+    "5fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b" },
+  { "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb",
+    "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c",
+    "72",
+    "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da"
+    "085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00" },
+  { "c5aa8df43f9f837bedb7442f31dcb7b166d38535076f094b85ce3a2e0b4458f7",
+    "fc51cd8e6218a1a38da47ed00230f0580816ed13ba3303ac5deb911548908025",
+    "af82",
+    "6291d657deec24024827e69c3abe01a30ce548a284743a445e3680d7db5ac3ac"
+    "18ff9b538d16f290ae67f760984dc6594a7c15e9716ed28dc027beceea1ec40a" },
+};
+
+// RFC 7748, section 5.2 (single evaluations) and 6.1 (Alice's and Bob's keys)
+static const struct {
+  const char *scalar, *u, *out;
+} xVectors[]={
+  { "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4",
+    "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c",
+    "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552" },
+  { "4b66e9d4d1b4673c5ad22691957d6af5c11b6421e0ea01d42ca4169e7918ba0d",
+    "e5210f12786811d3f4b7959d0538ae2c31dbe7106fc03c3efc4cd549c715a493",
+    "95cbde9476e8907d7aade45cb4b873f88b595a68799fa152e6f8f7647aac7957" },
+  { "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+    "0900000000000000000000000000000000000000000000000000000000000000",
+    "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a" },
+  { "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb",
+    "0900000000000000000000000000000000000000000000000000000000000000",
+    "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f" },
+  { "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a",
+    "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f",
+    "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742" },
+};
+
+// RFC 8439, section 2.8.2 (AEAD)
+static const char *aeadKey="808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f";
+static const char *aeadNonce="070000004041424344454647";
+static const char *aeadAD="50515253c0c1c2c3c4c5c6c7";
+static const char *aeadPlain="Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+static const char *aeadCipher="d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+  "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+  "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+  "3ff4def08e4b7a9de576d26586cec64b6116";
+static const char *aeadTag="1ae10b594f09e26a7e902ecbd0600691";
+
+static void checkVectors()
+{
+  for(size_t t=0; t<sizeof(edVectors)/sizeof(edVectors[0]); ++t) {
+    uint8_t priv[32], pub[32], msg[8], sig[64], exp[64];
+    size_t mlen=strlen(edVectors[t].msg)/2;
+    unhex(priv, edVectors[t].priv);
+    unhex(msg, edVectors[t].msg);
+    unhex(exp, edVectors[t].pub);
+    Ed25519::derivePublicKey(pub, priv);
+    gate(!memcmp(pub, exp, 32), "RFC 8032 public key");
+    unhex(exp, edVectors[t].sig);
+    Ed25519::sign(sig, priv, pub, msg, mlen);
+    gate(!memcmp(sig, exp, 64), "RFC 8032 signature");
+    gate(Ed25519::verify(sig, pub, msg, mlen), "RFC 8032 verify");
+    sig[t]^=1;
+    gate(!Ed25519::verify(sig, pub, msg, mlen), "RFC 8032 verify of a bad signature");
+  }
+
+  for(size_t t=0; t<sizeof(xVectors)/sizeof(xVectors[0]); ++t) {
+    uint8_t s[32], u[32], out[32], exp[32];
+    unhex(s, xVectors[t].scalar);
+    unhex(u, xVectors[t].u);
+    unhex(exp, xVectors[t].out);
+    // eval() is the raw function: clamp as in decodeScalar25519()
+    s[0]&=0xF8;
+    s[31]=(s[31]&0x7F)|0x40;
+    Curve25519::eval(out, s, u);
+    gate(!memcmp(out, exp, 32), "RFC 7748 X25519");
+  }
+
+  uint8_t key[32], nonce[12], ad[12], data[128], cipher[128], tag[16], expTag[16];
+  size_t plen=strlen(aeadPlain);
+  unhex(key, aeadKey);
+  unhex(nonce, aeadNonce);
+  unhex(ad, aeadAD);
+  unhex(cipher, aeadCipher);
+  unhex(expTag, aeadTag);
+  memcpy(data, aeadPlain, plen);
+  ChaChaPoly::encrypt(data, plen, tag, ad, sizeof(ad), key, nonce);
+  gate(!memcmp(data, cipher, plen), "RFC 8439 AEAD ciphertext");
+  gate(!memcmp(tag, expTag, 16), "RFC 8439 AEAD tag");
+  gate(ChaChaPoly::decrypt(data, plen, tag, ad, sizeof(ad), key, nonce) && !memcmp(data, aeadPlain, plen),
+    "RFC 8439 AEAD decrypt");
+  memcpy(data, cipher, plen);
+  tag[0]^=1;
+  gate(!ChaChaPoly::decrypt(data, plen, tag, ad, sizeof(ad), key, nonce), "RFC 8439 AEAD decrypt with a bad tag");
+
+  // FIPS 180-2 example
+  static const char *abc="ddaf35a193617abacc417349ae20413112e6fa4e89a97ea20a9eeee64b55d39a"
+    "2192992a274fc1a836ba3c23a3feebbd454d4423643ce80e2a9ac94fa54ca49f";
+  uint8_t h[64], exp[64];
+  SHA512 hash;
+  hash.update("abc", 3);
+  hash.finalize(h, sizeof(h));
+  unhex(exp, abc);
+  gate(!memcmp(h, exp, 64), "SHA512(\"abc\")");
+
+  // BigNumberUtil::mul against byte-wise schoolbook multiplication
+  uint8_t a[32], b[32], prod[64], ref[64];
+  uint32_t acc[64];
+  limb_t la[NUM_LIMBS_256BIT], lb[NUM_LIMBS_256BIT], lp[NUM_LIMBS_512BIT];
+  for(int round=0; round<100; ++round) {
+    for(int t=0; t<32; ++t) {
+      a[t]=rand();
+      b[t]=round?rand():0xFF;	// All ones first: longest carry chains
+    }
+    if(!round)
+      memset(a, 0xFF, sizeof(a));
+    memset(acc, 0, sizeof(acc));
+    for(int i=0; i<32; ++i)
+      for(int j=0; j<32; ++j)
+        acc[i+j]+=a[i]*b[j];
+    uint32_t carry=0;
+    for(int t=0; t<64; ++t) {
+      carry+=acc[t];
+      ref[t]=(uint8_t)carry;
+      carry>>=8;
+    }
+    BigNumberUtil::unpackLE(la, NUM_LIMBS_256BIT, a, 32);
+    BigNumberUtil::unpackLE(lb, NUM_LIMBS_256BIT, b, 32);
+    BigNumberUtil::mul(lp, la, NUM_LIMBS_256BIT, lb, NUM_LIMBS_256BIT);
+    BigNumberUtil::packLE(prod, 64, lp, NUM_LIMBS_512BIT);
+    if(memcmp(prod, ref, 64)) {
+      gate(false, "BigNumberUtil::mul");
+      break;
+    }
+  }
+
+  // reduceQuick: y+small reduces to small, small stays small
+  limb_t x[NUM_LIMBS_256BIT], y[NUM_LIMBS_256BIT], r[NUM_LIMBS_256BIT];
+  memset(a, 0xA5, sizeof(a));
+  a[31]=0x7F;
+  BigNumberUtil::unpackLE(y, NUM_LIMBS_256BIT, a, 32);
+  a[0]+=3;
+  BigNumberUtil::unpackLE(x, NUM_LIMBS_256BIT, a, 32);
+  BigNumberUtil::reduceQuick(r, x, y, NUM_LIMBS_256BIT);
+  BigNumberUtil::packLE(prod, 32, r, NUM_LIMBS_256BIT);
+  memset(ref, 0, 32);
+  ref[0]=3;
+  gate(!memcmp(prod, ref, 32), "BigNumberUtil::reduceQuick (x>=y)");
+  BigNumberUtil::reduceQuick(r, r, y, NUM_LIMBS_256BIT);
+  BigNumberUtil::packLE(prod, 32, r, NUM_LIMBS_256BIT);
+  gate(!memcmp(prod, ref, 32), "BigNumberUtil::reduceQuick (x<y)");
+}
+
+int main()
+{
+  printf("Limb size: %u bits\n", (unsigned)(8*sizeof(limb_t)));
+  checkVectors();
+  if(fails) {
+    printf("%d test vectors failed: no timings\n", fails);
+    return 1;
+  }
+  printf("All test vectors passed\n");
+
+  uint8_t priv[32], pub[32], sig[64], msg[64], k[32], f[32];
+  memset(priv, 0x5A, sizeof(priv));
+  memset(msg, 'x', sizeof(msg));
+  Ed25519::derivePublicKey(pub, priv);
+  Ed25519::sign(sig, priv, pub, msg, sizeof(msg));
+
+  printf("Ed25519 (64 byte message):\n");
+  report("sign", timeit([&]() { Ed25519::sign(sig, priv, pub, msg, sizeof(msg)); }));
+  report("verify", timeit([&]() {
+    if(!Ed25519::verify(sig, pub, msg, sizeof(msg)))
+      printf("verify failed!\n");
+  }));
+  report("derivePublicKey", timeit([&]() { Ed25519::derivePublicKey(pub, priv); }));
+
+  printf("Curve25519:\n");
+  report("eval (base point)", timeit([&]() { Curve25519::eval(k, priv, 0); }));
+  report("eval", timeit([&]() { Curve25519::eval(k, priv, pub); }));
+  report("dh1", timeit([&]() { Curve25519::dh1(k, f); }));
+  report("dh2", timeit([&]() {
+    uint8_t t[32];
+    memcpy(t, f, sizeof(t));
+    memcpy(k, pub, sizeof(k));
+    Curve25519::dh2(k, t);
+  }));
+
+  printf("RNG:\n");
+  report("rand (32 bytes)", timeit([&]() { RNG.rand(k, sizeof(k)); }), sizeof(k), "byte");
+
+  printf("SHA512:\n");
+  static const size_t sizes[]={ 64, 1024, 16384 };
+  static uint8_t data[16384];
+  for(size_t t=0; t<sizeof(sizes)/sizeof(sizes[0]); ++t) {
+    char name[32];
+    uint8_t h[64];
+    snprintf(name, sizeof(name), "%u byte messages", (unsigned)sizes[t]);
+    report(name, timeit([&]() {
+      SHA512 hash;
+      hash.update(data, sizes[t]);
+      hash.finalize(h, sizeof(h));
+    }), sizes[t], "byte");
+  }
+
+  printf("BigNumberUtil (256 bit operands):\n");
+  limb_t x[NUM_LIMBS_256BIT], y[NUM_LIMBS_256BIT], r[NUM_LIMBS_512BIT];
+  memset(priv, 0xC3, sizeof(priv));
+  BigNumberUtil::unpackLE(x, NUM_LIMBS_256BIT, priv, 32);
+  BigNumberUtil::unpackLE(y, NUM_LIMBS_256BIT, pub, 32);
+  // Each result feeds the next call: the compiler can't drop the loop
+  report("mul", timeit([&]() {
+    BigNumberUtil::mul(r, x, NUM_LIMBS_256BIT, y, NUM_LIMBS_256BIT);
+    x[0]^=r[NUM_LIMBS_256BIT];
+  }));
+  report("reduceQuick", timeit([&]() {
+    BigNumberUtil::reduceQuick(r, x, y, NUM_LIMBS_256BIT);
+    x[1]^=r[0];
+  }));
+  return 0;
+}
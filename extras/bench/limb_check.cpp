@@ -0,0 +1,95 @@
+/*
+ * Cross-check of Curve25519 and Ed25519 across limb sizes: the same
+ * pseudo-random keys, messages and points are processed and all results
+ * are hashed into a single digest, which must not depend on BIGNUMBER_LIMB.
+ * limb_check.sh builds this once per limb size and compares the digests;
+ * a single configuration can be built from this directory with:
+ *  g++ -O2 -DBIGNUMBER_LIMB=16 -I../../src -I../../src/crypto \
+ *    -o limb_check limb_check.cpp ../../src/RNG.cpp ../../src/crypto/[A-Z]*.cpp
+ *
+ * Output is one line: limb size, digest, then microseconds per operation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Curve25519.h"
+#include "Ed25519.h"
+#include "SHA512.h"
+#include "BigNumberUtil.h"
+
+static const int ROUNDS=64;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+// Same sequence on every build (xorshift64*)
+static uint64_t state=0x9E3779B97F4A7C15ULL;
+
+static void fill(uint8_t *buff, size_t len)
+{
+  for(size_t t=0; t<len; ++t) {
+    state^=state>>12;
+    state^=state<<25;
+    state^=state>>27;
+    buff[t]=(uint8_t)((state*0x2545F4914F6CDD1DULL)>>56);
+  }
+}
+
+int main()
+{
+  SHA512 digest;
+  double tDerive=0, tSign=0, tVerify=0, tEval=0, start;
+  int fails=0;
+
+  for(int r=0; r<ROUNDS; ++r) {
+    uint8_t priv[32], pub[32], sig[64], msg[200], s[32], u[32], out[32];
+    uint8_t mlen;
+
+    fill(priv, sizeof(priv));
+    fill(&mlen, 1);
+    mlen%=sizeof(msg);
+    fill(msg, mlen);
+
+    start=now();
+    Ed25519::derivePublicKey(pub, priv);
+    tDerive+=now()-start;
+    start=now();
+    Ed25519::sign(sig, priv, pub, msg, mlen);
+    tSign+=now()-start;
+    digest.update(pub, sizeof(pub));
+    digest.update(sig, sizeof(sig));
+
+    // Good signature must verify, a damaged one must not (bit 255 is not checked by verify())
+    start=now();
+    bool good=Ed25519::verify(sig, pub, msg, mlen);
+    tVerify+=now()-start;
+    sig[r%64]^=1<<(r%7);
+    bool bad=Ed25519::verify(sig, pub, msg, mlen);
+    if(!good || bad)
+      ++fails;
+
+    // Raw scalar (not clamped) and arbitrary u, including non-canonical ones
+    fill(s, sizeof(s));
+    fill(u, sizeof(u));
+    start=now();
+    bool ok=Curve25519::eval(out, s, u);
+    tEval+=now()-start;
+    digest.update(&ok, 1);
+    digest.update(out, sizeof(out));
+  }
+
+  uint8_t h[64];
+  digest.finalize(h, sizeof(h));
+  printf("%2u ", (unsigned)(8*sizeof(limb_t)));
+  for(int t=0; t<16; ++t)
+    printf("%02x", h[t]);
+  printf(" derive %.1f sign %.1f verify %.1f eval %.1f%s\n",
+    tDerive*1e6/ROUNDS, tSign*1e6/ROUNDS, tVerify*1e6/ROUNDS, tEval*1e6/ROUNDS,
+    fails?" VERIFY FAILED":"");
+  return fails?1:0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Build limb_check.cpp with every limb size and check that all of them
+# compute the same results. Extra arguments are passed to g++ (f.e. -O0).
+# Run from any directory; exits 1 on build errors or mismatches.
+cd "$(dirname "$0")" || exit 1
+SRC=../../src
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+
+rc=0
+ref=
+echo "limb digest (us per operation)"
+for l in 8 16 32 64; do
+  g++ -O2 "$@" -DBIGNUMBER_LIMB=$l -I$SRC -I$SRC/crypto -o "$TMP/limb$l" \
+    limb_check.cpp $SRC/RNG.cpp $SRC/crypto/[A-Z]*.cpp || exit 1
+  line=$("$TMP/limb$l") || rc=1
+  echo "$line"
+  digest=$(echo "$line" | awk '{ print $2 }')
+  [ -z "$ref" ] && ref=$digest
+  if [ "$digest" != "$ref" ]; then
+    echo "MISMATCH: $l-bit limbs differ from 8-bit ones"
+    rc=1
+  fi
+done
+exit $rc
@@ -1,4 +1,5 @@
 #include "Domotic.h"
+#include "DomoticStorage.h"
 #include <Wire.h>
 #include <WiFiUdp.h>
 
@@ -14,6 +15,8 @@ Domotic::Domotic()
 , _udp(0)
 , _initialized(false)
 , _mcastAddr(DOMOTIC_DEF_UDP_MCAST)
+, _remotePort(0)
+, _ansTicket(AnswerCache::NONE)
 , _douts(0)
 , _aouts(0)
 , _dins(0)
@@ -25,15 +28,59 @@ Domotic::Domotic()
 , _dinMap(NULL)
 , _ainMap(NULL)
 , _text(NULL)
+, _restore(NULL)
 , _isSigned(false)
 , _signKey(0)
 , _signOffset(0)
 , _signData(0)
+, _signCtr(0)
+, _signSender(0)
+, _encSession(0)
+, _encCtr(0)
+, _canExchange(false)
 , _doNotScan(false)
+, _regChanged(false)
+, _display(NULL)
+, _outPending(false)
+, _outRtc(false)
+, _outSince(0)
+, _outSaved(0)
+, _groupDropped(0)
+, _configGen(0)
+, _configDigest(0)
+, _configStale(false)
+, _hbMin(0)
+, _hbMax(0)
+, _hbInterval(0)
+, _hbLast(0)
+, _hbKey(0xFFFF)
+, _verifying(false)
+, _pendUpdate(false)
+, _pendRcv(0)
+, _pendOffset(0)
+, _pendLen(0)
+, _pendKey(0)
+, _pendSignCtr(0)
+, _pendSession(0)
+, _pendCtr(0)
+, _pendPort(0)
+, _pendTicket(AnswerCache::NONE)
+, _signHead(0)
+, _signCount(0)
+, _signing(false)
+, _signLatency(0)
+, _signLatencyMax(0)
 {
   for(uint8_t addr=0; addr<Domotic::MAX_EXPS; ++addr) {
     _exps[addr]=NULL;
   }
+  memset(_delayed, TimerTable::ACT_NONE, sizeof(_delayed));
+  memset(_subs, 0, sizeof(_subs));
+  _netConfig.pending=false;
+  for(int t=0; t<DOMOTIC_MAX_USUBS; ++t) {
+    _usubs[t].port=0;
+    _usubs[t].len=0;
+  }
 }
 
 Domotic::~Domotic() {
@@ -42,6 +89,8 @@ Domotic::~Domotic() {
   delete _dinMap;
   delete _ainMap;
   delete _text;
+  free(_restore);
+  free(_display);
   for(uint8_t addr=0; addr<Domotic::MAX_EXPS; ++addr) {
     delete _exps[addr];
     _exps[addr]=NULL;
@@ -158,7 +207,33 @@ void Domotic::begin(void) {
   _ainMap=(uint16_t *)calloc(_ains, sizeof(_ainMap[0]));
   _dinMap=(uint16_t *)calloc(_dins, sizeof(_dinMap[0]));
 
+  _restore=(uint8_t *)malloc(_douts+_aouts);
+  if(_restore)
+    memset(_restore, RESTORE_LAST, _douts+_aouts);
+
+  storageBegin(); // One scan of the log for all the loads below
   initMaps();
+  loadMaps(); // Missing or for other lines: maps from initMaps()
+  loadRestore(); // Missing or for other lines: policies from initMaps()
+  _wheel.poll(millis()); // Nothing armed yet: only brings the wheel to now, so the first timers don't expire at once
+  restoreOutputs(); // Before networking: the controller is not needed
+  _tlen=tlen();
+  if(_tlen)
+    _display=(char *)calloc(_tlen+1, 1);
+
+  _keys.load(); // Missing or corrupted keystore leaves _keys empty
+  _replay.load(); // Missing: counting starts from scratch
+  _rules.load(); // Missing or corrupted: no rules
+  _timers.load(); // Missing or corrupted: no timers
+  _groups.reserve(_douts+_aouts+RuleTable::MAX_RULES+MAX_SUBS);
+  indexGroups();
+  _journal.begin();
+  initKeys();
+  loadConfig();
+  _canExchange=false;
+  for(int t=0; t<_keys.count(); ++t)
+    if(_keys.at(t)->getCaps().keyexch)
+      _canExchange=true;
 
   // Setup networking
   _udp = new WiFiUDP();
@@ -166,6 +241,7 @@ void Domotic::begin(void) {
     return;
   // _udp->begin(_port); // included in beginMulticast
   _udp->beginMulticast(WiFi.localIP(), _mcastAddr, _port);
+  _joinedIP=WiFi.localIP();
 
   _initialized=true;
 }
@@ -173,7 +249,14 @@ void Domotic::begin(void) {
 void Domotic::handle()
 {
   handleNet(); // Always call network processing first!
+  handleCrypto(); // Pending signatures, one time slice
+  handleTimers(); // Expired timers, pulses and delayed writes
+  handleHeartbeat();
+  handleNetConfig(); // Network changes, once their answer is out
   handler(); // Call derived class' method
+  handleConfig(); // Digest of a changed configuration, now that no request uses _lastpkt
+  handleOutputs(); // Output changes from this round (and the previous ones, when due)
+  flushUSubs(); // Updates from this round, one packet per subscriber
 }
 
 void Domotic::handleNet()
@@ -182,6 +265,7 @@ void Domotic::handleNet()
     return;
 
   _isSigned=false;
+  _ansTicket=AnswerCache::NONE;
 
   int data=_udp->parsePacket();
   if(data) {
@@ -189,139 +273,356 @@ void Domotic::handleNet()
     int len=_udp->read(_lastpkt, DOMOTIC_MAX_PKT_SIZE); // Read UP TO DOMOTIC_MAX_PKT_SIZE
     if(len && _lastpkt[len-1]=='\n')
       --len;  // remove stray \n in query
+    if(len && _lastpkt[len-1]=='\r')
+      --len;  // and \r from println()
     _lastpkt[len]=0; // Make sure string terminates
     int offset=0;
 
-    Domotic::DomError err=Domotic::ERR_UNKNOWN;
+    _remoteIP=_udp->remoteIP();
+    _remotePort=_udp->remotePort();
 
     if(_udp->destinationIP()==_mcastAddr) {
       // Process multicast data
-      if(_lastpkt[offset]=='S') {
-        // Parse signature
-        ++offset;
-        verifySig(offset, len, true);
+      // Updates for groups nobody here cares about are dropped before checking MAC or signature
+      int upd=updateOffset(offset, len);
+      uint16_t group;
+      if(upd<0)
+        return;
+      if(len-upd>=8 && _lastpkt[upd]=='U' && (_lastpkt[upd+1]=='I' || _lastpkt[upd+1]=='O')
+          && (hex2uint16(_lastpkt+upd+3, &group) || _groups.find(group)<0)) {
+        ++_groupDropped;
+        return;
       }
-      if(data-offset>=10 && _lastpkt[offset]=='U') {	// Regular update
-        Domotic::UpdDir d;
-        Domotic::UpdType t;
-        uint16_t group=0, val;
-        uint8_t b;
-        offset=1;
-
-        // Input or output?
-        if(_lastpkt[offset]=='I') {
-          d=Domotic::DIR_IN;
-        } else
-        if(_lastpkt[offset]=='O') {
-          d=Domotic::DIR_OUT;
-        } else
+      if(_lastpkt[offset]==PKT_MAC) {
+        // Checking a MAC is cheap: forged packets are dropped right away
+        if(verifyMAC(offset, len))
           return;
+      } else if(_lastpkt[offset]==PKT_SIG) {
+        // A signature takes a while to verify: updates that are only trusted when authenticated are handled
+        // by handleCrypto() once verified. The others, or all while another verification runs, are
+        // handled at once as unauthenticated
         ++offset;
-
-        // Analog or digital?
-        if(_lastpkt[offset]=='A') {
-          t=Domotic::TYPE_ANALOG;
-        } else
-        if(_lastpkt[offset]=='D') {
-          t=Domotic::TYPE_DIGITAL;
-        } else
+        verifySig(offset, len, true);
+        if(!_signKey)
+          return; // Unknown key, stale counter or copy of a packet already seen
+        if(authUpdate(offset, len) && !_verifying && !startVerify(offset, len, true, rcv))
           return;
-        ++offset;
-
-        // Group
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        group=b;
-        offset+=2;
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        group=(group<<8)+b;
-        offset+=2;
-
-        if(Domotic::TYPE_DIGITAL==t) {
-          // Digital: only '1' or '0'
-          if('1'==_lastpkt[offset]) val=1;
-          else if('0'==_lastpkt[offset]) val=0;
-          else return;
-        } else {
-          // Analog: 4 hex bytes
-          if(hex2uint8(_lastpkt+offset, &b)) return;
-          val=b;
-          offset+=2;
-          if(hex2uint8(_lastpkt+offset, &b)) return;
-          val=(val<<8)+b;
-          offset+=2;
-        }
-        // Packet parsed OK, run callback
-        processNotification(d, t, group, val, data-offset, offset);
-      } else if(_lastpkt[offset]=='T' && data-offset>=12) { // Time update (usually signed)
-        ++offset; // Skip 'T'
-        uint8_t epoch;
-        uint32_t tstamp;
-        int8_t tz=0;
-        bool dst=false;
-        uint8_t b;
-
-        if(hex2uint8(_lastpkt+offset, &epoch)) return;
-        // epoch is currently fixed at 0
-        if(0!=epoch) return;
-        offset+=2;
-
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        tstamp=b;
-        offset+=2;
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        tstamp=(tstamp<<8)+b;
-        offset+=2;
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        tstamp=(tstamp<<8)+b;
-        offset+=2;
-        if(hex2uint8(_lastpkt+offset, &b)) return;
-        tstamp=(tstamp<<8)+b;
-        offset+=2;
-
-        if(2<hex2uint8(_lastpkt+offset, &b)) return;
-        tz=(b&0x1F) | ((b&0x10)?0xF0:0); // theoretically from -16 to +15, actually from -12 to +12
-        dst=b&0x20;
-        offset+=2;
-
-        tstamp+=(millis()-rcv+500)/1000; // verifying Ed25519 sig takes ~900ms, round it to 1s
-        processTimeUpdate(epoch, tstamp, tz, dst);
       }
+      handleUpdate(offset, len, rcv);
     } else {
       // Parse unicast packet
 //Serial.printf("Req: '%s' from ", (char*)_lastpkt);
 //Serial.println(_udp->remoteIP());
 
+      // A retransmission gets the answer already sent, without running the request again
+      // Plain reads are cheap and must return current values: they're never cached
+      if(_lastpkt[offset]!=PKT_INF) {
+        uint32_t h=AnswerCache::hash(_lastpkt, len);
+        const uint8_t *ans;
+        size_t alen;
+        switch(_answers.lookup(_remoteIP, _remotePort, h, rcv, ans, alen)) {
+          case AnswerCache::RES_DONE:
+            _udp->beginPacket(_remoteIP, _remotePort);
+            _udp->write(ans, alen);
+            _udp->endPacket();
+            return;
+          case AnswerCache::RES_PENDING:
+            return;
+        }
+        _ansTicket=_answers.open(_remoteIP, _remotePort, h, rcv);
+      }
+
       if(_lastpkt[offset]==PKT_ENC) {
-#warning "Encrypted packets currently unsupported (TODO)"
-         err=Domotic::ERR_UNSUPP;
+        handleEncrypted(offset, len);
+        return;
       }
-      // Signature could be inside an encrypted packet
       if(_lastpkt[offset]==PKT_SIG) {
-        verifySig(offset, len, false);	// Check immediately: parser modifies buffer for answer!
+        handleSigned(offset, len);
+        return;
       }
-      // SimplePkt can be encrypted and/or signed
-      switch(_lastpkt[offset]) {
-        case Domotic::DomPktType::PKT_CMD:
-          ++offset; --len;
-          err=processCommand(offset, len);
-          break;
-        case Domotic::DomPktType::PKT_INF:
-          ++offset; --len;
-          err=processInfo(offset, len);
-          break;
-        case Domotic::PKT_ANS:
-        case Domotic::PKT_UPD:
-        case Domotic::PKT_ENC:
-        case Domotic::PKT_SIG:
-          err=Domotic::ERR_CTX;
-          len=0;
-          break;
+      if(_lastpkt[offset]==PKT_MAC) {
+        handleMAC(offset, len);
+        return;
       }
-  //Serial.printf("Ans: '%s'\n", (char*)_lastpkt+offset);
-      // Send answer
-      answer(err, len, offset);
+      handleRequest(offset, len);
+    }
+  }
+}
+
+// Time updates step the clock: only authenticated ones are trusted, once one has been seen (see LocalClock)
+// Input updates from other nodes drive bound outputs and group rules only when authenticated (the group is
+// known to be in _groups: others are dropped before any signature check)
+bool Domotic::authUpdate(int offset, int len)
+{
+  if(len-offset<2 || 'U'!=_lastpkt[offset])
+    return false;
+  return 'T'==_lastpkt[offset+1] || ('I'==_lastpkt[offset+1] && _remoteIP!=WiFi.localIP());
+}
+
+// Multicast update at offset, already authenticated if _isSigned; rcv is millis() when it was received
+void Domotic::handleUpdate(int offset, int len, unsigned long rcv)
+{
+  uint16_t group;
+
+  if(len-offset>=8 && _lastpkt[offset]=='U' && _lastpkt[offset+1]!='T') {	// Regular update
+    Domotic::UpdDir d;
+    Domotic::UpdType t;
+    uint16_t val;
+    uint8_t b;
+    ++offset; // Skip 'U'
+
+    // Input or output?
+    if(_lastpkt[offset]=='I') {
+      d=Domotic::DIR_IN;
+    } else
+    if(_lastpkt[offset]=='O') {
+      d=Domotic::DIR_OUT;
+    } else
+      return;
+    ++offset;
+
+    // Analog or digital?
+    if(_lastpkt[offset]=='A') {
+      t=Domotic::TYPE_ANALOG;
+    } else
+    if(_lastpkt[offset]=='D') {
+      t=Domotic::TYPE_DIGITAL;
+    } else
+      return;
+    ++offset;
+
+    // Group
+    if(hex2uint16(_lastpkt+offset, &group)) return;
+    offset+=4;
+
+    if(Domotic::TYPE_DIGITAL==t) {
+      // Digital: only '1' or '0'
+      if('1'==_lastpkt[offset]) val=1;
+      else if('0'==_lastpkt[offset]) val=0;
+      else return;
+      ++offset;
+    } else {
+      // Analog: 4 hex bytes
+      if(hex2uint8(_lastpkt+offset, &b)) return;
+      val=b;
+      offset+=2;
+      if(hex2uint8(_lastpkt+offset, &b)) return;
+      val=(val<<8)+b;
+      offset+=2;
+    }
+    // Packet parsed OK: rules and bound outputs first (only authenticated input updates from other nodes),
+    // then run callback
+    if(Domotic::DIR_IN==d && _isSigned && _remoteIP!=WiFi.localIP())
+      applyGroup(t, group, val);
+    processNotification(d, t, group, val, len-offset, offset);
+  } else if(len-offset>=14 && _lastpkt[offset]=='U' && _lastpkt[offset+1]=='T') { // Time update (usually signed)
+    offset+=2; // Skip 'UT'
+    uint8_t epoch;
+    uint32_t tstamp;
+    int8_t tz=0;
+    bool dst=false;
+    uint8_t b;
+
+    if(hex2uint8(_lastpkt+offset, &epoch)) return;
+    // epoch is currently fixed at 0
+    if(0!=epoch) return;
+    offset+=2;
+
+    if(hex2uint8(_lastpkt+offset, &b)) return;
+    tstamp=b;
+    offset+=2;
+    if(hex2uint8(_lastpkt+offset, &b)) return;
+    tstamp=(tstamp<<8)+b;
+    offset+=2;
+    if(hex2uint8(_lastpkt+offset, &b)) return;
+    tstamp=(tstamp<<8)+b;
+    offset+=2;
+    if(hex2uint8(_lastpkt+offset, &b)) return;
+    tstamp=(tstamp<<8)+b;
+    offset+=2;
+
+    if(2<hex2uint8(_lastpkt+offset, &b)) return;
+    tz=(b&0x1F) | ((b&0x10)?0xF0:0); // theoretically from -16 to +15, actually from -12 to +12
+    dst=b&0x20;
+    offset+=2;
+
+    // rcv was taken before verifying the signature (~900ms): the clock accounts for that
+    if(_clock.update(rcv, (uint64_t)tstamp*1000, tz, dst, _isSigned))
+      tstamp+=(millis()-rcv+500)/1000; // Ignored by the clock: round elapsed time to 1s
+    else
+      tstamp=_clock.now()/1000;
+    processTimeUpdate(epoch, tstamp, tz, dst);
+  }
+}
+
+/*
+ * MACPkt := <'M'> <keyID:WordHex> <mac:b64> <counter:DWordHex> <msg>
+ * Same layout of SignedPkt, with a truncated HMAC-SHA512 of the sender's IPv4 address followed by msg instead of the
+ * signature: a key can be shared by many nodes, each one counting on its own
+ */
+bool Domotic::verifyMAC(int &offset, int len)
+{
+  int redo=0;
+
+  ++offset; // Skip 'M'
+  verifySig(offset, len, true);
+  KeySlot *k=_signKey?_keys.find(_signKey):NULL;
+  if(!k || KeySlot::KEY_HMAC!=k->getType()) {
+    // Slow keys must not be accepted here: full check is done immediately
+    _signKey=0;
+    return true;
+  }
+  verifySig(redo, len, false);
+  return !_isSigned;
+}
+
+// The key exchange is anonymous: encryption alone keeps the request private, not its sender trusted.
+// HMAC keys can be shared by a group of nodes, so any of them could have MAC'd it
+bool Domotic::fromController()
+{
+  KeySlot *k=_isSigned?_keys.find(_signKey):NULL;
+
+  return _encSession && k && KeySlot::KEY_ED25519==k->getType();
+}
+
+void Domotic::handleMAC(int offset, int len)
+{
+  if(verifyMAC(offset, len)) {
+    answer(Domotic::ERR_CTX, 0);
+    return;
+  }
+  handleRequest(offset, len);
+  _isSigned=false;
+}
+
+void Domotic::handleSigned(int offset, int len)
+{
+  // Full check takes a while: handleCrypto() will complete the request when done
+  if(_verifying) {
+    answer(Domotic::ERR_BUSY, 0);
+    return;
+  }
+  ++offset;
+  verifySig(offset, len, true);	// Only parse keyID and signature
+  if(!_signKey || startVerify(offset, len)) {
+    answer(Domotic::ERR_CTX, 0);
+  }
+}
+
+/*
+ * EncryptedPkt := <'E'> {KeyExchange | <session:WordHex> <counter:DWordHex> <ciphertext:b64>}
+ *   KeyExchange := <'K'> <keyID:WordHex> <peer ephemeral pubkey:b64>
+ * keyID selects a Curve25519 key of the node (listed in register 0x01). The answer is not encrypted:
+ *   <session:WordHex> <node ephemeral pubkey:b64>
+ * Session keys are derived as described in SessionCache::establish()
+ * The ciphertext is ChaCha20-Poly1305 (tag appended) of a signed or simple packet, with the header
+ * ('E', session and counter, as sent) as associated data. Counters must increase for every packet in the session.
+ * The answer is an EncryptedPkt with the same session and counter, encrypted with the node-to-peer key.
+ */
+void Domotic::handleEncrypted(int offset, int len)
+{
+  int start=offset;
+  uint16_t id;
+
+  ++offset; // Skip 'E'
+  if('K'==_lastpkt[offset]) {
+    ++offset;
+    int from=offset+4;
+    if(len-offset<4+44 || hex2uint16(_lastpkt+offset, &id) || b64dec(from, 32)) {
+      answer(Domotic::ERR_CTX, 0);
+      return;
+    }
+    KeySlot *k=_keys.find(id);
+    if(!k || !k->getCaps().keyexch) {
+      answer(Domotic::ERR_CTX, 0);
+      return;
     }
+    uint8_t peerEph[32], ephPriv[32], ephPub[32];
+    memcpy(peerEph, _lastpkt+offset+4, sizeof(peerEph));
+    _ephemeral.take(ephPub, ephPriv);
+    SessionCache::Session *s=_sessions.establish(_remoteIP, k, peerEph, ephPriv, ephPub);
+    clean(ephPriv);
+    if(!s) {
+      answer(Domotic::ERR_CTX, 0);
+      return;
+    }
+    len=sprintf((char *)_lastpkt, "%04X", s->id);
+    from=len;
+    memcpy(_lastpkt+len, ephPub, sizeof(ephPub));
+    b64enc(from, sizeof(ephPub));
+    len+=from;
+    answer(Domotic::ERR_OK, len, 0);
+    return;
+  }
+
+  // Parse header: session and counter
+  uint32_t ctr=0;
+  if(len-offset<4+8+24 || hex2uint16(_lastpkt+offset, &id)) {
+    answer(Domotic::ERR_CTX, 0);
+    return;
+  }
+  offset+=4;
+  for(int t=0; t<4; ++t, offset+=2) {
+    uint8_t b;
+    if(hex2uint8(_lastpkt+offset, &b)) {
+      answer(Domotic::ERR_CTX, 0);
+      return;
+    }
+    ctr=(ctr<<8)|b;
+  }
+  SessionCache::Session *s=_sessions.find(id, _remoteIP);
+
+  // Decode and decrypt in place: plaintext replaces the base64 data
+  size_t blen=(len-offset)/4*3;
+  if('='==_lastpkt[len-1]) --blen;
+  if('='==_lastpkt[len-2]) --blen;
+  int from=offset;
+  if(!s || (len-offset)%4 || blen<=SessionCache::TAG_SIZE || b64dec(from, blen)
+      || _sessions.open(s, ctr, _lastpkt+start, offset-start, _lastpkt+offset, blen-SessionCache::TAG_SIZE)) {
+    answer(Domotic::ERR_CTX, 0); // Peer must redo key exchange if session is unknown
+    return;
+  }
+  len=offset+blen-SessionCache::TAG_SIZE;
+  _lastpkt[len]=0;
+
+  // From now on answers are encrypted
+  _encSession=id;
+  _encCtr=ctr;
+  if(_lastpkt[offset]==PKT_SIG)
+    handleSigned(offset, len);
+  else if(_lastpkt[offset]==PKT_MAC)
+    handleMAC(offset, len);
+  else
+    handleRequest(offset, len);
+  _encSession=0;
+}
+
+// offset points to the SimplePkt in _lastpkt (past signature and encryption headers, if any)
+void Domotic::handleRequest(int offset, int len)
+{
+  Domotic::DomError err=Domotic::ERR_UNKNOWN;
+
+  // SimplePkt can be encrypted and/or signed
+  switch(_lastpkt[offset]) {
+    case Domotic::DomPktType::PKT_CMD:
+      ++offset; --len;
+      err=processCommand(offset, len);
+      break;
+    case Domotic::DomPktType::PKT_INF:
+      ++offset; --len;
+      err=processInfo(offset, len);
+      break;
+    case Domotic::PKT_ANS:
+    case Domotic::PKT_UPD:
+    case Domotic::PKT_ENC:
+    case Domotic::PKT_SIG:
+      err=Domotic::ERR_CTX;
+      len=0;
+      break;
   }
+//Serial.printf("Ans: '%s'\n", (char*)_lastpkt+offset);
+  // Send answer
+  answer(err, len, offset);
 }
 
 Domotic::DomError Domotic::processCommand(int &offset, int &len)
@@ -333,6 +634,7 @@ Domotic::DomError Domotic::processCommand(int &offset, int &len)
       AnalogOutSpec := <'A'> <input#:ByteHex> <value:WordHex>
         WordHex := <hibyte:ByteHex> <lobyte:ByteHex>
       RegisterSpec := <'R'> <reg#:ByteHex> <0x20-0x7f>* // Till end of line or end of packet; register-specific parsing required
+        Array registers are written by element: <first:ByteHex> <value> {<';'> <value>}* sets consecutive elements (see writeRegister())
 Answers:
   CD: <'W'> <'D'> <'0'|'1'>
   CA: <'W'> <'A'>
@@ -340,7 +642,6 @@ Answers:
 */
   char type=_lastpkt[offset++];
 
-#warning "Could be a problem with delayed verification of signatures?"
   _lastpkt[0]='W'; // Overwrites received packet (only already-parsed part)
   _lastpkt[1]=type; // In unsecure packets simply overwites that byte with its current contents
 
@@ -353,6 +654,10 @@ Answers:
 
   switch(type) {
     case 'D': {
+      if('D'==_lastpkt[offset+1] || 'P'==_lastpkt[offset+1])
+        return delayDigitalOut(obj, offset, len);
+      if(obj<DOMOTIC_MAX_DELAYED)
+        _wheel.stop(TimerTable::MAX_TIMERS+obj); // Explicit write wins over a pending one
       bool v='1'==_lastpkt[offset];
       // Handle "toggle" state
       if('T'==_lastpkt[offset]) {
@@ -375,14 +680,341 @@ Answers:
       return writeAnalogOut(obj, v);
     }; break;
     case 'R': {
-      return DomError::ERR_UNSUPP;
-#warning "incomplete!"
+      Register reg;
+      if(findRegister(obj, reg) || !reg.write)
+        return DomError::ERR_UNSUPP;
+      DomError e=writeRegister(reg, offset);
+      if(DomError::ERR_OK==e) {
+        offset=0; len=2; // "WR"
+      }
+      return e;
     }; break;
   }
   // Unsupported command
   return Domotic::DomError::ERR_CMD_UNS;
 };
 
+/*
+ * Symmetric keys are handed out by the controller, only inside encrypted packets signed with an Ed25519 key:
+ *  CR01 <keyID:WordHex> <'H'> <secret:b64>  add (or replace) an HMAC key
+ *  CR01 <keyID:WordHex> <'-'>               remove an HMAC key
+ * Other key types can't be changed remotely. The keystore is saved immediately.
+ */
+Domotic::DomError Domotic::writeKey(uint8_t reg, uint8_t idx, int &offset)
+{
+  uint16_t id;
+  char op;
+
+  if(!fromController())
+    return DomError::ERR_CTX;
+  if(hex2uint16(_lastpkt+offset, &id))
+    return DomError::ERR_CMD_BAD;
+  offset+=4;
+  op=_lastpkt[offset++];
+
+  KeySlot *old=_keys.find(id);
+  if(old && KeySlot::KEY_HMAC!=old->getType())
+    return DomError::ERR_CMD_RANGE;
+
+  if('-'==op) {
+    if(_keys.remove(id))
+      return DomError::ERR_CMD_RANGE;
+  } else if('H'==op) {
+    int from=offset;
+    if(strlen((const char *)_lastpkt+offset)<44 || b64dec(from, 32))
+      return DomError::ERR_CMD_BAD;
+    KeySlot *k=KeySlot::initialize(KeySlot::KEY_HMAC, id, _lastpkt+offset, 32);
+    clean(_lastpkt+offset, 32);
+    _keys.remove(id);
+    if(_keys.add(k))
+      return DomError::ERR_CMD_RANGE; // Keystore full
+  } else {
+    return DomError::ERR_CMD_BAD;
+  }
+  _replay.forget(id); // A new secret could restart counting
+  _verified.forget(id);
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+bool Domotic::saveKeys()
+{
+  configChanged();
+  return _keys.save();
+}
+
+/*
+ * Local rules: CR24 <slot:ByteHex> {Rule | <'-'>}
+ *  Rule := <'L'|'G'> <src:WordHex> <'R'|'F'|'B'> <'0'|'1'|'T'|'P'> <out:ByteHex> [<pulse ms:WordHex>]
+ * 'L' matches a local digital input line, 'G' a digital input group: local inputs mapped to it, or
+ * authenticated (signed or MAC'd) updates from other nodes. Signed updates are applied once their signature is
+ * verified (about a second later on ESP8266), or not at all if they arrive while another one is being verified.
+ * On a rising, falling or any edge, the local digital output out is switched off, on, toggled or pulsed on for
+ * the given ms, or timer out is (re)started.
+ * '-' clears the slot.
+ * Rules are evaluated as soon as notify() reports an input, before the update is sent.
+ */
+Domotic::DomError Domotic::writeRule(uint8_t reg, uint8_t slot, int &offset)
+{
+  RuleTable::Rule r;
+
+  if('-'==_lastpkt[offset]) {
+    _rules.set(slot, NULL);
+    ++offset;
+  } else {
+    if(RuleTable::parse(_lastpkt+offset, r))
+      return DomError::ERR_CMD_BAD;
+    if(RuleTable::ACT_TIMER==r.action?r.out>=TimerTable::MAX_TIMERS:r.out>=_douts)
+      return DomError::ERR_CMD_RANGE;
+    if(RuleTable::ACT_PULSE==r.action && r.out>=DOMOTIC_MAX_DELAYED)
+      return DomError::ERR_CMD_RANGE;
+    _rules.set(slot, &r);
+    offset+=RuleTable::ACT_PULSE==r.action?13:9;
+  }
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+bool Domotic::saveRules()
+{
+  indexGroups();
+  configChanged();
+  return _rules.save();
+}
+
+void Domotic::applyRules(uint8_t source, uint16_t src, bool value)
+{
+  uint8_t slots[RuleTable::MAX_RULES];
+  int n=_rules.match(source, src, value, slots, RuleTable::MAX_RULES);
+
+  for(int t=0; t<n; ++t) {
+    const RuleTable::Rule *r=_rules.at(slots[t]);
+    switch(r->action) {
+      case RuleTable::ACT_TIMER:
+        startTimer(r->out);
+        break;
+      case RuleTable::ACT_PULSE:
+        runAction(r->out, TimerTable::ACT_ON);
+        _delayed[r->out]=TimerTable::ACT_OFF;
+        _wheel.start(TimerTable::MAX_TIMERS+r->out, r->pulse);
+        break;
+      default: // Same chars as timer actions
+        runAction(r->out, r->action);
+    }
+  }
+}
+
+void Domotic::indexGroups()
+{
+  _groups.clear();
+  for(int t=0; t<_douts; ++t)
+    if(_doutMap && _doutMap[t])
+      _groups.add(_doutMap[t], GroupIndex::KIND_DOUT, t);
+  for(int t=0; t<_aouts; ++t)
+    if(_aoutMap && _aoutMap[t])
+      _groups.add(_aoutMap[t], GroupIndex::KIND_AOUT, t);
+  for(int t=0; t<RuleTable::MAX_RULES; ++t) {
+    const RuleTable::Rule *r=_rules.at(t);
+    if(r && RuleTable::SRC_GROUP==r->source)
+      _groups.add(r->src, GroupIndex::KIND_RULE);
+  }
+  for(int t=0; t<MAX_SUBS; ++t)
+    if(_subs[t])
+      _groups.add(_subs[t], GroupIndex::KIND_SUB);
+  _groups.sort();
+}
+
+bool Domotic::subscribe(uint16_t group)
+{
+  int free=-1;
+
+  if(!group)
+    return true;
+  for(int t=0; t<MAX_SUBS; ++t) {
+    if(group==_subs[t])
+      return false;
+    if(!_subs[t] && free<0)
+      free=t;
+  }
+  if(free<0)
+    return true;
+  _subs[free]=group;
+  indexGroups();
+  return false;
+}
+
+void Domotic::unsubscribe(uint16_t group)
+{
+  for(int t=0; t<MAX_SUBS; ++t)
+    if(group==_subs[t])
+      _subs[t]=0;
+  indexGroups();
+}
+
+// Group rules, then outputs bound to group follow its value
+void Domotic::applyGroup(UpdType t, uint16_t group, uint16_t val)
+{
+  if(Domotic::TYPE_DIGITAL==t)
+    applyRules(RuleTable::SRC_GROUP, group, val);
+  for(int i=_groups.find(group); i>=0 && i<_groups.count() && _groups.at(i).group==group; ++i) {
+    const GroupIndex::Entry &e=_groups.at(i);
+    if(GroupIndex::KIND_DOUT==e.kind && Domotic::TYPE_DIGITAL==t) {
+      if(DomError::ERR_OK==writeDigitalOut(e.line, val))
+        notify(Domotic::DIR_OUT, Domotic::TYPE_DIGITAL, e.line);
+    } else if(GroupIndex::KIND_AOUT==e.kind && Domotic::TYPE_ANALOG==t) {
+      if(DomError::ERR_OK==writeAnalogOut(e.line, val))
+        notify(Domotic::DIR_OUT, Domotic::TYPE_ANALOG, e.line);
+    }
+  }
+}
+
+/*
+ * Timer actions: CR25 <timer:ByteHex> {<out:ByteHex> <start> <expire> | <'-'> | <'S'> | <'X'>}
+ * start and expire are '0', '1', 'T' or '-' (nothing): what to do on digital output out when the timer is
+ * (re)started and when it expires. '-' clears the actions, 'S' (re)starts the timer and 'X' stops it.
+ * F.e. staircase lights: "051 0" restarted by a rule; pulsed irrigation: astable interval and "07-T".
+ */
+Domotic::DomError Domotic::writeTimer(uint8_t reg, uint8_t slot, int &offset)
+{
+  TimerTable::Timer t=*_timers.at(slot);
+  switch(_lastpkt[offset]) {
+    case 'S':
+      if(startTimer(slot))
+        return DomError::ERR_CTX; // No interval
+      ++offset;
+      return DomError::ERR_OK;
+    case 'X':
+      _wheel.stop(slot);
+      ++offset;
+      return DomError::ERR_OK;
+    case '-':
+      t.out=0;
+      t.start=t.expire=TimerTable::ACT_NONE;
+      ++offset;
+      break;
+    default:
+      if(TimerTable::parse(_lastpkt+offset, t))
+        return DomError::ERR_CMD_BAD;
+      if(t.out>=_douts)
+        return DomError::ERR_CMD_RANGE;
+      offset+=4;
+  }
+  _timers.set(slot, &t);
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+/*
+ * Timer intervals: CR26 <timer:ByteHex> <interval:WordHex> (see REGISTERS)
+ * A running timer keeps its current expiration; interval 0 stops it
+ */
+Domotic::DomError Domotic::writeInterval(uint8_t reg, uint8_t slot, int &offset)
+{
+  uint16_t interval;
+
+  if(hex2uint16(_lastpkt+offset, &interval) || (interval&TimerTable::INT_RESERVED))
+    return DomError::ERR_CMD_BAD;
+  offset+=4;
+
+  TimerTable::Timer t=*_timers.at(slot);
+  t.interval=interval;
+  _timers.set(slot, &t);
+  if(!TimerTable::ms(interval))
+    _wheel.stop(slot);
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+bool Domotic::saveTimers()
+{
+  configChanged();
+  return _timers.save();
+}
+
+/*
+ * CD <out:ByteHex> <'0'|'1'|'T'> <'D'|'P'> <interval:WordHex>
+ * 'D' writes the output after interval, 'P' writes it now and reverts it after interval (toggles it back for 'T').
+ * interval is encoded as in register 0x26 (the astable bit is ignored). Answer is "WD" followed by the
+ * value written now ('P') or by the delayed action ('D').
+ */
+Domotic::DomError Domotic::delayDigitalOut(uint8_t obj, int &offset, int &len)
+{
+  uint8_t act=_lastpkt[offset];
+  bool pulse='P'==_lastpkt[offset+1];
+  uint16_t interval;
+
+  if(TimerTable::ACT_OFF!=act && TimerTable::ACT_ON!=act && TimerTable::ACT_TOGGLE!=act)
+    return DomError::ERR_CMD_BAD;
+  if(hex2uint16(_lastpkt+offset+2, &interval) || !TimerTable::ms(interval&~TimerTable::INT_ASTABLE))
+    return DomError::ERR_CMD_BAD;
+  if(obj>=_douts || obj>=DOMOTIC_MAX_DELAYED)
+    return DomError::ERR_CMD_RANGE;
+
+  if(pulse) {
+    bool v=TimerTable::ACT_ON==act;
+    if(TimerTable::ACT_TOGGLE==act) {
+      readDigitalOut(obj, v); // Read current state
+      v=!v; // Toggle it
+    }
+    DomError e=writeDigitalOut(obj, v);
+    if(DomError::ERR_OK!=e)
+      return e;
+    _delayed[obj]=TimerTable::ACT_TOGGLE==act?TimerTable::ACT_TOGGLE:(v?TimerTable::ACT_OFF:TimerTable::ACT_ON);
+    _lastpkt[2]=v?'1':'0';
+  } else {
+    _delayed[obj]=act;
+    _lastpkt[2]=act;
+  }
+  _wheel.start(TimerTable::MAX_TIMERS+obj, TimerTable::ms(interval&~TimerTable::INT_ASTABLE));
+
+  offset=0; len=3;
+  return DomError::ERR_OK;
+}
+
+bool Domotic::startTimer(uint8_t t)
+{
+  const TimerTable::Timer *timer=_timers.at(t);
+  uint64_t ms=timer?TimerTable::ms(timer->interval):0;
+
+  if(!ms)
+    return true;
+  _wheel.start(t, ms);
+  runAction(timer->out, timer->start);
+  return false;
+}
+
+void Domotic::runAction(uint8_t out, uint8_t action)
+{
+  bool v=TimerTable::ACT_ON==action;
+
+  if(TimerTable::ACT_OFF!=action && TimerTable::ACT_ON!=action && TimerTable::ACT_TOGGLE!=action)
+    return;
+  if(TimerTable::ACT_TOGGLE==action) {
+    readDigitalOut(out, v);
+    v=!v;
+  }
+  if(DomError::ERR_OK==writeDigitalOut(out, v))
+    notify(Domotic::DIR_OUT, Domotic::TYPE_DIGITAL, out);
+}
+
+void Domotic::handleTimers()
+{
+  uint16_t id;
+
+  // Constant time per elapsed ms, however many timers are running
+  while(TimerWheel::NONE!=(id=_wheel.poll(millis()))) {
+    if(id>=TimerTable::MAX_TIMERS) {
+      runAction(id-TimerTable::MAX_TIMERS, _delayed[id-TimerTable::MAX_TIMERS]);
+      continue;
+    }
+    const TimerTable::Timer *t=_timers.at(id);
+    uint64_t ms=TimerTable::ms(t->interval);
+    if((t->interval&TimerTable::INT_ASTABLE) && ms)
+      _wheel.start(id, ms, true); // Next period starts at this expiration
+    runAction(t->out, t->expire);
+  }
+}
+
 Domotic::DomError Domotic::writeDigitalOut(uint8_t obj, bool val)
 {
   Domotic::DomError e=DomError::ERR_CMD_RANGE;
@@ -408,6 +1040,8 @@ Domotic::DomError Domotic::writeDigitalOut(uint8_t obj, bool val)
       }
     }
   }
+  if(DomError::ERR_OK==e)
+    outputsChanged();
   return e;
 }
 
@@ -436,6 +1070,8 @@ Domotic::DomError Domotic::writeAnalogOut(uint8_t obj, uint16_t val)
       }
     }
   }
+  if(DomError::ERR_OK==e)
+    outputsChanged();
   return e;
 };
 
@@ -511,8 +1147,8 @@ Domotic::DomError Domotic::readDigitalOut(uint8_t obj, bool &val)
     // Scan expansions
     for(uint8_t addr=0; addr<Domotic::MAX_EXPS; ++addr) {
       if(_exps[addr]) {
-        if(obj<_exps[addr]->douts()) {
-          val=_exps[addr]->dout(obj);
+        if(o<_exps[addr]->douts()) {
+          val=_exps[addr]->dout(o);
           e=Domotic::DomError::ERR_OK;
           break;
         }
@@ -526,7 +1162,7 @@ Domotic::DomError Domotic::readDigitalOut(uint8_t obj, bool &val)
 Domotic::DomError Domotic::readDigitalIn(uint8_t obj, bool &val)
 {
   Domotic::DomError e=DomError::ERR_CMD_RANGE;
-  if(_ains<obj) return e;
+  if(_dins<obj) return e;
 
   if(obj<dins()) {
     val=din(obj);
@@ -536,8 +1172,8 @@ Domotic::DomError Domotic::readDigitalIn(uint8_t obj, bool &val)
     uint8_t o=obj-dins();
     for(uint8_t addr=0; addr<Domotic::MAX_EXPS; ++addr) {
       if(_exps[addr]) {
-        if(obj<_exps[addr]->dins()) {
-          val=_exps[addr]->din(obj);
+        if(o<_exps[addr]->dins()) {
+          val=_exps[addr]->din(o);
           e=Domotic::DomError::ERR_OK;
           break;
         }
@@ -682,14 +1318,14 @@ Domotic::DomError Domotic::processInfo(int &offset, int &len)
       DigitalReadSpec := <'D'> <'I'|'O'> <io#:ByteHex>
       AnalogReadSpec := <'A'> <'I'|'O'> <io#:ByteHex>
       InfoSpec := <'I'> <'A'|'D'> <'I'|'O'> <io#:ByteHex>
-      RegisterReadSpec := <'R'> <reg#:ByteHex> [<arrayelement#:ByteHex>]
+      RegisterReadSpec := <'R'> <reg#:ByteHex> [<arrayelement#:ByteHex> [<lastelement#:ByteHex>]]
 
 The first character ('I') is already parsed, so offset is *at least* 1, but it could be bigger if the packet is encrypted and/or signed.
 
 Answers:
   ID: <'R'> <'D'> <'0'|'1'>
   IA: <'R'> <'A'> <value#:WordHex>
-  IR: <'R'> <'R'> {<'L'> <len:ByteHex> | <'V'> <0x20-0x7f>*}
+  IR: <'R'> <'R'> {<'L'> <len:ByteHex> | <'V'> <0x20-0x7f>* | <'M'> <first:ByteHex> <0x20-0x7f>* {<';'> <0x20-0x7f>*}*}
   II: <'R'> <'I'> {InfoBool | InfoPercent | InfoTemp | InfoPower | InfoUserFloat | InfoText} <descr:<0x20-0x7f>*>
     InfoBool := <'B'>                                                   // Used for digital lines
     InfoPercent := <'%'> <decimals:0-3>
@@ -703,6 +1339,7 @@ Answers:
   char type, dir;
   DomError r=DomError::ERR_OK;
   uint8_t obj=0;
+  uint32_t cached=0;	// InfoCache key of a static answer
 
   _lastpkt[0]='R'; // Overwrites received packet (only already-parsed part)
   _lastpkt[1]=act; // In unsecure packets simply overwites that byte with its current contents
@@ -771,6 +1408,11 @@ Answers:
       if(Domotic::hex2uint8(_lastpkt+offset, &obj)) {
         return DomError::ERR_INF_BAD; // no hex chars where expected
       }
+      cached=InfoCache::key(act, type, dir, obj);
+      if(!_info.get(cached, _lastpkt, len)) {
+        cached=0; // Already there
+        break;
+      }
 
       if(UpdTypeC::TYPEC_ANALOG==type) {
         if(Domotic::UpdDirC::DIRC_IN==dir) {
@@ -790,149 +1432,33 @@ Answers:
         }
       }
       break;
-    case 'R': // Read register
+    case 'R': // Read register (see REGISTERS)
+      {
+      Register reg;
       if(Domotic::hex2uint8(_lastpkt+offset, &obj)) {
         return Domotic::DomError::ERR_INF_BAD; // no hex chars where expected
       }
-      switch(obj) {
-        case 0x00: // Version & node info
-          _lastpkt[2]='V';
-          len=3;
-          len+=sprintf((char *)(_lastpkt+len),
-            PROTOVERSION " %d %d %d %d %d %c", _douts, _dins, _aouts, _ains, _tlen, _utf?'T':'F');
-          break;
-        case 0x01: // Node keys and supported algorithms
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", 0); // @@@ TODO: get keyslot counter
-          } else {
-            _lastpkt[2]='V';
-            len=3;
-            return ERR_INF_RANGE; // @@@ TODO: get keyslot info
-          }
-          }
-          break;
-        case 0x02: // Hostname
-          _lastpkt[2]='V';
-          len=3;
-          len+=sprintf((char *)(_lastpkt+len), "%.32s (%s %s)", WiFi.hostname().c_str(), __DATE__, __TIME__);
-          break;
-        case 0x03: // Flags (RESERVED)
-          _lastpkt[2]='V';
-          len=3;
-          len+=sprintf((char *)(_lastpkt+len), "%04X", 0x0000);
-          break;
-        case 0x04: // network info, string, write: "WIFI:SSID,password[,ip,mask]" (encrypted); read: "WIFI:SSID,ip"; write: "ETH:DHCP|ip,mask", read: "ETH:ip"; write/read: "BUS:nodeID" (bus must be on a different port than config interface)
-          _lastpkt[2]='V';
-          len=3;
-          len+=sprintf((char *)(_lastpkt+len), "WIFI:%s,%s", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
-          break;
-        case 0x05: // display message, string, max max_txt_len (from R0) printable-ASCII characters (0x20-0x7e) for message
-          _lastpkt[2]='V';
-          len=3;
-          //len+=sprintf((char *)(_lastpkt+offset), "%s", ???); // @@@ TODO
-          break;
-        case 0x20: // digital out port map
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", _douts);
-          } else {
-            if(r<_douts) {
-              _lastpkt[2]='V';
-              len=3;
-              len+=sprintf((char*)_lastpkt+len, "%04X", _doutMap[r]);
-            } else {
-              return DomError::ERR_INF_RANGE;
-            }
-          }
-          }
-          break;
-        case 0x21: // analog out port map
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", _aouts);
-          } else {
-            if(r<_aouts) {
-              _lastpkt[2]='V';
-              len=3;
-              len+=sprintf((char*)(_lastpkt+len), "%04X", _aoutMap[r]);
-            } else {
-              return DomError::ERR_INF_RANGE;
-            }
-          }
-          }
-          break;
-        case 0x22: // digital in port map
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", _dins);
-          } else {
-            if(r<_dins) {
-              _lastpkt[2]='V';
-              len=3;
-              len+=sprintf((char*)(_lastpkt+len), "%04X", _dinMap[r]);
-            } else {
-              return DomError::ERR_INF_RANGE;
-            }
-          }
-          }
-          break;
-        case 0x23: // analog in port map
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", _ains);
-          } else {
-            if(r<_ains) {
-              _lastpkt[2]='V';
-              len=3;
-              len+=sprintf((char*)(_lastpkt+len), "%04X", _ainMap[r]);
-            } else {
-              return DomError::ERR_INF_RANGE;
-            }
-          }
-          }
-          break;
-/*
-        case 0x2: //
-          {
-          uint8_t r;
-          if(Domotic::hex2uint8(_lastpkt+offset+2, &r)) { // Missing optional param: read array len
-            _lastpkt[2]='L';
-            len=3;
-            len+=sprintf((char*)(_lastpkt+len), "%02X", _douts);
-          } else {
-            if(r<_douts) {
-              _lastpkt[2]='V';
-              len=3;
-              len+=sprintf((char*)(_lastpkt+len), "%04X", _doutMap[r]);
-            } else {
-              return DomError::ERR_INF_RANGE;
-            }
-          }
-          }
+      offset+=2;
+      if(findRegister(obj, reg) || !reg.read) {
+        len=0;
+        return ERR_INF_RANGE;
+      }
+      if(reg.flags&REG_STATIC) {
+        // Static (but slow: String allocations, sprintf) until the configuration or the address change
+        if(_infoIP!=WiFi.localIP()) {
+          _info.clear();
+          _infoIP=WiFi.localIP();
+        }
+        cached=InfoCache::key(act, obj);
+        if(!_info.get(cached, _lastpkt, len)) {
+          cached=0;
           break;
-24: (Array<Event>) events
-25: (Array<?>) timer actions TODO
-26: (Array<WordHex>) timers intervals; most significant nibble is: 0=Monostable|1=Astable, 00=milliseconds, 01=seconds, 10=minutes, 11=hours, 0=RESERVED; the remaining 12 bits define the actual interval
-*/
-        default:
-          len=0;
-          return ERR_INF_RANGE;
+        }
+      }
+      r=readRegister(reg, offset, len);
+      if(DomError::ERR_OK!=r) {
+        return r;
+      }
       }
       break;
     default:
@@ -941,41 +1467,739 @@ Answers:
   }
   _lastpkt[len]=0; // terminate string
   offset=0; // All answers start at the beginning of _lastpkt
+  if(cached && DomError::ERR_OK==r) {
+    _info.put(cached, _lastpkt, len);
+  }
   return ERR_OK;
 }
 
-bool Domotic::sigBuff(char* buff, uint16_t keyID)
+/*
+ * Registers, sorted by id (see findRegister())
+ *  0x00 version & node info: "<protocol> <douts> <dins> <aouts> <ains> <max text len> <'T'|'F'>" (UTF-8 text)
+ *  0x01 node keys and supported algorithms: "<id:WordHex> <algo> <caps> <pubkey:b64>" (see writeKey())
+ *  0x02 hostname and firmware build date
+ *  0x03 flags (RESERVED)
+ *  0x04 network info, read: "WIFI:SSID,ip" (see writeNetwork())
+ *  0x05 display message, at most max text len (from 0x00) printable-ASCII characters (0x20-0x7e)
+ *  0x06 configuration generation: grows whenever maps, restore policies, names, keys, rules or timers change (also across reboots)
+ *  0x20-0x23 digital out, analog out, digital in and analog in port maps: group of each line
+ *  0x24 rules (see writeRule())
+ *  0x25 timer actions (see writeTimer())
+ *  0x26 timer intervals; most significant nibble is: 0=Monostable|1=Astable, 00=milliseconds, 01=seconds, 10=minutes, 11=hours, 0=RESERVED; the remaining 12 bits define the actual interval
+ *  0x27 update journal: "<last:WordHex><oldest:WordHex>", or events after the given seq (see UpdateJournal::since())
+ *  0x28 unicast subscribers: "<ip> <port:WordHex> <mask:ByteHex> <from:WordHex> <to:WordHex> <lease left s:WordHex>" or "-" (see writeUSub())
+ *  0x29-0x2A digital and analog out restore policies: what begin() does with each line (see restoreOutputs())
+ */
+const Domotic::Register Domotic::REGISTERS[] PROGMEM = {
+  { 0x00, REG_STATIC, NULL, &Domotic::readNodeInfo, NULL, NULL },
+  { 0x01, REG_ARRAY|REG_RAW, &Domotic::keyCount, &Domotic::readKey, &Domotic::writeKey, &Domotic::saveKeys },
+  { 0x02, REG_STATIC, NULL, &Domotic::readHostname, NULL, NULL },
+  { 0x03, 0, NULL, &Domotic::readFlags, NULL, NULL },
+  { 0x04, REG_STATIC, NULL, &Domotic::readNetwork, &Domotic::writeNetwork, NULL },
+  { 0x05, 0, NULL, &Domotic::readDisplay, &Domotic::writeDisplay, NULL },
+  { 0x06, 0, NULL, &Domotic::readConfigGen, NULL, NULL },
+  { 0x20, REG_ARRAY, &Domotic::mapCount, &Domotic::readMap, &Domotic::writeMap, &Domotic::saveMaps },
+  { 0x21, REG_ARRAY, &Domotic::mapCount, &Domotic::readMap, &Domotic::writeMap, &Domotic::saveMaps },
+  { 0x22, REG_ARRAY, &Domotic::mapCount, &Domotic::readMap, &Domotic::writeMap, &Domotic::saveMaps },
+  { 0x23, REG_ARRAY, &Domotic::mapCount, &Domotic::readMap, &Domotic::writeMap, &Domotic::saveMaps },
+  { 0x24, REG_ARRAY, &Domotic::ruleCount, &Domotic::readRule, &Domotic::writeRule, &Domotic::saveRules },
+  { 0x25, REG_ARRAY, &Domotic::timerCount, &Domotic::readTimer, &Domotic::writeTimer, &Domotic::saveTimers },
+  { 0x26, REG_ARRAY, &Domotic::timerCount, &Domotic::readTimer, &Domotic::writeInterval, &Domotic::saveTimers },
+  { 0x27, 0, NULL, &Domotic::readJournal, NULL, NULL },
+  { 0x28, REG_ARRAY|REG_RAW, &Domotic::usubCount, &Domotic::readUSub, &Domotic::writeUSub, NULL },
+  { 0x29, REG_ARRAY, &Domotic::restoreCount, &Domotic::readRestore, &Domotic::writeRestore, &Domotic::saveRestore },
+  { 0x2A, REG_ARRAY, &Domotic::restoreCount, &Domotic::readRestore, &Domotic::writeRestore, &Domotic::saveRestore },
+};
+
+bool Domotic::findRegister(uint8_t id, Register &reg)
+{
+  int lo=0, hi=sizeof(REGISTERS)/sizeof(REGISTERS[0]);
+
+  while(lo<hi) {
+    int mid=(lo+hi)/2;
+    memcpy_P(&reg, REGISTERS+mid, sizeof(reg));
+    if(reg.id==id)
+      return false;
+    if(reg.id<id)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return true;
+}
+
+/*
+ * Array registers: no index reads the number of elements ('L'), an index reads one element ('V').
+ * A second index reads elements from the first to it ('M'): as many as fit in an answer, separated by ';'.
+ * The controller continues from the first element missing.
+ */
+Domotic::DomError Domotic::readRegister(const Register &reg, int offset, int &len)
 {
-  int len=strlen(buff);
-  int slen=128;
-#warning "@@@ TODO: get signature len from key type"
+  uint8_t first, last, n;
 
-  if(DOMOTIC_MAX_PKT_SIZE<(1+4+slen+len))
-    return true;
+  len=3;
+  if(!(reg.flags&REG_ARRAY)) {
+    _lastpkt[2]='V';
+    return (this->*reg.read)(reg.id, 0, offset, len);
+  }
+  n=(this->*reg.count)(reg.id);
+  if(Domotic::hex2uint8(_lastpkt+offset, &first)) { // Missing optional param: read array len
+    _lastpkt[2]='L';
+    len+=sprintf((char*)(_lastpkt+len), "%02X", n);
+    return DomError::ERR_OK;
+  }
+  offset+=2;
+  if(first>=n)
+    return DomError::ERR_INF_RANGE;
+  if(Domotic::hex2uint8(_lastpkt+offset, &last)) {
+    _lastpkt[2]='V';
+    return (this->*reg.read)(reg.id, first, offset, len);
+  }
+  offset+=2;
+  if(last<first)
+    return DomError::ERR_INF_BAD;
+  if(last>=n)
+    last=n-1;
+  _lastpkt[2]='M';
+  len+=sprintf((char*)(_lastpkt+len), "%02X", first);
+  for(int t=first; t<=last; ++t) {
+    int prev=len;
+    if(t>first)
+      _lastpkt[len++]=';';
+    DomError e=(this->*reg.read)(reg.id, t, offset, len);
+    if(DomError::ERR_OK!=e)
+      return e;
+    if(len>MAX_ANSWER && t>first) {
+      len=prev;
+      break;
+    }
+  }
+  return DomError::ERR_OK;
+}
 
-  memmove(buff+1+4+slen, buff, len);
-  buff[0]=Domotic::DomPktType::PKT_SIG;
-  sprintf(buff+1, "%04X", keyID);
-  for(int t=0; t<slen; ++t) buff[1+4+t]='0'; // @@@ TODO
+/*
+ * Array registers (but REG_RAW ones) are written by element: <first:ByteHex> <value> {<';'> <value>}*
+ * Values go to consecutive elements, in order: on error (including anything but ';' or the end after a value),
+ * the ones before stay written.
+ * The register is saved once, after the last value.
+ */
+Domotic::DomError Domotic::writeRegister(const Register &reg, int &offset)
+{
+  DomError e=DomError::ERR_OK;
 
-  return false;
+  _regChanged=false;
+  if(!(reg.flags&REG_ARRAY) || (reg.flags&REG_RAW)) {
+    e=(this->*reg.write)(reg.id, 0, offset);
+  } else {
+    uint8_t first;
+    int n=(this->*reg.count)(reg.id);
+
+    if(hex2uint8(_lastpkt+offset, &first))
+      return DomError::ERR_CMD_BAD;
+    offset+=2;
+    for(int t=first; ; ++t) {
+      if(t>=n) {
+        e=DomError::ERR_CMD_RANGE;
+        break;
+      }
+      e=(this->*reg.write)(reg.id, t, offset);
+      if(DomError::ERR_OK!=e)
+        break;
+      if(';'!=_lastpkt[offset]) {
+        if(_lastpkt[offset])
+          e=DomError::ERR_CMD_BAD; // Not a separator: the remaining values would be dropped silently
+        break;
+      }
+      ++offset;
+    }
+  }
+  if(_regChanged && reg.save && (this->*reg.save)() && DomError::ERR_OK==e)
+    e=DomError::ERR_UNKNOWN; // Active, but will be lost at reboot
+  return e;
 }
 
-void Domotic::verifySig(int &offset, int len, bool fast)
+Domotic::DomError Domotic::readNodeInfo(uint8_t reg, uint8_t idx, int arg, int &len)
 {
-//  Serial.printf("Verify (%s) off=%d\n", fast?"FAST":"full", offset);
-  uint8_t t;
-  int off=offset;
+  len+=sprintf((char *)(_lastpkt+len),
+    PROTOVERSION " %d %d %d %d %d %c", _douts, _dins, _aouts, _ains, _tlen, _utf?'T':'F');
+  return DomError::ERR_OK;
+}
 
-  _isSigned=false;
+Domotic::DomError Domotic::readKey(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  KeySlot *k=_keys.at(idx);
+  if(!k)
+    return DomError::ERR_INF_RANGE;
+
+  union KeySlot::cypherCaps caps=k->getCaps();
+  len+=sprintf((char*)(_lastpkt+len), "%04X %s %s%s%s ",
+    k->getID(), k->getDescr(),
+    caps.sign?"S":"", caps.verify?"V":"", caps.keyexch?"K":"");
+  // Public key is encoded in-place
+  int from=len;
+  memcpy(_lastpkt+len, k->getPublic(), 32);
+  if(b64enc(from, 32))
+    return DomError::ERR_UNKNOWN;
+  len+=from;
+  return DomError::ERR_OK;
+}
 
-  if(offset) {	// Fresh verification
-    //Serial.println(" Fresh");
-    // Parse _signKey
-    uint16_t tk=_signKey=0;
-    if(hex2uint8(_lastpkt+off, &t)) return; // Abort parsing
-    tk=t<<8;
-    off+=2;
+Domotic::DomError Domotic::readHostname(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  len+=sprintf((char *)(_lastpkt+len), "%.32s (%s %s)", WiFi.hostname().c_str(), __DATE__, __TIME__);
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readFlags(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  len+=sprintf((char *)(_lastpkt+len), "%04X", 0x0000);
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readNetwork(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  len+=sprintf((char *)(_lastpkt+len), "WIFI:%s,%s", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+  return DomError::ERR_OK;
+}
+
+// Dotted quad, up to the first character that is not part of it; returns true in case of error
+static bool parseIP(const uint8_t *txt, int &pos, IPAddress &ip)
+{
+  for(int t=0; t<4; ++t) {
+    int v=0, digits=0;
+    if(t && '.'!=txt[pos++])
+      return true;
+    while(txt[pos]>='0' && txt[pos]<='9' && digits<3) {
+      v=v*10+txt[pos++]-'0';
+      ++digits;
+    }
+    if(!digits || v>255)
+      return true;
+    ip[t]=v;
+  }
+  return false;
+}
+
+/*
+ * Network settings, only inside encrypted packets signed with an Ed25519 key: CR04 <'WIFI:'> <SSID> <','> <password> [<','> <ip> <','> <mask> [<','> <gateway>]]
+ * Without ip the address comes from DHCP; the default gateway is the first address of the subnet.
+ * The change is applied after the answer is sent (see handleNetConfig()): the node is then unreachable until
+ * it joins the new network. Credentials are kept by the WiFi library. "ETH:" and "BUS:" are not supported.
+ */
+Domotic::DomError Domotic::writeNetwork(uint8_t reg, uint8_t idx, int &offset)
+{
+  NetConfig &n=_netConfig;
+  const char *txt=(const char *)_lastpkt+offset;
+  const char *comma;
+  int pos;
+
+  if(!fromController())
+    return DomError::ERR_CTX;
+  if(strncmp(txt, "WIFI:", 5))
+    return DomError::ERR_UNSUPP;
+  txt+=5;
+  comma=strchr(txt, ',');
+  if(!comma)
+    return DomError::ERR_CMD_BAD;
+  if(comma==txt || comma-txt>=(int)sizeof(n.ssid))
+    return DomError::ERR_CMD_SIZE;
+  memcpy(n.ssid, txt, comma-txt);
+  n.ssid[comma-txt]=0;
+  txt=comma+1;
+  comma=strchr(txt, ',');
+  pos=comma?comma-txt:strlen(txt);
+  if(pos>=(int)sizeof(n.pass))
+    return DomError::ERR_CMD_SIZE;
+  memcpy(n.pass, txt, pos);
+  n.pass[pos]=0;
+
+  n.ip=n.mask=n.gw=IPAddress(0, 0, 0, 0);
+  if(comma) {
+    pos=comma+1-(const char *)_lastpkt;
+    if(parseIP(_lastpkt, pos, n.ip) || ','!=_lastpkt[pos++] || parseIP(_lastpkt, pos, n.mask))
+      return DomError::ERR_CMD_BAD;
+    if(','==_lastpkt[pos]) {
+      ++pos;
+      if(parseIP(_lastpkt, pos, n.gw))
+        return DomError::ERR_CMD_BAD;
+    } else {
+      for(int t=0; t<4; ++t)
+        n.gw[t]=n.ip[t]&n.mask[t];
+      n.gw[3]|=1;
+    }
+  }
+  clean(_lastpkt+offset, strlen((const char *)_lastpkt+offset));
+  n.pending=true;
+  n.at=millis();
+  return DomError::ERR_OK;
+}
+
+void Domotic::handleNetConfig()
+{
+  NetConfig &n=_netConfig;
+
+  if(!_initialized)
+    return;
+  if(n.pending && millis()-n.at>=100) {
+    n.pending=false;
+    WiFi.disconnect();
+    WiFi.config(n.ip, n.gw, n.mask);
+    WiFi.begin(n.ssid, n.pass);
+    clean((uint8_t *)n.pass, sizeof(n.pass));
+    _info.clear(); // Register 0x04 shows the SSID too, which can change while the address stays the same
+  }
+  // Group membership belongs to the interface address: join again when it changes
+  IPAddress ip=WiFi.localIP();
+  if((uint32_t)ip && ip!=_joinedIP) {
+    _udp->stop();
+    _udp->beginMulticast(ip, _mcastAddr, _port);
+    _joinedIP=ip;
+  }
+}
+
+Domotic::DomError Domotic::readDisplay(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  if(_display)
+    len+=sprintf((char *)(_lastpkt+len), "%s", _display);
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::writeDisplay(uint8_t reg, uint8_t idx, int &offset)
+{
+  int n=strlen((const char *)_lastpkt+offset);
+
+  if(!_display)
+    return DomError::ERR_UNSUPP;
+  if(n>_tlen)
+    return DomError::ERR_CMD_SIZE;
+  for(int t=0; t<n; ++t)
+    if(_lastpkt[offset+t]<0x20 || _lastpkt[offset+t]>0x7e)
+      return DomError::ERR_CMD_BAD;
+  memcpy(_display, _lastpkt+offset, n+1);
+  offset+=n;
+  processDisplay(_display);
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readConfigGen(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  len+=sprintf((char *)(_lastpkt+len), "%08X", _configGen);
+  return DomError::ERR_OK;
+}
+
+uint16_t *Domotic::map(uint8_t reg)
+{
+  switch(reg) {
+    case 0x20: return _doutMap;
+    case 0x21: return _aoutMap;
+    case 0x22: return _dinMap;
+    case 0x23: return _ainMap;
+  }
+  return NULL;
+}
+
+uint8_t Domotic::mapCount(uint8_t reg)
+{
+  switch(reg) {
+    case 0x20: return _douts;
+    case 0x21: return _aouts;
+    case 0x22: return _dins;
+    case 0x23: return _ains;
+  }
+  return 0;
+}
+
+Domotic::DomError Domotic::readMap(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  len+=sprintf((char*)(_lastpkt+len), "%04X", map(reg)[idx]);
+  return DomError::ERR_OK;
+}
+
+/*
+ * Port maps: CR2x <line:ByteHex> <group:WordHex> {<';'> <group:WordHex>}*
+ * Maps written by the controller replace the ones from initMaps() (also at next boot, as long as the lines don't change)
+ */
+Domotic::DomError Domotic::writeMap(uint8_t reg, uint8_t idx, int &offset)
+{
+  uint16_t group;
+
+  if(hex2uint16(_lastpkt+offset, &group))
+    return DomError::ERR_CMD_BAD;
+  offset+=4;
+  map(reg)[idx]=group;
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+/*
+ * Saved maps layout: <'D'> <'M'> <version> <douts> <aouts> <dins> <ains> {<group:2>}* <crc8>
+ * Groups of all digital outputs, then analog outputs, digital inputs and analog inputs; big endian
+ */
+static const uint8_t MAPS_VERSION=1;
+static const int MAPS_HDRSIZE=7;
+#define MAPS_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_MAPS_FILE)
+
+bool Domotic::loadMaps()
+{
+  size_t size=MAPS_HDRSIZE+2*(_douts+_aouts+_dins+_ains)+1, len=0;
+  uint8_t *buff=(uint8_t *)malloc(size);
+  bool err=true;
+
+  if(buff && !storageRead(MAPS_PATH, buff, size, len) && size==len && 'D'==buff[0] && 'M'==buff[1]
+      && MAPS_VERSION==buff[2] && _douts==buff[3] && _aouts==buff[4] && _dins==buff[5] && _ains==buff[6]
+      && crypto_crc8(MAPS_VERSION, buff, len-1)==buff[len-1]) {
+    const uint8_t *p=buff+MAPS_HDRSIZE;
+    for(uint8_t r=0x20; r<=0x23; ++r)
+      for(int t=0; t<mapCount(r); ++t, p+=2)
+        map(r)[t]=(p[0]<<8)|p[1];
+    err=false;
+  }
+  free(buff);
+  return err;
+}
+
+bool Domotic::saveMaps()
+{
+  size_t size=MAPS_HDRSIZE+2*(_douts+_aouts+_dins+_ains)+1;
+  uint8_t *buff=(uint8_t *)malloc(size);
+  bool err;
+
+  indexGroups();
+  configChanged();
+  if(!buff)
+    return true;
+  buff[0]='D';
+  buff[1]='M';
+  buff[2]=MAPS_VERSION;
+  buff[3]=_douts;
+  buff[4]=_aouts;
+  buff[5]=_dins;
+  buff[6]=_ains;
+  uint8_t *p=buff+MAPS_HDRSIZE;
+  for(uint8_t r=0x20; r<=0x23; ++r) {
+    for(int t=0; t<mapCount(r); ++t) {
+      *p++=map(r)[t]>>8;
+      *p++=map(r)[t];
+    }
+  }
+  buff[size-1]=crypto_crc8(MAPS_VERSION, buff, size-1);
+  err=storageWrite(MAPS_PATH, buff, size);
+  free(buff);
+  return err;
+}
+
+uint8_t Domotic::restoreCount(uint8_t reg)
+{
+  if(!_restore)
+    return 0;
+  return 0x29==reg?_douts:_aouts;
+}
+
+uint8_t *Domotic::restore(uint8_t reg)
+{
+  return 0x29==reg?_restore:_restore+_douts;
+}
+
+Domotic::DomError Domotic::readRestore(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  _lastpkt[len++]=restore(reg)[idx];
+  return DomError::ERR_OK;
+}
+
+/*
+ * Restore policies: CR29|CR2A <line:ByteHex> <policy> {<';'> <policy>}*
+ * policy is 'L' (last state, the default), '0' (off) or 'N' (leave it to the driver): see restoreOutputs()
+ */
+Domotic::DomError Domotic::writeRestore(uint8_t reg, uint8_t idx, int &offset)
+{
+  uint8_t p=_lastpkt[offset];
+
+  if(RESTORE_LAST!=p && RESTORE_OFF!=p && RESTORE_NONE!=p)
+    return DomError::ERR_CMD_BAD;
+  ++offset;
+  restore(reg)[idx]=p;
+  _regChanged=true;
+  return DomError::ERR_OK;
+}
+
+/*
+ * Saved restore policies layout: <'D'> <'P'> <version> <douts> <aouts> {<policy>}* <crc8>
+ * Policies of all digital outputs, then analog outputs
+ */
+static const uint8_t RESTORE_VERSION=1;
+static const int RESTORE_HDRSIZE=5;
+#define RESTORE_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_RESTORE_FILE)
+
+bool Domotic::loadRestore()
+{
+  size_t size=RESTORE_HDRSIZE+_douts+_aouts+1, len=0;
+  uint8_t *buff=(uint8_t *)malloc(size);
+  bool err=true;
+
+  if(_restore && buff && !storageRead(RESTORE_PATH, buff, size, len) && size==len && 'D'==buff[0] && 'P'==buff[1]
+      && RESTORE_VERSION==buff[2] && _douts==buff[3] && _aouts==buff[4]
+      && crypto_crc8(RESTORE_VERSION, buff, len-1)==buff[len-1]) {
+    memcpy(_restore, buff+RESTORE_HDRSIZE, _douts+_aouts);
+    err=false;
+  }
+  free(buff);
+  return err;
+}
+
+bool Domotic::saveRestore()
+{
+  size_t size=RESTORE_HDRSIZE+_douts+_aouts+1;
+  uint8_t *buff=(uint8_t *)malloc(size);
+  bool err;
+
+  configChanged();
+  if(!buff)
+    return true;
+  buff[0]='D';
+  buff[1]='P';
+  buff[2]=RESTORE_VERSION;
+  buff[3]=_douts;
+  buff[4]=_aouts;
+  memcpy(buff+RESTORE_HDRSIZE, _restore, _douts+_aouts);
+  buff[size-1]=crypto_crc8(RESTORE_VERSION, buff, size-1);
+  err=storageWrite(RESTORE_PATH, buff, size);
+  free(buff);
+  return err;
+}
+
+Domotic::DomError Domotic::readRule(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  const RuleTable::Rule *rule=_rules.at(idx);
+
+  if(rule)
+    len+=RuleTable::format((char*)(_lastpkt+len), *rule);
+  else
+    _lastpkt[len++]='-';
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readTimer(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  const TimerTable::Timer *t=_timers.at(idx);
+
+  if(!t)
+    return DomError::ERR_INF_RANGE;
+  if(0x25==reg)
+    len+=TimerTable::format((char*)(_lastpkt+len), *t);
+  else
+    len+=sprintf((char*)(_lastpkt+len), "%04X", t->interval);
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readJournal(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  uint16_t s;
+
+  if(Domotic::hex2uint16(_lastpkt+arg, &s)) {
+    len+=sprintf((char*)(_lastpkt+len), "%04X%04X", _journal.last(), _journal.oldest());
+  } else {
+    int n;
+    _lastpkt[len]=_journal.since(s, (char*)(_lastpkt+len+1), MAX_ANSWER-len-1, n);
+    len+=1+n;
+  }
+  return DomError::ERR_OK;
+}
+
+Domotic::DomError Domotic::readUSub(uint8_t reg, uint8_t idx, int arg, int &len)
+{
+  const USub &s=_usubs[idx];
+  unsigned long used=millis()-s.start;
+
+  if(!s.port || used>=s.lease) {
+    _lastpkt[len++]='-';
+  } else {
+    len+=sprintf((char*)(_lastpkt+len), "%u.%u.%u.%u %04X %02X %04X %04X %04X",
+      s.ip[0], s.ip[1], s.ip[2], s.ip[3], s.port, s.mask, s.from, s.to, (unsigned)((s.lease-used)/1000));
+  }
+  return DomError::ERR_OK;
+}
+
+bool Domotic::sendSigned(const char* buff, uint16_t keyID)
+{
+  KeySlot *k=_keys.find(keyID);
+  size_t len=strlen(buff);
+
+  if(k && KeySlot::KEY_HMAC==k->getType())
+    return sendMAC(buff, k); // Takes microseconds: no need to queue
+
+  // Only Ed25519 signatures can be computed in background
+  if(!k || KeySlot::KEY_ED25519!=k->getType() || !k->getCaps().sign)
+    return true;
+  if(8+len>=SIGN_MAXMSG || SIGN_QUEUE==_signCount) // msg holds the counter too
+    return true;
+  uint32_t ctr=_replay.nextTx();
+  if(!ctr)
+    return true;
+
+  SignJob &j=_signQueue[(_signHead+_signCount)%SIGN_QUEUE];
+  j.keyID=keyID;
+  j.queued=millis();
+  sprintf(j.msg, "%08X%s", ctr, buff);
+  ++_signCount;
+  return false;
+}
+
+static int b64encode(char *dst, const uint8_t *src, size_t len);
+
+// Send a MACPkt right away; does not use _lastpkt, since it could hold a request being processed
+bool Domotic::sendMAC(const char *buff, KeySlot *k)
+{
+  char pkt[DOMOTIC_MAX_PKT_SIZE+1];
+  char data[DOMOTIC_MAX_PKT_SIZE+1];
+  uint8_t mac[HmacSlot::MAC_LEN];
+  size_t len=strlen(buff);
+  int pos;
+
+  if(1+4+4*((sizeof(mac)+2)/3)+8+len>DOMOTIC_MAX_PKT_SIZE)
+    return true;
+  uint32_t ctr=_replay.nextTx();
+  if(!ctr)
+    return true;
+  len=sprintf(data, "%08X%s", ctr, buff);
+  uint32_t ip=WiFi.localIP();
+  static_cast<HmacSlot *>(k)->signFrom((const uint8_t *)&ip, (const uint8_t *)data, len, mac);
+  pos=sprintf(pkt, "%c%04X", Domotic::DomPktType::PKT_MAC, k->getID());
+  pos+=b64encode(pkt+pos, mac, sizeof(mac));
+  strcpy(pkt+pos, data);
+
+  _udp->beginPacketMulticast(_mcastAddr, _port, WiFi.localIP());
+  _udp->println(pkt);
+  _udp->endPacket();
+  return false;
+}
+
+// Advance the pending verification or the signature of the first queued notification by (about) DOMOTIC_CRYPTO_SLICE_US
+// When it's complete, answer the request or send the notification
+void Domotic::handleCrypto()
+{
+  if(!_initialized)
+    return;
+
+  if(_verifying) {
+    // Verifications have priority: someone is waiting for an answer (or for the time)
+    unsigned long start=micros();
+    bool done;
+    do {
+      done=Ed25519::verifyStep(_verifyCtx, 1);
+    } while(!done && micros()-start<DOMOTIC_CRYPTO_SLICE_US);
+    if(!done)
+      return;
+    _verifying=false;
+
+    // Restore the request and complete it
+    memcpy(_lastpkt, _pendpkt, _pendLen+1);
+    _remoteIP=_pendIP;
+    _remotePort=_pendPort;
+    _ansTicket=_pendTicket;
+    _encSession=_pendSession;
+    _encCtr=_pendCtr;
+    if(_pendUpdate) {
+      // Multicast update: a forged one is just dropped
+      _ansTicket=AnswerCache::NONE;
+      _signKey=0;
+      if(!Ed25519::verifyResult(_verifyCtx)) {
+        _verified.store(_pendKey, _pendDigest, VerifyCache::RES_BAD, millis());
+      } else {
+        _verified.store(_pendKey, _pendDigest, VerifyCache::RES_GOOD, millis());
+        _signKey=_pendKey;
+        _signCtr=_pendSignCtr;
+        _replay.accept(_signKey, 0, _signCtr); // Background checks are Ed25519 only: one window per key
+        _isSigned=true;
+        handleUpdate(_pendOffset, _pendLen, _pendRcv);
+        _isSigned=false;
+      }
+    } else if(!Ed25519::verifyResult(_verifyCtx)) {
+      _verified.store(_pendKey, _pendDigest, VerifyCache::RES_BAD, millis());
+      _signKey=0;
+      answer(Domotic::ERR_CTX, 0);
+    } else {
+      _verified.store(_pendKey, _pendDigest, VerifyCache::RES_GOOD, millis());
+      _signKey=_pendKey;
+      _signCtr=_pendSignCtr;
+      _replay.accept(_signKey, 0, _signCtr);
+      _isSigned=true;
+      handleRequest(_pendOffset, _pendLen);
+      _isSigned=false;
+    }
+    _encSession=0;
+    _ansTicket=AnswerCache::NONE;
+    return;
+  }
+
+  if(!_signCount) {
+    // Idle: prepare ephemeral keys for the next key exchanges
+    if(_canExchange) {
+      unsigned long start=micros();
+      while(!_ephemeral.step(1) && micros()-start<DOMOTIC_CRYPTO_SLICE_US)
+        ;
+    }
+    return;
+  }
+
+  SignJob &j=_signQueue[_signHead];
+
+  if(!_signing) {
+    KeySlot *k=_keys.find(j.keyID);
+    if(!k || !k->getPrivate()) {
+      // Key got removed after queuing: drop the notification
+      _signHead=(_signHead+1)%SIGN_QUEUE;
+      --_signCount;
+      return;
+    }
+    memcpy(_signPub, k->getPublic(), sizeof(_signPub));
+    Ed25519::signStart(_signCtx, _signature, k->getPrivate(), _signPub, j.msg, strlen(j.msg));
+    _signing=true;
+    return; // Hashing used this time slice
+  }
+
+  unsigned long start=micros();
+  bool done;
+  do {
+    done=Ed25519::signStep(_signCtx, 1);
+  } while(!done && micros()-start<DOMOTIC_CRYPTO_SLICE_US);
+  if(!done)
+    return;
+  _signing=false;
+
+  // Signature ready: SignedPkt := <'S'> <keyID:WordHex> <signature:b64> <counter:DWordHex> <msg>
+  // _lastpkt is free: received packets are completely handled by handleNet()
+  int enc=1+4;
+  sprintf((char *)_lastpkt, "%c%04X", Domotic::DomPktType::PKT_SIG, j.keyID);
+  memcpy(_lastpkt+enc, _signature, sizeof(_signature));
+  b64enc(enc, sizeof(_signature)); // enc gets updated with encoded len
+  strcpy((char *)_lastpkt+1+4+enc, j.msg);
+
+  _udp->beginPacketMulticast(_mcastAddr, _port, WiFi.localIP());
+  _udp->println((const char *)_lastpkt);
+  _udp->endPacket();
+
+  _signLatency=millis()-j.queued;
+  if(_signLatency>_signLatencyMax)
+    _signLatencyMax=_signLatency;
+  _signHead=(_signHead+1)%SIGN_QUEUE;
+  --_signCount;
+}
+
+void Domotic::verifySig(int &offset, int len, bool fast)
+{
+//  Serial.printf("Verify (%s) off=%d\n", fast?"FAST":"full", offset);
+  uint8_t t;
+  int off=offset;
+
+  _isSigned=false;
+
+  if(offset) {	// Fresh verification
+    //Serial.println(" Fresh");
+    // Parse _signKey
+    uint16_t tk=_signKey=0;
+    if(hex2uint8(_lastpkt+off, &t)) return; // Abort parsing
+    tk=t<<8;
+    off+=2;
     if(hex2uint8(_lastpkt+off, &t)) return; // Abort parsing
     tk|=t;
     off+=2;
@@ -991,14 +2215,16 @@ void Domotic::verifySig(int &offset, int len, bool fast)
     // Now offset points to start of signature
   }
 
-#warning "TODO: locate key from signKey"
-  const uint8_t pubkey[]={
-    0xd7, 0x5a, 0x98, 0x01, 0x82, 0xb1, 0x0a, 0xb7,
-    0xd5, 0x4b, 0xfe, 0xd3, 0xc9, 0x64, 0x07, 0x3a,
-    0x0e, 0xe1, 0x72, 0xf3, 0xda, 0xa6, 0x23, 0x25,
-    0xaf, 0x02, 0x1a, 0x68, 0xf7, 0x07, 0x51, 0x1a
-    };
-  int sigLen=64;
+  KeySlot *k=_keys.find(_signKey);
+  int sigLen=k?k->getSigLen():0;
+  if(!sigLen || !k->getCaps().verify) {
+    // Unknown key or key unable to verify
+    _signKey=0;
+    _signOffset=0;
+    _signData=0;
+    return;
+  }
+  _signSender=KeySlot::KEY_HMAC==k->getType()?(uint32_t)_remoteIP:0;
 
   if(offset) { // Only for fresh verify
     // Replace base64-encoded signature with binary one
@@ -1011,16 +2237,41 @@ void Domotic::verifySig(int &offset, int len, bool fast)
       return;
     }
     _signData=off;
+
+    // Cheap checks before any pk crypto: stale counter or copy of a packet already seen
+    // (forged, being verified or verified: a good copy is a replay too)
+    uint16_t hi, lo;
+    VerifyCache::digest(_signDigest, _lastpkt+_signOffset, sigLen, _lastpkt+off, strlen((const char *)_lastpkt+off));
+    if(hex2uint16(_lastpkt+off, &hi) || hex2uint16(_lastpkt+off+4, &lo)
+        || _replay.isReplay(_signKey, _signSender, _signCtr=((uint32_t)hi<<16)|lo)
+        || _verified.lookup(_signKey, _signDigest, millis())) {
+      _signKey=0;
+      _signOffset=0;
+      _signData=0;
+      return;
+    }
   }
 
   if(fast) {
 //    Serial.println("End of fast check: sign formally OK");
     // Packet is not considered signed, yet, but offset must be updated and _signKey is set
-    offset=off;
+    offset=_signData+8;
     return;
   }
 //  Serial.printf("Performing check on %s\n", (char*)_lastpkt+_signData);
-  bool rv=Ed25519::verify(_lastpkt+_signOffset, pubkey, _lastpkt+_signData, strlen((const char *)_lastpkt+_signData));
+  bool rv;	// True if signature is good
+  uint8_t res=_verified.lookup(_signKey, _signDigest, millis());
+  if(VerifyCache::RES_GOOD==res || VerifyCache::RES_BAD==res) {
+    rv=(VerifyCache::RES_GOOD==res);
+  } else {
+    const uint8_t *data=_lastpkt+_signData;
+    int dlen=strlen((const char *)data);
+    if(KeySlot::KEY_HMAC==k->getType())
+      rv=!static_cast<HmacSlot *>(k)->verifyFrom((const uint8_t *)&_signSender, data, dlen, _lastpkt+_signOffset);
+    else
+      rv=!k->verify(data, dlen, _lastpkt+_signOffset, &sigLen, false);
+    _verified.store(_signKey, _signDigest, rv?VerifyCache::RES_GOOD:VerifyCache::RES_BAD, millis());
+  }
   if(!rv) {
 //    Serial.println(" SIG_BAD!");
     _signKey=0;
@@ -1028,35 +2279,125 @@ void Domotic::verifySig(int &offset, int len, bool fast)
     _signData=0;
   } else {
 //    Serial.println(" SIG_OK");
-    offset=off;
+    _replay.accept(_signKey, _signSender, _signCtr);
+    offset=_signData+8;
     _isSigned=true;
   }
 }
 
+// Signed and MAC'd packets: skip keyID, signature and counter without decoding them
+int Domotic::updateOffset(int offset, int len)
+{
+  if(PKT_MAC!=_lastpkt[offset] && PKT_SIG!=_lastpkt[offset])
+    return offset;
+
+  uint16_t id;
+  if(hex2uint16(_lastpkt+offset+1, &id))
+    return -1;
+  KeySlot *k=_keys.find(id);
+  int sigLen=k?k->getSigLen():0;
+  if(!sigLen)
+    return -1; // Would be dropped by verifySig() anyway
+  offset+=1+4+4*((sigLen+2)/3)+8;
+  return offset<len?offset:-1;
+}
+
+// Start background verification of the signed request (or multicast update, received at rcv) in _lastpkt,
+// already parsed by verifySig(offset, len, true)
+// Returns true if verification can't be started (only Ed25519 keys are supported)
+bool Domotic::startVerify(int offset, int len, bool update, unsigned long rcv)
+{
+  KeySlot *k=_keys.find(_signKey);
+  if(!k || KeySlot::KEY_ED25519!=k->getType())
+    return true;
+
+  // Save the request: _lastpkt will be overwritten by other packets meanwhile
+  memcpy(_pendpkt, _lastpkt, len+1);
+  _pendOffset=offset;
+  _pendLen=len;
+  _pendKey=_signKey;
+  _pendSignCtr=_signCtr;
+  memcpy(_pendDigest, _signDigest, sizeof(_pendDigest));
+  _pendSession=_encSession;
+  _pendCtr=_encCtr;
+  _pendIP=_remoteIP;
+  _pendPort=_remotePort;
+  _pendTicket=_ansTicket;
+  _pendUpdate=update;
+  _pendRcv=rcv;
+  // Copies arriving meanwhile are dropped (see verifySig()); only a verification that runs can be pending
+  _verified.store(_signKey, _signDigest, VerifyCache::RES_PENDING, millis());
+  Ed25519::verifyStart(_verifyCtx, _lastpkt+_signOffset, k->getPublic(),
+    _lastpkt+_signData, strlen((const char *)_lastpkt+_signData));
+  _verifying=true;
+  return false;
+}
+
 // Send unicast answer to a request
 void Domotic::answer(Domotic::DomError err, size_t size, int offset)
 {
   if(!_initialized)
     return;
 
-  uint8_t ecode=static_cast<uint8_t>(err);
-  _udp->beginPacket(_udp->remoteIP(), _udp->remotePort());
-  _udp->write(Domotic::DomPktType::PKT_ANS);
-  _udp->print(ecode>>4, HEX);
-  _udp->print(ecode&0xf, HEX);
-  if(Domotic::DomError::ERR_OK==err) {
+  SessionCache::Session *s=_encSession?_sessions.find(_encSession, _remoteIP):NULL;
+  if(s) {
+    // Encrypted request: AnswerPkt becomes the plaintext of an EncryptedPkt
+    const int hdr=1+4+8;
+    char head[hdr+4];
+    int enc=-1;
+
+    if(Domotic::DomError::ERR_OK!=err)
+      size=0;
+    b64enc(enc, 3+size+SessionCache::TAG_SIZE); // Only computes the encoded size
+    if(hdr+enc>DOMOTIC_MAX_PKT_SIZE) {
+      // Won't fit: the counter can't be reused, so this is the only answer
+      err=Domotic::DomError::ERR_UNKNOWN;
+      size=0;
+    }
+    sprintf(head, "%c%04X%08X%c%02X", Domotic::DomPktType::PKT_ENC, s->id, _encCtr,
+      Domotic::DomPktType::PKT_ANS, static_cast<uint8_t>(err));
+    memmove(_lastpkt+hdr+3, _lastpkt+offset, size);
+    memcpy(_lastpkt, head, hdr+3);
+    _sessions.seal(s, _encCtr, _lastpkt, hdr, _lastpkt+hdr, 3+size);
+    enc=hdr;
+    b64enc(enc, 3+size+SessionCache::TAG_SIZE);
+    size=hdr+enc;
+  } else {
+    // Session of an encrypted request gone meanwhile (f.e. replaced while its signature was being verified):
+    // its answer must never be sent in clear, only a bare error
+    if(_encSession)
+      err=Domotic::DomError::ERR_CTX;
     // Append details only for "OK" answer
-    _udp->write(_lastpkt+offset, size);
+    if(Domotic::DomError::ERR_OK!=err)
+      size=0;
+    if(size>DOMOTIC_MAX_PKT_SIZE)
+      size=DOMOTIC_MAX_PKT_SIZE;
+    memmove(_lastpkt+3, _lastpkt+offset, size);
+    _lastpkt[0]=Domotic::DomPktType::PKT_ANS;
+    _lastpkt[1]="0123456789ABCDEF"[static_cast<uint8_t>(err)>>4];
+    _lastpkt[2]="0123456789ABCDEF"[static_cast<uint8_t>(err)&0xf];
+    size+=3;
   }
-  _udp->write((uint8_t)0);
+  _lastpkt[size++]=0;
+
+  _udp->beginPacket(_remoteIP, _remotePort);
+  _udp->write(_lastpkt, size);
   _udp->endPacket();
+
+  // Busy means "not done, retry later": the retransmission must run
+  if(Domotic::DomError::ERR_BUSY==err)
+    _answers.forget(_ansTicket);
+  else
+    _answers.store(_ansTicket, _lastpkt, size, millis());
+  _ansTicket=AnswerCache::NONE;
 }
 
 /*
  * Send a multicast notification of the changed IO state (notify()) or current time (notifyTime())
  * Does not (currently) modify _lastpkt
  *  UpdatePkt := <'U'> EventSpec
- *    EventSpec := InEvent | OutEvent | TimeEvent
+ *    EventSpec := {InEvent | OutEvent} <seq:WordHex> | TimeEvent | HeartbeatEvent (see handleHeartbeat())
+ *      seq numbers IO events: missed ones can be read from register 0x27 (see UpdateJournal)
  *      InEvent := <'I'> {DigitalEvent | AnalogEvent}
  *        DigitalEvent := <'D'> <group:WordHex> <'0'|'1'>
  *        AnalogEvent := <'A'> <group:WordHex> <value:WordHex>
@@ -1085,6 +2426,8 @@ void Domotic::notify(Domotic::UpdDir d, Domotic::UpdType t, uint8_t num, uint16_
     if(Domotic::UpdDir::DIR_IN==d) {
       e=readAnalogIn(num, val);
       pGroup=_ainMap; // Delay dereference after error check
+      if(Domotic::DomError::ERR_OK==e && pGroup && pGroup[num])
+        applyGroup(Domotic::TYPE_ANALOG, pGroup[num], val); // Local reaction first
     } else {
       e=readAnalogOut(num, val);
       pGroup=_aoutMap; // Delay dereference after error check
@@ -1092,9 +2435,10 @@ void Domotic::notify(Domotic::UpdDir d, Domotic::UpdType t, uint8_t num, uint16_
     if(Domotic::DomError::ERR_OK!=e || !pGroup || 0==pGroup[num])
       return;
 
-    sprintf(buff+pos, "%04X%04X",
+    sprintf(buff+pos, "%04X%04X%04X",
       pGroup[num],
-      val
+      val,
+      _journal.add(buff[1], buff[2], pGroup[num], val)
       );
   } else {
     // Digital IO
@@ -1104,6 +2448,12 @@ void Domotic::notify(Domotic::UpdDir d, Domotic::UpdType t, uint8_t num, uint16_
     if(Domotic::UpdDir::DIR_IN==d) {
       e=readDigitalIn(num, val);
       pGroup=_dinMap; // Delay dereference after error check
+      if(Domotic::DomError::ERR_OK==e) {
+        // Local reaction first: it must not wait for the network
+        applyRules(RuleTable::SRC_LINE, num, val);
+        if(pGroup && pGroup[num])
+          applyGroup(Domotic::TYPE_DIGITAL, pGroup[num], val);
+      }
     } else {
       e=readDigitalOut(num, val);
       pGroup=_doutMap; // Delay dereference after error check
@@ -1111,24 +2461,464 @@ void Domotic::notify(Domotic::UpdDir d, Domotic::UpdType t, uint8_t num, uint16_
     if(Domotic::DomError::ERR_OK!=e || !pGroup || 0==pGroup[num])
       return;
 
-    sprintf(buff+pos, "%04X%c",
+    sprintf(buff+pos, "%04X%c%04X",
       pGroup[num],
-      val?'1':'0'
+      val?'1':'0',
+      _journal.add(buff[1], buff[2], pGroup[num], val)
       );
   }
 
+  _hbInterval=_hbMin; // Heartbeats are frequent again after a change
+
   if(0xffff!=signKey) {
-    // Create actual signature
-    if(sigBuff(buff, signKey))
-      return;
+    // Signing takes a while: handle() will send it when ready
+    sendSigned(buff, signKey);
+    return;
   }
 
+  if(queueUSubs(buff, buff[1], buff[2], pGroup[num]))
+    return; // Subscribers asked for unicast only
+
   _udp->beginPacketMulticast(_mcastAddr, _port, WiFi.localIP());
   _udp->println((const char *)buff);
   _udp->endPacket();
 
 }
 
+/*
+ * Unicast subscriptions: CR28 <port:WordHex> <lease s:WordHex> <mask:ByteHex> [<from:WordHex> <to:WordHex>]
+ * Unsigned updates for groups from-to (default: all) of the line classes in mask (see USubMask) are also
+ * sent to the requesting IP at port (0: the port the request came from). Updates generated in the same
+ * handle() round are batched in one packet, separated by '\n'.
+ * A new subscription from the same IP and port replaces the old one; lease 0 removes it.
+ * USUB_ONLY (matching updates are not multicast) is only accepted from signed or MAC'd requests: encryption alone
+ * doesn't identify the peer, as the key exchange is anonymous.
+ */
+Domotic::DomError Domotic::writeUSub(uint8_t reg, uint8_t idx, int &offset)
+{
+  uint16_t port, lease, from=0, to=0xFFFF;
+  uint8_t mask;
+
+  if(hex2uint16(_lastpkt+offset, &port) || hex2uint16(_lastpkt+offset+4, &lease) || hex2uint8(_lastpkt+offset+8, &mask))
+    return DomError::ERR_CMD_BAD;
+  offset+=10;
+  if(_lastpkt[offset] && (hex2uint16(_lastpkt+offset, &from) || hex2uint16(_lastpkt+offset+4, &to) || from>to))
+    return DomError::ERR_CMD_BAD;
+  if(mask&~(USUB_ID|USUB_IA|USUB_OD|USUB_OA|USUB_ONLY))
+    return DomError::ERR_CMD_RANGE;
+  if((mask&USUB_ONLY) && !_isSigned)
+    return DomError::ERR_CTX;
+  if(!port)
+    port=_remotePort;
+
+  int slot=-1;
+  for(int t=0; t<DOMOTIC_MAX_USUBS; ++t) {
+    if(_usubs[t].port==port && _usubs[t].ip==_remoteIP) {
+      slot=t;
+      break;
+    }
+    if(!_usubs[t].port && slot<0)
+      slot=t;
+  }
+  if(slot<0 || (!lease && (!_usubs[slot].port || _usubs[slot].ip!=_remoteIP)))
+    return lease?DomError::ERR_BUSY:DomError::ERR_CMD_RANGE; // Table full, or nothing to remove
+
+  USub &s=_usubs[slot];
+  if(s.port)
+    flushUSub(slot); // Pending updates belong to the old subscription
+  s.port=lease?port:0;
+  s.ip=_remoteIP;
+  s.mask=mask;
+  s.from=from;
+  s.to=to;
+  s.start=millis();
+  s.lease=1000UL*lease;
+  s.len=0;
+  return DomError::ERR_OK;
+}
+
+bool Domotic::queueUSubs(const char *buff, char dir, char type, uint16_t group)
+{
+  uint8_t cls=('I'==dir)?(('D'==type)?USUB_ID:USUB_IA):(('D'==type)?USUB_OD:USUB_OA);
+  int n=strlen(buff);
+  bool only=false;
+
+  for(int t=0; t<DOMOTIC_MAX_USUBS; ++t) {
+    USub &s=_usubs[t];
+    if(!s.port || !(s.mask&cls) || group<s.from || group>s.to || millis()-s.start>=s.lease)
+      continue;
+    if(s.len && s.len+1+n>USUB_BATCH)
+      flushUSub(t);
+    if(s.len)
+      s.batch[s.len++]='\n';
+    memcpy(s.batch+s.len, buff, n);
+    s.len+=n;
+    only|=(s.mask&USUB_ONLY)!=0;
+  }
+  return only;
+}
+
+void Domotic::flushUSub(int t)
+{
+  USub &s=_usubs[t];
+
+  if(!s.len)
+    return;
+  _udp->beginPacket(s.ip, s.port);
+  _udp->write((const uint8_t *)s.batch, s.len);
+  _udp->write((uint8_t)0);
+  _udp->endPacket();
+  s.len=0;
+}
+
+void Domotic::flushUSubs()
+{
+  if(!_initialized)
+    return;
+  for(int t=0; t<DOMOTIC_MAX_USUBS; ++t) {
+    if(!_usubs[t].port)
+      continue;
+    flushUSub(t);
+    if(millis()-_usubs[t].start>=_usubs[t].lease)
+      _usubs[t].port=0; // Lease expired
+  }
+}
+
+void Domotic::setHeartbeat(unsigned long minMs, unsigned long maxMs, uint16_t signKey)
+{
+  _hbMin=_hbInterval=minMs;
+  _hbMax=maxMs<minMs?minMs:maxMs;
+  _hbKey=signKey;
+  _hbLast=millis();
+}
+
+void Domotic::configChanged()
+{
+  ++_configGen;
+  _info.clear();
+  _hbInterval=_hbMin;
+  _configStale=true; // Saved by handleConfig(): configDigest() would overwrite _lastpkt of the request being handled
+}
+
+void Domotic::handleConfig()
+{
+  if(!_configStale)
+    return;
+  _configStale=false;
+  _configDigest=configDigest();
+  saveConfig(); // The generation changed, even if the digest didn't
+}
+
+// FNV-1a, 32 bits
+static uint32_t fnv1a(uint32_t h, uint8_t b)
+{
+  return (h^b)*16777619UL;
+}
+
+// Renders every line spec in _lastpkt: only call it when no request is being handled
+uint32_t Domotic::configDigest()
+{
+  uint32_t h=2166136261UL;
+  const uint16_t *maps[4]={_doutMap, _aoutMap, _dinMap, _ainMap};
+  const uint8_t counts[4]={_douts, _aouts, _dins, _ains};
+
+  for(int m=0; m<4; ++m) {
+    h=fnv1a(h, counts[m]);
+    for(int t=0; t<counts[m]; ++t) {
+      int len=0;
+      h=fnv1a(fnv1a(h, maps[m][t]>>8), maps[m][t]);
+      switch(m) {
+        case 0: readDigitalOutSpec(t, len); break;
+        case 1: readAnalogOutSpec(t, len); break;
+        case 2: readDigitalInSpec(t, len); break;
+        case 3: readAnalogInSpec(t, len); break;
+      }
+      for(int c=0; c<len; ++c)
+        h=fnv1a(h, _lastpkt[c]);
+    }
+  }
+  for(int t=0; _restore && t<_douts+_aouts; ++t)
+    h=fnv1a(h, _restore[t]);
+  h=fnv1a(fnv1a(h, _tlen), _utf);
+  for(int t=0; t<_keys.count(); ++t) {
+    KeySlot *k=_keys.at(t);
+    h=fnv1a(fnv1a(fnv1a(h, k->getID()>>8), k->getID()), k->getType());
+    if(KeySlot::KEY_HMAC!=k->getType()) {
+      for(int c=0; c<32; ++c)
+        h=fnv1a(h, k->getPublic()[c]);
+    }
+  }
+  return h;
+}
+
+/*
+ * Saved configuration generation: <'D'> <'G'> <version> <gen:4> <digest:4> <crc8>
+ * Multi-byte values are big endian
+ */
+static const uint8_t CONFIG_VERSION=1;
+static const int CONFIG_SIZE=3+4+4+1;
+#define CONFIG_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_CONFIG_FILE)
+
+// The generation never goes back: if it can't be loaded (f.e. first boot), it starts from a random value,
+// so a controller can't mistake the new configuration for the one it cached
+void Domotic::loadConfig()
+{
+  uint8_t buff[CONFIG_SIZE];
+  size_t len=0;
+  uint32_t digest=configDigest();
+
+  if(storageRead(CONFIG_PATH, buff, sizeof(buff), len) || CONFIG_SIZE!=len || 'D'!=buff[0] || 'G'!=buff[1]
+      || CONFIG_VERSION!=buff[2] || crypto_crc8(CONFIG_VERSION, buff, len-1)!=buff[len-1]) {
+    RNG.rand((uint8_t *)&_configGen, sizeof(_configGen));
+    _configDigest=~digest;
+  } else {
+    _configGen=((uint32_t)buff[3]<<24)|((uint32_t)buff[4]<<16)|(buff[5]<<8)|buff[6];
+    _configDigest=((uint32_t)buff[7]<<24)|((uint32_t)buff[8]<<16)|(buff[9]<<8)|buff[10];
+  }
+  if(digest!=_configDigest) {
+    // Different firmware, expansions or keys
+    _configDigest=digest;
+    configChanged();
+    _configStale=false; // Just computed
+    saveConfig();
+  }
+}
+
+bool Domotic::saveConfig()
+{
+  uint8_t buff[CONFIG_SIZE];
+
+  buff[0]='D';
+  buff[1]='G';
+  buff[2]=CONFIG_VERSION;
+  for(int t=0; t<4; ++t) {
+    buff[3+t]=_configGen>>(24-8*t);
+    buff[7+t]=_configDigest>>(24-8*t);
+  }
+  buff[CONFIG_SIZE-1]=crypto_crc8(CONFIG_VERSION, buff, CONFIG_SIZE-1);
+  return storageWrite(CONFIG_PATH, buff, CONFIG_SIZE);
+}
+
+/*
+ * Saved output states layout: <'D'> <'O'> <version> <douts> <aouts> {<douts bits>} {<aout:2>}* <crc8>
+ * Digital output t is bit t%8 of byte t/8; multi-byte values are big endian
+ * The same image is kept in RTC user memory on ESP8266, rounded up to 4-byte blocks
+ */
+static const uint8_t OUTPUTS_VERSION=1;
+static const int OUTPUTS_HDRSIZE=5;
+#define OUTPUTS_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_OUTPUTS_FILE)
+#if defined(ESP8266)
+// The image, rounded up to 4-byte blocks, fits in RTC user memory (512 bytes) from DOMOTIC_OUTPUTS_RTC
+static bool rtcFits(size_t blocks)
+{
+  return DOMOTIC_OUTPUTS_RTC>=0 && (int)blocks<=512-4*DOMOTIC_OUTPUTS_RTC;
+}
+#endif
+
+static uint32_t fnv1a(const uint8_t *buff, size_t len)
+{
+  uint32_t h=2166136261UL;
+
+  while(len--)
+    h=fnv1a(h, *buff++);
+  return h;
+}
+
+size_t Domotic::outputsSize()
+{
+  return OUTPUTS_HDRSIZE+(_douts+7)/8+2*_aouts+1;
+}
+
+void Domotic::outputsImage(uint8_t *buff)
+{
+  size_t size=outputsSize();
+  uint8_t *p=buff+OUTPUTS_HDRSIZE;
+
+  memset(buff, 0, size);
+  buff[0]='D';
+  buff[1]='O';
+  buff[2]=OUTPUTS_VERSION;
+  buff[3]=_douts;
+  buff[4]=_aouts;
+  for(int t=0; t<_douts; ++t) {
+    bool v=false;
+    readDigitalOut(t, v);
+    if(v)
+      p[t/8]|=1<<(t%8);
+  }
+  p+=(_douts+7)/8;
+  for(int t=0; t<_aouts; ++t) {
+    uint16_t v=0;
+    readAnalogOut(t, v);
+    *p++=v>>8;
+    *p++=v;
+  }
+  buff[size-1]=crypto_crc8(OUTPUTS_VERSION, buff, size-1);
+}
+
+bool Domotic::checkOutputs(const uint8_t *buff, size_t len)
+{
+  return outputsSize()!=len || 'D'!=buff[0] || 'O'!=buff[1] || OUTPUTS_VERSION!=buff[2] || _douts!=buff[3]
+      || _aouts!=buff[4] || crypto_crc8(OUTPUTS_VERSION, buff, len-1)!=buff[len-1];
+}
+
+/*
+ * Outputs get their saved state (RESTORE_LAST), are switched off (RESTORE_OFF) or keep the state set by their
+ * driver (RESTORE_NONE). The RTC memory copy is preferred: it's never older than the flash one, but it's lost
+ * when power goes off. Without a saved state for these lines, RESTORE_LAST leaves outputs to their driver.
+ */
+void Domotic::restoreOutputs()
+{
+  size_t size=outputsSize(), len=0;
+  size_t blocks=(size+3)&~3;
+  uint8_t *buff=(uint8_t *)malloc(blocks);
+  bool saved=false;
+
+  if(!_restore || !buff) {
+    free(buff);
+    return;
+  }
+  if(!storageRead(OUTPUTS_PATH, buff, size, len) && !checkOutputs(buff, len)) {
+    _outSaved=fnv1a(buff, size);
+    saved=true;
+  }
+#if defined(ESP8266)
+  if(rtcFits(blocks)) {
+    uint8_t *rtc=(uint8_t *)malloc(blocks);
+    if(rtc && ESP.rtcUserMemoryRead(DOMOTIC_OUTPUTS_RTC, (uint32_t *)rtc, blocks) && !checkOutputs(rtc, size)) {
+      memcpy(buff, rtc, size);
+      saved=true;
+    }
+    free(rtc);
+  }
+#endif
+
+  const uint8_t *p=buff+OUTPUTS_HDRSIZE;
+  for(int t=0; t<_douts; ++t) {
+    if(RESTORE_OFF==_restore[t])
+      writeDigitalOut(t, false);
+    else if(RESTORE_LAST==_restore[t] && saved)
+      writeDigitalOut(t, p[t/8]&(1<<(t%8)));
+  }
+  p+=(_douts+7)/8;
+  for(int t=0; t<_aouts; ++t, p+=2) {
+    if(RESTORE_OFF==_restore[_douts+t])
+      writeAnalogOut(t, 0);
+    else if(RESTORE_LAST==_restore[_douts+t] && saved)
+      writeAnalogOut(t, (p[0]<<8)|p[1]);
+  }
+  free(buff);
+}
+
+void Domotic::outputsChanged()
+{
+  if(!_outPending)
+    _outSince=millis();
+  _outPending=true;
+  _outRtc=true;
+}
+
+bool Domotic::saveOutputs(bool flash)
+{
+  size_t size=outputsSize();
+  size_t blocks=(size+3)&~3;
+  uint8_t *buff=(uint8_t *)malloc(blocks);
+  bool err=false;
+
+  if(!buff)
+    return true;
+  outputsImage(buff);
+#if defined(ESP8266)
+  if(rtcFits(blocks))
+    ESP.rtcUserMemoryWrite(DOMOTIC_OUTPUTS_RTC, (uint32_t *)buff, blocks);
+#endif
+  if(flash) {
+    uint32_t h=fnv1a(buff, size);
+    // Outputs back as they were saved (f.e. toggled twice) cost no write
+    if(h!=_outSaved) {
+      err=storageWrite(OUTPUTS_PATH, buff, size);
+      if(!err)
+        _outSaved=h;
+    }
+  }
+  free(buff);
+  return err;
+}
+
+void Domotic::handleOutputs()
+{
+  if(!_outPending)
+    return;
+  bool due=(millis()-_outSince>=DOMOTIC_OUTPUTS_SAVE_MS);
+#if defined(ESP8266)
+  bool rtc=_outRtc;
+#else
+  bool rtc=false;	// No RTC memory
+#endif
+  if(!due && !rtc)
+    return;
+  _outRtc=false;
+  if(saveOutputs(due)) {
+    _outSince=millis(); // Retry later
+  } else if(due) {
+    _outPending=false;
+  }
+}
+
+uint32_t Domotic::stateDigest()
+{
+  uint32_t h=2166136261UL;
+
+  for(int t=0; t<_douts; ++t) {
+    bool v=false;
+    readDigitalOut(t, v);
+    h=fnv1a(h, v?'1':'0');
+  }
+  for(int t=0; t<_dins; ++t) {
+    bool v=false;
+    readDigitalIn(t, v);
+    h=fnv1a(h, v?'1':'0');
+  }
+  for(int t=0; t<_aouts; ++t) {
+    uint16_t v=0;
+    readAnalogOut(t, v);
+    h=fnv1a(fnv1a(h, v>>8), v);
+  }
+  for(int t=0; t<_ains; ++t) {
+    uint16_t v=0;
+    readAnalogIn(t, v);
+    h=fnv1a(fnv1a(h, v>>8), v);
+  }
+  return fnv1a(fnv1a(h, _configGen>>8), _configGen);
+}
+
+/*
+ * Heartbeat: lets a controller check its cached view of the node without polling it
+ *  HeartbeatPkt := <'U'> <'H'> <seq:WordHex> <gen:WordHex> <digest:DWordHex>
+ * seq is the last update sent (see UpdateJournal), gen the low word of the configuration generation
+ * (register 0x06) and digest the FNV-1a hash of all lines, by line number: digital outputs and inputs as
+ * '0'|'1', then analog outputs and inputs as 2 bytes (big endian), then gen (2 bytes, big endian).
+ * A controller whose cache gives the same digest for the same seq has nothing to poll.
+ */
+void Domotic::handleHeartbeat()
+{
+  if(!_initialized || !_hbMin || millis()-_hbLast<_hbInterval)
+    return;
+
+  char buff[3+4+4+8+1];
+  sprintf(buff, "%cH%04X%04X%08X", Domotic::DomPktType::PKT_UPD, _journal.last(), (uint16_t)_configGen, stateDigest());
+  _hbLast=millis();
+  _hbInterval=(_hbInterval>_hbMax/2)?_hbMax:2*_hbInterval;
+
+  if(0xffff!=_hbKey) {
+    sendSigned(buff, _hbKey);
+    return;
+  }
+  _udp->beginPacketMulticast(_mcastAddr, _port, WiFi.localIP());
+  _udp->println((const char *)buff);
+  _udp->endPacket();
+}
+
 void Domotic::notifyTime(uint8_t epoch, uint32_t counter, uint8_t tz, uint16_t signKey)
 {
   if(!_initialized)
@@ -1136,7 +2926,7 @@ void Domotic::notifyTime(uint8_t epoch, uint32_t counter, uint8_t tz, uint16_t s
 
   char buff[DOMOTIC_MAX_PKT_SIZE];
 
-  sprintf(buff, "%c%02X%08X%02X",
+  sprintf(buff, "%cT%02X%08X%02X",
     Domotic::DomPktType::PKT_UPD,
     epoch,
     counter,
@@ -1144,9 +2934,9 @@ void Domotic::notifyTime(uint8_t epoch, uint32_t counter, uint8_t tz, uint16_t s
     );
 
   if(0xffff!=signKey) {
-    // Create actual signature
-    if(sigBuff(buff, signKey))
-      return;
+    // Signing takes a while: handle() will send it when ready
+    sendSigned(buff, signKey);
+    return;
   }
 
   _udp->beginPacketMulticast(_mcastAddr, _port, WiFi.localIP());
@@ -1184,22 +2974,45 @@ int Domotic::hex2uint8(uint8_t *buff, uint8_t *out) {
     return 2-idx;
 }
 
+int Domotic::hex2uint16(uint8_t *buff, uint16_t *out) {
+    uint8_t hi, lo;
+    int missing=hex2uint8(buff, &hi);
+    if(missing)
+      return missing+2;
+    missing=hex2uint8(buff+2, &lo);
+    if(!missing && out)
+      *out=(hi<<8)|lo;
+    return missing;
+}
+
 static const char b64Charset[]=
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
     "abcdefghijklmnopqrstuvwxyz"
     "0123456789-_"
     ;
 
+// Base64-encode len bytes from src to dst (not in-place), returns the number of characters written (not terminated)
+static int b64encode(char *dst, const uint8_t *src, size_t len)
+{
+  int pos=0;
+  for(size_t t=0; t<len; t+=3) {
+    uint32_t blob=src[t]<<16;
+    if(t+1<len) blob|=src[t+1]<<8;
+    if(t+2<len) blob|=src[t+2];
+    dst[pos++]=b64Charset[(blob>>(6*3))&0x3f];
+    dst[pos++]=b64Charset[(blob>>(6*2))&0x3f];
+    dst[pos++]=(t+1<len)?b64Charset[(blob>>(6*1))&0x3f]:'=';
+    dst[pos++]=(t+2<len)?b64Charset[(blob>>(6*0))&0x3f]:'=';
+  }
+  return pos;
+}
+
 // Base64-encode a binary buffer at _lastpkt[from].._lastpkt[from+len-1] in-place
 // Call with -1==from to get the encoded len in 'from'
 // returns true if encoding would overflow _lastpkt
 bool Domotic::b64enc(int &from, size_t len)
 {
-  int ol=0;
-  if(len) {
-    ol=(len*4+2)/3;
-    ol+=4-(ol&3);	// Include padding
-  }
+  int ol=4*((len+2)/3);	// Include padding
 
   if(-1==from) {
     // Only return needed space
@@ -1246,7 +3059,7 @@ bool Domotic::b64enc(int &from, size_t len)
     _lastpkt[start+ol+2]=b64Charset[(blob>>(6*1))&0x3f];
     _lastpkt[start+ol+3]=b64Charset[(blob>>(6*0))&0x3f];
   }
-  return true;
+  return false;
 }
 
 // Decode a base64-encoded string in _lastpkt+from
@@ -1259,8 +3072,7 @@ bool Domotic::b64dec(int &from, size_t len)
   if(!len) return false; // Nothing to do
 
   size_t ol=len;	// Save requested output len
-  len=(len*4)/3;	// Calculate encoded len...
-  len+=4-(len&3);	// ... including padding
+  len=4*((len+2)/3);	// Encoded len, including padding
 
   char *sig=(char *)_lastpkt+from;
 
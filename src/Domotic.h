@@ -6,7 +6,7 @@
  * - override the methods from ains() to handler() as needed
  * - instantiate your class (global scope)
  * - call Wire.begin(sda, scl) *before* calling yourclass.begin()
- * - call yourclass.begin() from setup()
+ * - call yourclass.begin() from setup(), once outputs can be driven: it restores their saved state
  * - call yourclass.handle() from loop()
  * - manage *all* inputs from yourclass.handler() calling Domotic::notify() when needed
  *
@@ -24,9 +24,13 @@
 
 // Max MAX_PKT_SIZE is 1472 : bigger packets are not received by ESP, but we don't need such a monster
 // Smaller packets are better for limited-resources devices and 256 is already stretching some limits
-// (but a signed packet is 1+4+128+x bytes so can't reduce too much).
+// (but a signed packet is 1+4+88+x bytes so can't reduce too much).
 // Remember that *received* pkt can be 3 bytes longer ('Aee' where ee is error code)
 #define DOMOTIC_MAX_PKT_SIZE 256
+// Controllers that can subscribe to unicast updates (register 0x28)
+#ifndef DOMOTIC_MAX_USUBS
+#define DOMOTIC_MAX_USUBS 4
+#endif
 // Default port ("NdK" from base64-charset [13, 29, 10] to a 16-bit int)
 #define DOMOTIC_DEF_UDP_PORT 55114
 /*
@@ -34,8 +38,33 @@
  * two octects are 55114 -- see the notes about DEF_UDP_PORT)
  */
 #define DOMOTIC_DEF_UDP_MCAST 239,255,215,74
+// Max time (in microseconds) spent in public-key crypto at every handle() call
+// Lower values keep the node more responsive, higher ones get signatures done sooner
+#define DOMOTIC_CRYPTO_SLICE_US 10000
+// Where the configuration generation is saved (see DomoticStorage.h)
+#define DOMOTIC_CONFIG_FILE "/domotic.config"
+// Where port maps written by the controller are saved
+#define DOMOTIC_MAPS_FILE "/domotic.maps"
+// Where output states and their restore policies (registers 0x29 and 0x2A) are saved
+#define DOMOTIC_OUTPUTS_FILE "/domotic.outputs"
+#define DOMOTIC_RESTORE_FILE "/domotic.restore"
+// Output changes are saved this long (ms) after the first one: a burst of commands costs one write
+#ifndef DOMOTIC_OUTPUTS_SAVE_MS
+#define DOMOTIC_OUTPUTS_SAVE_MS 5000
+#endif
+// ESP8266: 4-byte block of RTC user memory where output states are kept at once (they survive resets but
+// not power losses); -1 to keep them only in flash. Blocks 32-63 hold the replay windows (DOMOTIC_WINDOWS_RTC)
+#ifndef DOMOTIC_OUTPUTS_RTC
+#define DOMOTIC_OUTPUTS_RTC 64
+#endif
 
 #include "DomoticCrypto.h"
+#include "DomoticRules.h"
+#include "DomoticTimers.h"
+#include "DomoticClock.h"
+#include "DomoticGroups.h"
+#include "DomoticJournal.h"
+#include "DomoticAnswers.h"
 #include "expansions/DomoticIODescr.h"
 #include "expansions/DomoNodeExpansion.h"
 
@@ -45,6 +74,7 @@ class Domotic : public DomoticIODescr
     enum DomError : uint8_t {
       ERR_OK = 0,       // No error
       ERR_CTX,          // Bad context (unencrypted packet for something that needed encryption? or multicast over unicast?)
+      ERR_BUSY,         // Node is busy (f.e. still verifying a previous signed request): retry later
       // 0x80-0x8f: COMMAND errors
       ERR_CMD_BAD=0x80, // Malformed/unrecognized command
       ERR_CMD_UNS,      // Unsupported command
@@ -68,6 +98,13 @@ class Domotic : public DomoticIODescr
     // ****************** Setup methods ******************
     void setPort(int port) { if(!_initialized) _port=port; };
     void setMcast(IPAddress a) { if(!_initialized) _mcastAddr=a; };
+    // Periodic state heartbeat (see handleHeartbeat()): minMs after a change, then doubling up to maxMs while
+    // nothing changes; minMs=0 disables it (default)
+    void setHeartbeat(unsigned long minMs, unsigned long maxMs, uint16_t signKey=0xFFFF);
+    // Multicast updates are only processed for mapped output groups, group rules and these subscriptions
+    // Returns true if group is 0 or there's no room (MAX_SUBS)
+    bool subscribe(uint16_t group);
+    void unsubscribe(uint16_t group);
     void stop(void);
 
     // ****************** Helper methods ******************
@@ -75,17 +112,37 @@ class Domotic : public DomoticIODescr
     // Parse 2 hex characters pointed by buff and sets out to the parsed value if both chars are valid;
     // returns 0 if both charaters got parsed, or the number of missing characters
     static int hex2uint8(uint8_t *buff, uint8_t *out);
+    // Same as above, for 4 hex characters (big endian)
+    static int hex2uint16(uint8_t *buff, uint16_t *out);
+
+    // Network time, kept by time updates: clock().now() gives ms, 0 until the first update
+    LocalClock &clock() { return _clock; };
 
     // Convert a float representing a temperature to/from centi-Kelvin
     static uint16_t temp2net(float temp) { return 27316+(int)(temp*100); };
     static float net2temp(uint16_t temp) { return temp/100.0 - 273.16; };
 
+    // ****************** Statistics ******************
+
+    // Signed notifications waiting for their signature (including the one being signed)
+    int signQueued() { return _signCount; };
+    // Time (ms) from notify() to actual send for the last signed notification, and the max seen
+    unsigned long signLatency() { return _signLatency; };
+    unsigned long signLatencyMax() { return _signLatencyMax; };
+    // Ephemeral keypairs ready for key exchanges, and how many exchanges found one ready or not
+    int ephemeralReady() { return _ephemeral.count(); };
+    uint32_t ephemeralHits() { return _ephemeral.hits(); };
+    uint32_t ephemeralMisses() { return _ephemeral.misses(); };
+    // Multicast updates dropped because of their group
+    uint32_t groupDropped() { return _groupDropped; };
+
   protected:
     enum DomPktType : char {
       PKT_ANS = 'A',  // Answer packet (can *not* appear in multicast packet)
       PKT_CMD = 'C',  // Command (write)
       PKT_ENC = 'E',  // Encrypted Packet (contains signed/command/request)
       PKT_INF = 'I',  // Request info (read)
+      PKT_MAC = 'M',  // Authenticated packet (contains command/request/update): like PKT_SIG but with a symmetric key
       PKT_SIG = 'S',  // Signed packet (contains command/request) -- different format for unicast / multicast
       PKT_UPD = 'U',  // Multicast update (can *not* appear in unicast packet)
     };
@@ -131,17 +188,30 @@ class Domotic : public DomoticIODescr
     virtual int setAnalogInName(int i, const char *name) override { return 0; };        // Returns number of characters written
     virtual int setAnalogOutName(int o, const char *name) override { return 0; };       // Returns number of characters written
 
-    virtual void initMaps() {}; // Called by begin() to initialize IO mapping data (arrays are already allocated and initialized to 0)
+    virtual int tlen() { return 0; }; // Max length of the display message (register 0x05); 0 if there's no display
+    virtual void initMaps() {}; // Called by begin() to initialize IO mapping data (arrays are already allocated and initialized to 0); call indexGroups() if they change later
+                                // _restore can be set here too (all RESTORE_LAST by default)
+    virtual void initKeys() {}; // Called by begin() after loading saved keys: add the missing ones to _keys (and save it) as needed
     virtual void handler() {}; // Called by handle() to process application-specific logic in derived class and notify changes
 
     // No return: multicast packets don't send answers
+    // Only called for the groups in _groups (see subscribe())
     virtual void processNotification(UpdDir d, UpdType t, int group, uint16_t val, size_t size, int offset=0) {};
     virtual void processTimeUpdate(uint8_t epoch, uint32_t timestamp, int8_t tz, bool dst) {};
+    virtual void processDisplay(const char *text) {}; // New display message (register 0x05)
 
     // Probably the following methods will never need overrides
     // ********************************************************
 
     int recvPkt(); // Called by handleNet(); returns amount of available new data in _lastpkt
+    void indexGroups(); // Rebuild _groups from maps, group rules and subscriptions
+    void configChanged(); // Call after changing maps or names: bumps the configuration generation (saved by handleConfig()) and drops cached info answers
+    uint32_t configDigest(); // Hash of line counts, maps, restore policies, specs and keys: begin() bumps the generation if it changed since last boot
+    void handleConfig(); // Save the generation and digest of a configuration changed at runtime, so the next begin() doesn't bump again
+    void loadConfig(); // Called by begin()
+    bool saveConfig(); // Returns true in case of error
+    uint32_t stateDigest(); // Hash of all line states and configuration generation (see handleHeartbeat())
+    void outputsChanged(); // Call after driving outputs without writeDigitalOut()/writeAnalogOut(): schedules saving their state
 
     // Callbacks receive the offset in _lastpkt to start parsing from, for up to 'len' bytes.
     // If present, encrypted packets are decrypted and signed ones are verified) *before* callback.
@@ -167,8 +237,8 @@ class Domotic : public DomoticIODescr
     virtual DomError readDigitalOutSpec(uint8_t dout, int &len);	// Variable-len output
     virtual DomError readDigitalInSpec(uint8_t din, int &len);		// Variable-len output
 
-    // Send an answer to current packet (unicast)
-    void answer(DomError err, size_t size, int offset=0); // Answer with 'size' bytes from _lastpkt+offset
+    // Send an answer to current packet (unicast, to _remoteIP:_remotePort) and keep it for retransmissions
+    void answer(DomError err, size_t size, int offset=0); // Answer with 'size' bytes from _lastpkt+offset; overwrites _lastpkt
 
     // Send a notification (multicast)
     void notify(UpdDir d, UpdType t, uint8_t num, uint16_t signKey=0xFFFF);
@@ -180,12 +250,16 @@ class Domotic : public DomoticIODescr
     // At exit verified message starts at _lastpkt+offset and ends at _lastpkt+len
     // Modifies _lastpkt content with binary data and updates offset
     // If fast is true, then no pk crypto is performed -- notifiee can then choose to ask for signature check after inspecting packet contents (f.e. if time skew is too big)
+    // Signed data starts with a counter (saved in _signCtr and skipped by offset): stale or duplicated packets fail the fast check too
+    // Results are cached (see VerifyCache): checking the same packet again costs no pk crypto
+    // A full check blocks for about 900ms on ESP8266: signed requests are verified in background by handle() instead
     void verifySig(int &offset, int len, bool fast);
 
-    // Signs 0-terminated buffer contents using keyID
-    // Modifies buff to include signature and protocol markers, shifting current content as needed
-    // Returns true in case of error (unknown keyID, buffer too small, ...)
-    bool sigBuff(char* buff, uint16_t keyID);
+    // Queues 0-terminated buffer contents to be signed using keyID and multicast
+    // Signature is computed in time slices by handle(): packet is sent when it's ready
+    // With a symmetric (HMAC) key a PKT_MAC packet is sent right away instead
+    // Returns true in case of error (unknown keyID, message too long, queue full, ...)
+    bool sendSigned(const char* buff, uint16_t keyID);
 
     // Copy from src in PROGMEM to _lastpkt+pos
     // Returns number of copied bytes
@@ -204,15 +278,41 @@ class Domotic : public DomoticIODescr
     bool _initialized;
     uint8_t _lastpkt[DOMOTIC_MAX_PKT_SIZE+4];	// Account for A00 and terminator in answers
     IPAddress _mcastAddr;
+    IPAddress _remoteIP;	// Sender of the request being handled
+    uint16_t _remotePort;
+    AnswerCache _answers;	// Answers to recent requests, sent again for retransmissions
+    uint32_t _ansTicket;	// Entry of the request being handled (AnswerCache::NONE if not cached)
+    InfoCache _info;	// Cleared by configChanged() and network changes
+    IPAddress _infoIP;	// Address in the cached IR04 answer
     uint8_t _douts, _aouts, _dins, _ains, _tlen; // Total, for base + all detected extensions
     bool _utf;
     uint16_t *_doutMap, *_aoutMap, *_dinMap, *_ainMap, *_text;
+    // What begin() does with each output: digital ones, then analog ones (registers 0x29 and 0x2A)
+    enum RestorePolicy : uint8_t {
+      RESTORE_NONE = 'N',	// Leave it as the driver sets it
+      RESTORE_LAST = 'L',	// Saved state
+      RESTORE_OFF = '0'	// Off (analog: 0)
+    };
+    uint8_t *_restore;
 
     // Signature handling
+    KeyStore _keys;	// Node keys, loaded by begin()
     bool _isSigned;	// True iff packet contains a valid signature
     uint16_t _signKey;	// keyid of signing key if _isSigned, else 0
     int _signOffset;	// offset of (decoded-to-binary) signature is saved here
     int _signData;	// offset of signed data is saved here
+    uint32_t _signCtr;	// Counter at the start of signed data
+    uint32_t _signSender;	// Replay window of _signKey: sender address for HMAC keys (shared), else 0
+    ReplayFilter _replay;	// Counters of received and sent authenticated packets
+    VerifyCache _verified;	// Results of recent verifications
+    uint8_t _signDigest[VerifyCache::DIGEST_SIZE];	// Identifies the packet in _verified
+
+    // Encryption handling
+    SessionCache _sessions;	// Sessions set up by 'EK' packets
+    uint16_t _encSession;	// Session of the request being handled if it was encrypted (answer gets encrypted too), else 0
+    uint32_t _encCtr;	// Counter of the encrypted request, reused for its answer
+    EphemeralPool _ephemeral;	// Filled by handleCrypto() when idle
+    bool _canExchange;	// Some key supports key exchange: _ephemeral is worth filling
 
   private:
     static const int MAX_EXPS=8;
@@ -221,6 +321,193 @@ class Domotic : public DomoticIODescr
     bool _doNotScan;	// Set by disableScan()
     DomoNodeExpansion *_exps[MAX_EXPS];
     void handleNet();
+    void handleCrypto();
+    void handleRequest(int offset, int len); // Process the (unicast) request in _lastpkt and answer it
+    void handleSigned(int offset, int len); // Start verification of a signed (unicast) request
+    void handleEncrypted(int offset, int len); // Key exchange or encrypted (unicast) request
+    void handleMAC(int offset, int len); // Check and process an authenticated (unicast) request
+    bool verifyMAC(int &offset, int len); // Check a PKT_MAC header at offset, moving offset to the data; true if MAC is bad
+    bool fromController(); // True if the request is encrypted and signed with an Ed25519 key (not just MAC'd)
+    bool sendMAC(const char *buff, KeySlot *k);
+
+    // Registers: readers append the value of element idx (0 for scalar registers) at _lastpkt+len, arg is the
+    // offset of any parameter after the index; writers parse a value at offset, leaving offset past it, and set
+    // _regChanged if save must be called (once for all the elements written by a command)
+    typedef DomError (Domotic::*RegRead)(uint8_t reg, uint8_t idx, int arg, int &len);
+    typedef DomError (Domotic::*RegWrite)(uint8_t reg, uint8_t idx, int &offset);
+    typedef uint8_t (Domotic::*RegCount)(uint8_t reg);
+    typedef bool (Domotic::*RegSave)(); // Returns true in case of error
+    enum RegFlags : uint8_t {
+      REG_ARRAY = 0x01,	// Has count() elements
+      REG_RAW = 0x02,	// Writes aren't by element: write parses the whole command (idx is 0)
+      REG_STATIC = 0x04	// Only changes with the configuration: answer is kept in _info
+    };
+    struct Register {
+      uint8_t id;
+      uint8_t flags;
+      RegCount count;	// Only for REG_ARRAY
+      RegRead read;	// NULL if write-only
+      RegWrite write;	// NULL if read-only
+      RegSave save;	// NULL if there's nothing to save
+    };
+    static const Register REGISTERS[];	// In PROGMEM, sorted by id
+    bool findRegister(uint8_t id, Register &reg); // Returns true if id is not a register
+    DomError readRegister(const Register &reg, int offset, int &len); // IR, offset past the register id
+    DomError writeRegister(const Register &reg, int &offset); // CR, offset past the register id
+    bool _regChanged;
+    char *_display;	// Register 0x05: _tlen characters at most
+    // Network change (register 0x04 write), applied by handleNetConfig() once its answer is out
+    struct NetConfig {
+      bool pending;
+      unsigned long at;	// millis() of the write
+      char ssid[33];
+      char pass[65];
+      IPAddress ip, mask, gw;	// ip 0.0.0.0: DHCP
+    };
+    NetConfig _netConfig;
+    IPAddress _joinedIP;	// Local address when the multicast group was joined
+    void handleNetConfig(); // Apply a pending network change; join the multicast group again if the address changed
+    // Output states, saved DOMOTIC_OUTPUTS_SAVE_MS after the first change (at once to RTC memory)
+    bool _outPending;	// Changes not saved to flash yet
+    bool _outRtc;	// Changes not copied to RTC memory yet
+    unsigned long _outSince;	// millis() of the first change not saved
+    uint32_t _outSaved;	// Hash of the saved states: unchanged ones are not written again
+    size_t outputsSize();
+    void outputsImage(uint8_t *buff); // Current output states, as saved
+    bool checkOutputs(const uint8_t *buff, size_t len); // Returns true if buff is not a valid image for these lines
+    void restoreOutputs(); // Called by begin(), after loading maps and policies
+    bool saveOutputs(bool flash); // Returns true in case of error
+    void handleOutputs(); // Save changes when due
+
+    uint8_t keyCount(uint8_t reg) { return _keys.count(); };
+    uint8_t mapCount(uint8_t reg);
+    uint8_t ruleCount(uint8_t reg) { return RuleTable::MAX_RULES; };
+    uint8_t timerCount(uint8_t reg) { return TimerTable::MAX_TIMERS; };
+    uint8_t usubCount(uint8_t reg) { return DOMOTIC_MAX_USUBS; };
+    uint16_t *map(uint8_t reg); // Map of register 0x20-0x23
+    uint8_t restoreCount(uint8_t reg);
+    uint8_t *restore(uint8_t reg); // Policies of register 0x29 or 0x2A
+    DomError readNodeInfo(uint8_t reg, uint8_t idx, int arg, int &len); // 0x00
+    DomError readKey(uint8_t reg, uint8_t idx, int arg, int &len); // 0x01
+    DomError writeKey(uint8_t reg, uint8_t idx, int &offset);
+    bool saveKeys();
+    DomError readHostname(uint8_t reg, uint8_t idx, int arg, int &len); // 0x02
+    DomError readFlags(uint8_t reg, uint8_t idx, int arg, int &len); // 0x03
+    DomError readNetwork(uint8_t reg, uint8_t idx, int arg, int &len); // 0x04
+    DomError writeNetwork(uint8_t reg, uint8_t idx, int &offset);
+    DomError readDisplay(uint8_t reg, uint8_t idx, int arg, int &len); // 0x05
+    DomError writeDisplay(uint8_t reg, uint8_t idx, int &offset);
+    DomError readConfigGen(uint8_t reg, uint8_t idx, int arg, int &len); // 0x06
+    DomError readMap(uint8_t reg, uint8_t idx, int arg, int &len); // 0x20-0x23
+    DomError writeMap(uint8_t reg, uint8_t idx, int &offset);
+    bool loadMaps(); // Called by begin(), after initMaps(); returns true if saved maps are missing or for different lines
+    bool saveMaps();
+    DomError readRule(uint8_t reg, uint8_t idx, int arg, int &len); // 0x24
+    DomError writeRule(uint8_t reg, uint8_t idx, int &offset);
+    bool saveRules();
+    DomError readTimer(uint8_t reg, uint8_t idx, int arg, int &len); // 0x25 and 0x26
+    DomError writeTimer(uint8_t reg, uint8_t idx, int &offset);
+    DomError writeInterval(uint8_t reg, uint8_t idx, int &offset);
+    bool saveTimers();
+    DomError readJournal(uint8_t reg, uint8_t idx, int arg, int &len); // 0x27
+    DomError readUSub(uint8_t reg, uint8_t idx, int arg, int &len); // 0x28
+    DomError writeUSub(uint8_t reg, uint8_t idx, int &offset);
+    DomError readRestore(uint8_t reg, uint8_t idx, int arg, int &len); // 0x29 and 0x2A
+    DomError writeRestore(uint8_t reg, uint8_t idx, int &offset);
+    bool loadRestore(); // Called by begin(), after initMaps(); returns true if saved policies are missing or for different lines
+    bool saveRestore();
+
+    bool queueUSubs(const char *buff, char dir, char type, uint16_t group); // Returns true if multicast can be skipped
+    void flushUSub(int s); // Send batched updates to subscriber s
+    void flushUSubs(); // Send all batched updates, drop expired subscribers
+    DomError delayDigitalOut(uint8_t obj, int &offset, int &len); // Delayed or pulsed 'D' command
+    void applyRules(uint8_t source, uint16_t src, bool value); // Run the rules triggered by an input edge
+    void applyGroup(UpdType t, uint16_t group, uint16_t val); // Input update for group: rules and bound outputs
+    int updateOffset(int offset, int len); // Where the update in a (signed or MAC'd) multicast packet starts, or -1
+    bool startTimer(uint8_t t); // Returns true if timer has no interval
+    void runAction(uint8_t out, uint8_t action); // '0', '1' or 'T' on a digital output, notifying the change
+    void handleTimers(); // Run expired timers and delayed writes
+    void handleHeartbeat(); // Send the heartbeat when due
+    bool startVerify(int offset, int len, bool update=false, unsigned long rcv=0);
+    bool authUpdate(int offset, int len); // True if the multicast update at offset is worth verifying in background
+    void handleUpdate(int offset, int len, unsigned long rcv); // Multicast update, received at millis() rcv
+
+    LocalClock _clock;
+
+    // Multicast groups
+    static const int MAX_SUBS=16;
+    GroupIndex _groups;
+    uint16_t _subs[MAX_SUBS];	// 0: unused
+    uint32_t _groupDropped;
+    UpdateJournal _journal;	// Updates sent by notify()
+    uint32_t _configGen;	// Bumped by configChanged(), saved in DOMOTIC_CONFIG_FILE (register 0x06)
+    uint32_t _configDigest;	// configDigest() at begin() or after the last change, saved with _configGen
+    bool _configStale;	// Set by configChanged(): _configDigest is recomputed and saved by handleConfig()
+
+    // Unicast update subscribers
+    static const int USUB_BATCH=128;	// Updates batched per destination
+    enum USubMask : uint8_t {
+      USUB_ID = 0x01,	// Digital inputs
+      USUB_IA = 0x02,	// Analog inputs
+      USUB_OD = 0x04,	// Digital outputs
+      USUB_OA = 0x08,	// Analog outputs
+      USUB_ONLY = 0x10	// Matching updates are not multicast (needs an authenticated subscription)
+    };
+    struct USub {
+      IPAddress ip;
+      uint16_t port;	// 0: unused slot
+      uint8_t mask;
+      uint16_t from, to;	// Group range
+      unsigned long start, lease;	// millis(), ms
+      char batch[USUB_BATCH];
+      int len;
+    };
+    USub _usubs[DOMOTIC_MAX_USUBS];
+
+    // Heartbeat
+    unsigned long _hbMin, _hbMax, _hbInterval;	// ms
+    unsigned long _hbLast;	// millis() of the last heartbeat
+    uint16_t _hbKey;
+    static const int MAX_ANSWER=(DOMOTIC_MAX_PKT_SIZE-1-4-8)/4*3-3-SessionCache::TAG_SIZE;	// Longest answer that fits an encrypted packet too
+
+    // Local rules and timers
+    RuleTable _rules;	// Loaded by begin()
+    TimerTable _timers;	// Loaded by begin()
+    TimerWheel _wheel;	// Entries: timers, then delayed writes of outputs 0..DOMOTIC_MAX_DELAYED-1
+    uint8_t _delayed[DOMOTIC_MAX_DELAYED];	// Action of the delayed write of each output
+
+    // Background verification of signed requests and multicast updates
+    bool _verifying;
+    bool _pendUpdate;	// Multicast update: no answer
+    unsigned long _pendRcv;	// millis() when the update was received
+    Ed25519::VerifyContext _verifyCtx;
+    uint8_t _pendpkt[DOMOTIC_MAX_PKT_SIZE+4];	// Request waiting for its signature to be verified
+    int _pendOffset, _pendLen;
+    uint16_t _pendKey;
+    uint32_t _pendSignCtr;
+    uint8_t _pendDigest[VerifyCache::DIGEST_SIZE];
+    uint16_t _pendSession;	// Saved _encSession and _encCtr
+    uint32_t _pendCtr;
+    IPAddress _pendIP;
+    uint16_t _pendPort;
+    uint32_t _pendTicket;
+
+    // Background signing of notifications
+    static const int SIGN_QUEUE=4;
+    static const int SIG_B64LEN=88;	// Ed25519 signature, base64-encoded
+    static const int SIGN_MAXMSG=DOMOTIC_MAX_PKT_SIZE-1-4-SIG_B64LEN;	// Including the counter
+    struct SignJob {
+      uint16_t keyID;
+      unsigned long queued;	// millis() at sendSigned()
+      char msg[SIGN_MAXMSG];	// Counter and message, as signed
+    };
+    SignJob _signQueue[SIGN_QUEUE];	// Ring buffer: head is the one being signed
+    uint8_t _signHead, _signCount;
+    bool _signing;
+    Ed25519::SignContext _signCtx;
+    uint8_t _signPub[32];	// Copy of the public key: key could be removed while signing
+    uint8_t _signature[64];
+    unsigned long _signLatency, _signLatencyMax;
     // Obey the rule-of-three: Domotic must not be copied
     Domotic(const Domotic &src) = delete;
     Domotic &operator=(const Domotic &src) = delete;
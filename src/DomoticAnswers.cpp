@@ -0,0 +1,122 @@
+#include "Domotic.h"
+
+#include <string.h>
+
+AnswerCache::AnswerCache()
+: _tickets(NONE)
+{
+  memset(_entries, 0, sizeof(_entries));
+}
+
+uint32_t AnswerCache::hash(const uint8_t *req, size_t len)
+{
+  uint32_t h=2166136261UL;
+
+  while(len--) {
+    h^=*req++;
+    h*=16777619UL;
+  }
+  return h;
+}
+
+uint8_t AnswerCache::lookup(uint32_t ip, uint16_t port, uint32_t hash, uint32_t now, const uint8_t *&ans, size_t &len)
+{
+  for(int t=0; t<ENTRIES; ++t) {
+    Entry &e=_entries[t];
+    if(NONE==e.ticket || e.hash!=hash || e.ip!=ip || e.port!=port || now-e.stamp>LIFETIME)
+      continue;
+    if(!e.len)
+      return RES_PENDING;
+    ans=e.ans;
+    len=e.len;
+    return RES_DONE;
+  }
+  return RES_NONE;
+}
+
+uint32_t AnswerCache::open(uint32_t ip, uint16_t port, uint32_t hash, uint32_t now)
+{
+  Entry *e=_entries;
+
+  for(int t=0; t<ENTRIES; ++t) {
+    if(NONE==_entries[t].ticket) {
+      e=_entries+t;
+      break;
+    }
+    if(now-_entries[t].stamp>now-e->stamp)	// Oldest: largest age, across millis() wraparound
+      e=_entries+t;
+  }
+  if(NONE==++_tickets)
+    ++_tickets;
+  e->ticket=_tickets;
+  e->ip=ip;
+  e->port=port;
+  e->hash=hash;
+  e->stamp=now;
+  e->len=0;
+  return e->ticket;
+}
+
+AnswerCache::Entry *AnswerCache::entry(uint32_t ticket)
+{
+  if(NONE==ticket)
+    return NULL;
+  for(int t=0; t<ENTRIES; ++t) {
+    if(_entries[t].ticket==ticket)
+      return _entries+t;
+  }
+  return NULL;
+}
+
+void AnswerCache::store(uint32_t ticket, const uint8_t *ans, size_t len, uint32_t now)
+{
+  Entry *e=entry(ticket);
+
+  if(!e || e->len)
+    return;
+  if(!len || len>sizeof(e->ans)) {
+    e->ticket=NONE;
+    return;
+  }
+  memcpy(e->ans, ans, len);
+  e->len=len;
+  e->stamp=now;
+}
+
+void AnswerCache::forget(uint32_t ticket)
+{
+  Entry *e=entry(ticket);
+
+  if(e)
+    e->ticket=NONE;
+}
+
+InfoCache::InfoCache()
+: _count(0)
+, _used(0)
+{
+}
+
+bool InfoCache::get(uint32_t key, uint8_t *out, int &len)
+{
+  for(int t=0; t<_count; ++t) {
+    if(_entries[t].key==key) {
+      memcpy(out, _data+_entries[t].pos, _entries[t].len);
+      len=_entries[t].len;
+      return false;
+    }
+  }
+  return true;
+}
+
+void InfoCache::put(uint32_t key, const uint8_t *ans, int len)
+{
+  if(ENTRIES==_count || len<=0 || len>SIZE-_used)
+    return;
+  _entries[_count].key=key;
+  _entries[_count].pos=_used;
+  _entries[_count].len=len;
+  memcpy(_data+_used, ans, len);
+  _used+=len;
+  ++_count;
+}
@@ -0,0 +1,104 @@
+/*
+ * Answers kept for retransmitted requests, and answers that only change with the configuration
+ * Clients retry a request when its answer gets lost: a retried toggle must not flip the output back and a
+ * retried signed request must not pay for another signature check, so the first answer is sent again.
+ * Discovery sweeps read node info and line specs over and over: those are rendered only once.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// DOMOTIC_MAX_PKT_SIZE comes from Domotic.h, which includes this file
+
+// Requests whose answers are remembered, at most 255
+#ifndef DOMOTIC_ANSWER_CACHE
+#define DOMOTIC_ANSWER_CACHE 4
+#endif
+// ms an answer is kept: the same request (same bytes, from the same address and port) sent again
+// within this time gets the same answer and is not run again
+#ifndef DOMOTIC_ANSWER_CACHE_MS
+#define DOMOTIC_ANSWER_CACHE_MS 2000
+#endif
+// Bytes and entries (at most 255) for rendered info answers (see InfoCache)
+#ifndef DOMOTIC_INFO_CACHE_SIZE
+#define DOMOTIC_INFO_CACHE_SIZE 512
+#endif
+#ifndef DOMOTIC_INFO_CACHE_ENTRIES
+#define DOMOTIC_INFO_CACHE_ENTRIES 24
+#endif
+
+class AnswerCache
+{
+  public:
+    static const int ENTRIES=DOMOTIC_ANSWER_CACHE;
+    static const int MAX_SIZE=DOMOTIC_MAX_PKT_SIZE+4;	// As _lastpkt
+    static const uint32_t LIFETIME=DOMOTIC_ANSWER_CACHE_MS;
+    static const uint32_t NONE=0;	// Never returned by open()
+
+    enum Result : uint8_t {
+      RES_NONE = 0,	// Not in cache: a new request
+      RES_PENDING = 1,	// Still running (f.e. its signature is being verified): its answer will follow
+      RES_DONE = 2	// Answered: ans and len are set
+    };
+
+    AnswerCache();
+
+    // FNV-1a of the request as received
+    static uint32_t hash(const uint8_t *req, size_t len);
+    // now is millis()
+    uint8_t lookup(uint32_t ip, uint16_t port, uint32_t hash, uint32_t now, const uint8_t *&ans, size_t &len);
+    // Track a new request, replacing the oldest entry; returns the ticket to use with store() and forget()
+    uint32_t open(uint32_t ip, uint16_t port, uint32_t hash, uint32_t now);
+    // Remember the answer (the whole packet, as sent); ignored if the entry was replaced meanwhile
+    void store(uint32_t ticket, const uint8_t *ans, size_t len, uint32_t now);
+    // Drop an entry whose answer must not be repeated (f.e. ERR_BUSY)
+    void forget(uint32_t ticket);
+
+  private:
+    struct Entry {
+      uint32_t ticket;	// NONE if unused
+      uint32_t ip;
+      uint32_t hash;
+      uint32_t stamp;	// millis() when opened, then when answered
+      uint16_t port;
+      uint16_t len;	// 0 while pending
+      uint8_t ans[MAX_SIZE];
+    };
+    Entry _entries[ENTRIES];
+    uint32_t _tickets;	// Last ticket handed out
+
+    Entry *entry(uint32_t ticket);
+};
+
+// Answers to info requests that don't depend on line values (f.e. IR00, II specs), packed in a fixed buffer
+// Entries are only added, until the buffer is full; clear() drops them all when the configuration changes
+class InfoCache
+{
+  public:
+    static const int SIZE=DOMOTIC_INFO_CACHE_SIZE;
+    static const int ENTRIES=DOMOTIC_INFO_CACHE_ENTRIES;
+
+    InfoCache();
+
+    // Request identifier: the request characters after 'I' (f.e. 'R', 0x02 or 'I', 'D', 'O', line)
+    static uint32_t key(uint8_t a, uint8_t b, uint8_t c=0, uint8_t d=0)
+      { return ((uint32_t)a<<24)|((uint32_t)b<<16)|((uint32_t)c<<8)|d; };
+    // Copy the answer for key to out, setting len; returns true if it's not cached
+    bool get(uint32_t key, uint8_t *out, int &len);
+    // Add an answer; silently ignored if there's no space left
+    void put(uint32_t key, const uint8_t *ans, int len);
+    void clear() { _count=0; _used=0; };
+    int count() { return _count; };
+
+  private:
+    struct Entry {
+      uint32_t key;
+      uint16_t pos;
+      uint16_t len;
+    };
+    Entry _entries[ENTRIES];
+    uint8_t _data[SIZE];
+    uint8_t _count;
+    uint16_t _used;	// Bytes of _data
+};
@@ -0,0 +1,80 @@
+#include "DomoticClock.h"
+
+#include <Arduino.h>
+
+LocalClock::LocalClock()
+: _base(0)
+, _remote(0)
+, _anchor(0)
+, _anchorRemote(0)
+, _ppb(0)
+, _offset(0)
+, _jitter(0)
+, _updates(0)
+, _steps(0)
+, _tz(0)
+, _dst(false)
+, _synced(false)
+, _auth(false)
+{
+}
+
+uint64_t LocalClock::estimate(unsigned long at)
+{
+  unsigned long d=at-_base;
+  return _remote+d+(int64_t)d*_ppb/1000000000;
+}
+
+uint64_t LocalClock::now()
+{
+  if(!_synced)
+    return 0;
+
+  unsigned long at=millis();
+  uint64_t t=estimate(at);
+  if(at-_base>=0x40000000UL) {
+    // Rebase well before millis() wraps around
+    _remote=t;
+    _base=at;
+  }
+  return t;
+}
+
+bool LocalClock::update(unsigned long rcv, uint64_t remote, int8_t tz, bool dst, bool auth)
+{
+  if(_auth && !auth)
+    return true;
+  _auth|=auth;
+  _tz=tz;
+  _dst=dst;
+  ++_updates;
+
+  int64_t e=(int64_t)(remote-estimate(rcv));
+  if(!_synced || e>STEP_MS || e<-STEP_MS) {
+    // First update, or too far off to be drift: restart from here, keeping the drift estimate
+    _offset=_synced?(e>INT32_MAX?INT32_MAX:(e<-INT32_MAX?-INT32_MAX:(int32_t)e)):0;
+    _remote=remote;
+    _base=rcv;
+    _anchor=rcv;
+    _anchorRemote=remote;
+    _synced=true;
+    ++_steps;
+    return false;
+  }
+
+  unsigned long span=rcv-_anchor;
+  _remote=estimate(rcv)+e/2;
+  _base=rcv;
+  if(span>=MIN_SPAN) {
+    int64_t ppb=((int64_t)(remote-_anchorRemote)-(int64_t)span)*1000000000/(int64_t)span;
+    _ppb=ppb>MAX_PPB?MAX_PPB:(ppb<-MAX_PPB?-MAX_PPB:ppb);
+  }
+  if(span>=0x40000000UL) {
+    // Restart measuring before millis() wraps around
+    _anchor=rcv;
+    _anchorRemote=remote;
+  }
+  _offset=e;
+  _jitter+=((int32_t)(e<0?-e:e)-(int32_t)_jitter)/8;
+  return false;
+}
@@ -0,0 +1,57 @@
+/*
+ * Local clock disciplined by multicast time updates ('UT' packets)
+ * Each update gives the sender's time counter (seconds) at the moment the packet was received: the clock
+ * corrects half of its phase error at once, while drift is measured against the first update after the last
+ * reset, so its estimate gets better the longer the clock runs. After a few updates the clock follows the
+ * time server within tens of ms, and keeps doing so between updates.
+ * Time servers are expected to send updates right when their counter increments.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class LocalClock
+{
+  public:
+    static const int32_t STEP_MS=2000;	// Larger errors are stepped, not slewed
+    static const int32_t MAX_PPB=500000;	// Drift larger than 500ppm is not a crystal
+    static const unsigned long MIN_SPAN=60000;	// ms of updates needed to estimate drift
+
+    LocalClock();
+
+    // Time update: remote is the sender's time (ms) when the packet got received at local millis() rcv
+    // Once an authenticated update is seen, unauthenticated ones are ignored
+    // Returns true if the update got ignored
+    bool update(unsigned long rcv, uint64_t remote, int8_t tz, bool dst, bool auth);
+
+    bool synced() { return _synced; };
+    // Current time in ms (same epoch as the time counter); 0 if not synced
+    uint64_t now();
+    // Time zone (hours) and DST flag of the last accepted update
+    int8_t tz() { return _tz; };
+    bool dst() { return _dst; };
+
+    // Statistics
+    int32_t offset() { return _offset; };	// ms error of the last update vs the local estimate
+    uint32_t jitter() { return _jitter; };	// Average abs(offset), ms
+    int32_t skew() { return _ppb; };	// Estimated drift of millis(), ppb (positive: millis() is slow)
+    uint32_t updates() { return _updates; };
+    uint32_t steps() { return _steps; };	// Updates that reset the clock instead of adjusting it
+
+  private:
+    unsigned long _base;	// millis() at _remote
+    uint64_t _remote;
+    unsigned long _anchor;	// millis() of the update drift is measured from
+    uint64_t _anchorRemote;
+    int32_t _ppb;
+    int32_t _offset;
+    uint32_t _jitter;
+    uint32_t _updates, _steps;
+    int8_t _tz;
+    bool _dst;
+    bool _synced;
+    bool _auth;	// Seen an authenticated update
+
+    uint64_t estimate(unsigned long at);
+};
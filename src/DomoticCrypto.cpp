@@ -1,10 +1,829 @@
 #include "DomoticCrypto.h"
+#include "DomoticStorage.h"
 
 #include "crypto/Ed25519.h"
 #include "crypto/SHA512.h"
+#include <string.h>
+#if defined(ESP8266)
+#include <Arduino.h>
+#endif
+#define KEYSTORE_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_KEYSTORE_FILE)
+#define COUNTER_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_COUNTER_FILE)
+#define WINDOWS_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_WINDOWS_FILE)
 //#include <Crypto.h>
 //#include <Ed25519.h>
 //#include <utility/ProgMemUtil.h>
 //#include <string.h>
 
-RNGClass RNG=RNGClass();
+// ****************** KeySlot ******************
+
+KeySlot::KeySlot(uint16_t id)
+: _id(id)
+, _hasPriv(false)
+{
+  memset(_priv, 0, sizeof(_priv));
+  memset(_pub, 0, sizeof(_pub));
+}
+
+KeySlot::~KeySlot()
+{
+  clean(_priv);
+}
+
+KeySlot *KeySlot::initialize(uint8_t type, uint16_t id, const uint8_t *blob, const int blen)
+{
+  KeySlot *k=NULL;
+
+  // A proper factory pattern would only waste precious RAM
+  switch(type) {
+    case KEY_ED25519:
+      k=new Ed25519Slot(id);
+      break;
+    case KEY_CURVE25519:
+      k=new Curve25519Slot(id);
+      break;
+    case KEY_HMAC:
+      k=new HmacSlot(id);
+      break;
+  }
+  if(!k)
+    return NULL;
+
+  if(KEY_HMAC==type) {
+    if(!blob) {
+      RNG.rand(k->_priv, sizeof(k->_priv));
+      if(!RNG.healthy()) {
+        delete k; // The destructor wipes the secret
+        return NULL;
+      }
+    } else if(sizeof(k->_priv)==blen || sizeof(k->_priv)+sizeof(k->_pub)==blen) {
+      memcpy(k->_priv, blob, sizeof(k->_priv));
+    } else {
+      delete k;
+      return NULL;
+    }
+    k->_hasPriv=true;
+    // Fingerprint takes the place of the public key
+    uint8_t fp[64];
+    SHA512 hash;
+    hash.update(k->_priv, sizeof(k->_priv));
+    hash.finalize(fp, sizeof(fp));
+    memcpy(k->_pub, fp, sizeof(k->_pub));
+    return k;
+  }
+
+  if(!blob) {
+    // Generate a new keypair
+    if(KEY_ED25519==type) {
+      Ed25519::generatePrivateKey(k->_priv);
+      Ed25519::derivePublicKey(k->_pub, k->_priv);
+    } else {
+      Curve25519::dh1(k->_pub, k->_priv);
+    }
+    if(!RNG.healthy()) {
+      delete k;
+      return NULL;
+    }
+    k->_hasPriv=true;
+  } else if(sizeof(k->_pub)==blen) {
+    // Public key only
+    memcpy(k->_pub, blob, sizeof(k->_pub));
+  } else if(sizeof(k->_priv)+sizeof(k->_pub)==blen) {
+    memcpy(k->_priv, blob, sizeof(k->_priv));
+    memcpy(k->_pub, blob+sizeof(k->_priv), sizeof(k->_pub));
+    k->_hasPriv=true;
+  } else {
+    delete k;
+    return NULL;
+  }
+  return k;
+}
+
+// ****************** Ed25519Slot ******************
+
+const union KeySlot::cypherCaps Ed25519Slot::getCaps()
+{
+  union cypherCaps x;
+  x.intval=0;
+  x.sign=_hasPriv;
+  x.verify=1;
+  return x;
+}
+
+bool Ed25519Slot::sign(const uint8_t *src, const int slen, uint8_t *dst, int *dlen)
+{
+  if(dlen) *dlen=64;
+  if(!_hasPriv || !dst)
+    return true;
+  Ed25519::sign(dst, _priv, _pub, src, slen);
+  return false;
+}
+
+bool Ed25519Slot::verify(const uint8_t *src, const int slen, const uint8_t *sig, int *sigLen, bool fast)
+{
+  if(sigLen) *sigLen=64;
+  if(!sig)
+    return true;
+  if(fast)
+    return false;
+  return !Ed25519::verify(sig, _pub, src, slen);
+}
+
+// ****************** Curve25519Slot ******************
+
+const union KeySlot::cypherCaps Curve25519Slot::getCaps()
+{
+  union cypherCaps x;
+  x.intval=0;
+  x.keyexch=_hasPriv;
+  return x;
+}
+
+bool Curve25519Slot::keyExchange(uint8_t *shared, const uint8_t *peerPub)
+{
+  if(!_hasPriv)
+    return true;
+  uint8_t f[32];
+  memcpy(f, _priv, sizeof(f)); // dh2() destroys it
+  memcpy(shared, peerPub, 32);
+  bool ok=Curve25519::dh2(shared, f);
+  clean(f);
+  return !ok;
+}
+
+// ****************** HmacSlot ******************
+
+const union KeySlot::cypherCaps HmacSlot::getCaps()
+{
+  union cypherCaps x;
+  x.intval=0;
+  x.sign=1;
+  x.verify=1;
+  return x;
+}
+
+bool HmacSlot::sign(const uint8_t *src, const int slen, uint8_t *dst, int *dlen)
+{
+  if(dlen) *dlen=MAC_LEN;
+  if(!dst)
+    return true;
+  SHA512 hash;
+  hash.resetHMAC(_priv, sizeof(_priv));
+  hash.update(src, slen);
+  hash.finalizeHMAC(_priv, sizeof(_priv), dst, MAC_LEN);
+  return false;
+}
+
+bool HmacSlot::verify(const uint8_t *src, const int slen, const uint8_t *sig, int *sigLen, bool fast)
+{
+  if(sigLen) *sigLen=MAC_LEN;
+  if(!sig)
+    return true;
+  if(fast)
+    return false;
+  uint8_t mac[MAC_LEN];
+  sign(src, slen, mac, NULL);
+  bool ok=secure_compare(mac, sig, MAC_LEN);
+  clean(mac);
+  return !ok;
+}
+
+bool HmacSlot::signFrom(const uint8_t sender[4], const uint8_t *src, const int slen, uint8_t *dst)
+{
+  SHA512 hash;
+  hash.resetHMAC(_priv, sizeof(_priv));
+  hash.update(sender, 4);
+  hash.update(src, slen);
+  hash.finalizeHMAC(_priv, sizeof(_priv), dst, MAC_LEN);
+  return false;
+}
+
+bool HmacSlot::verifyFrom(const uint8_t sender[4], const uint8_t *src, const int slen, const uint8_t *sig)
+{
+  uint8_t mac[MAC_LEN];
+  signFrom(sender, src, slen, mac);
+  bool ok=secure_compare(mac, sig, MAC_LEN);
+  clean(mac);
+  return !ok;
+}
+
+// ****************** KeyStore ******************
+
+KeyStore::KeyStore()
+: _count(0)
+{
+  for(int t=0; t<MAX_SLOTS; ++t)
+    _slots[t]=NULL;
+  for(int t=0; t<BUCKETS; ++t)
+    _index[t]=-1;
+}
+
+KeyStore::~KeyStore()
+{
+  for(int t=0; t<_count; ++t) {
+    delete _slots[t];
+    _slots[t]=NULL;
+  }
+}
+
+KeySlot *KeyStore::find(uint16_t id)
+{
+  // Linear probing: table is never more than half full, so the chain is short
+  for(int b=bucket(id), n=0; n<BUCKETS; ++n, b=(b+1)&(BUCKETS-1)) {
+    if(_index[b]<0)
+      return NULL;
+    if(_slots[_index[b]]->getID()==id)
+      return _slots[_index[b]];
+  }
+  return NULL;
+}
+
+bool KeyStore::add(KeySlot *k)
+{
+  if(!k)
+    return true;
+  if(MAX_SLOTS==_count || find(k->getID())) {
+    delete k;
+    return true;
+  }
+
+  int b=bucket(k->getID());
+  while(_index[b]>=0)
+    b=(b+1)&(BUCKETS-1);
+  _index[b]=_count;
+  _slots[_count++]=k;
+  return false;
+}
+
+bool KeyStore::remove(uint16_t id)
+{
+  for(int t=0; t<_count; ++t) {
+    if(_slots[t]->getID()==id) {
+      delete _slots[t];
+      memmove(_slots+t, _slots+t+1, (_count-t-1)*sizeof(_slots[0]));
+      _slots[--_count]=NULL;
+      reindex(); // Removals are rare: no need for tombstones
+      return false;
+    }
+  }
+  return true;
+}
+
+void KeyStore::reindex()
+{
+  for(int t=0; t<BUCKETS; ++t)
+    _index[t]=-1;
+  for(int t=0; t<_count; ++t) {
+    int b=bucket(_slots[t]->getID());
+    while(_index[b]>=0)
+      b=(b+1)&(BUCKETS-1);
+    _index[b]=t;
+  }
+}
+
+/*
+ * Saved keystore layout:
+ *  <'D'> <'K'> <version> <count>
+ *  count times: <type> <flags (bit0: private key present)> <id (big endian)> <pubkey (32)> [<privkey (32)>]
+ *  <crc8 of all the preceding bytes>
+ */
+static const size_t KEYSTORE_HDRSIZE=4;
+static const size_t KEYSTORE_RECSIZE=4+32+32;
+
+// Whole-file I/O on the backing storage; both return true in case of error
+bool KeyStore::load()
+{
+  uint8_t buff[KEYSTORE_HDRSIZE+MAX_SLOTS*KEYSTORE_RECSIZE+1];
+  size_t len=0;
+  bool err=true;
+
+  if(storageRead(KEYSTORE_PATH, buff, sizeof(buff), len))
+    return true;
+
+  if(len>KEYSTORE_HDRSIZE
+      && 'D'==buff[0] && 'K'==buff[1] && FILE_VERSION==buff[2] && buff[3]<=MAX_SLOTS
+      && crypto_crc8(FILE_VERSION, buff, len-1)==buff[len-1]) {
+    KeySlot *loaded[MAX_SLOTS];
+    int cnt=0;
+    size_t pos=KEYSTORE_HDRSIZE;
+
+    err=false;
+    while(cnt<buff[3] && !err) {
+      if(pos+4+32>len-1) {
+        err=true;
+        break;
+      }
+      uint8_t type=buff[pos];
+      int blen=(buff[pos+1]&1)?64:32;
+      uint16_t id=(buff[pos+2]<<8)|buff[pos+3];
+      uint8_t blob[64];
+      pos+=4;
+      if(pos+blen>len-1) {
+        err=true;
+        break;
+      }
+      // Blob for initialize() has private key first
+      if(64==blen) {
+        memcpy(blob, buff+pos+32, 32);
+        memcpy(blob+32, buff+pos, 32);
+      } else {
+        memcpy(blob, buff+pos, 32);
+      }
+      pos+=blen;
+      loaded[cnt]=KeySlot::initialize(type, id, blob, blen);
+      clean(blob);
+      if(!loaded[cnt])
+        err=true;
+      else
+        ++cnt;
+    }
+
+    if(!err) {
+      // Saved copy is valid: replace current contents
+      for(int t=0; t<_count; ++t) {
+        delete _slots[t];
+        _slots[t]=NULL;
+      }
+      _count=0;
+      reindex();
+      for(int t=0; t<cnt; ++t)
+        add(loaded[t]);
+    } else {
+      for(int t=0; t<cnt; ++t)
+        delete loaded[t];
+    }
+  }
+  clean(buff);
+  return err;
+}
+
+bool KeyStore::save()
+{
+  uint8_t buff[KEYSTORE_HDRSIZE+MAX_SLOTS*KEYSTORE_RECSIZE+1];
+  size_t pos=0;
+
+  buff[pos++]='D';
+  buff[pos++]='K';
+  buff[pos++]=FILE_VERSION;
+  buff[pos++]=_count;
+  for(int t=0; t<_count; ++t) {
+    KeySlot *k=_slots[t];
+    const uint8_t *priv=k->getPrivate();
+    buff[pos++]=k->getType();
+    buff[pos++]=priv?1:0;
+    buff[pos++]=k->getID()>>8;
+    buff[pos++]=k->getID()&0xFF;
+    memcpy(buff+pos, k->getPublic(), 32);
+    pos+=32;
+    if(priv) {
+      memcpy(buff+pos, priv, 32);
+      pos+=32;
+    }
+  }
+  buff[pos]=crypto_crc8(FILE_VERSION, buff, pos);
+  ++pos;
+
+  bool err=storageWrite(KEYSTORE_PATH, buff, pos);
+  clean(buff);
+  // Drop the superseded copy from the log: it could hold a replaced private key
+  return err || storageCompact();
+}
+
+// ****************** SessionCache ******************
+
+SessionCache::SessionCache()
+: _useCtr(0)
+{
+  memset(_sessions, 0, sizeof(_sessions));
+}
+
+SessionCache::~SessionCache()
+{
+  clean(_sessions);
+}
+
+/*
+ * Both parties compute
+ *  rxKey || txKey = SHA512(dh(ephemerals) || dh(peer ephemeral, node static) || peer ephemeral || node ephemeral)
+ * The ephemeral-ephemeral secret gives forward secrecy, the static one proves the node's identity to the peer.
+ */
+SessionCache::Session *SessionCache::establish(uint32_t peer, KeySlot *k, const uint8_t *peerEph, uint8_t *ephPriv, const uint8_t *ephPub)
+{
+  uint8_t secret[64];
+  SHA512 hash;
+  Session *s=NULL;
+
+  if(!k || !k->getCaps().keyexch || !RNG.healthy())
+    return NULL; // The session ID and the node ephemeral could be guessed
+
+  memcpy(secret, peerEph, 32);
+  bool err=!Curve25519::dh2(secret, ephPriv);
+  err|=k->keyExchange(secret+32, peerEph);
+  if(err) {
+    clean(secret);
+    return NULL;
+  }
+  hash.update(secret, sizeof(secret));
+  hash.update(peerEph, 32);
+  hash.update(ephPub, 32);
+  hash.finalize(secret, sizeof(secret));
+
+  // Reuse peer's slot, else a free one, else the least recently used
+  for(int t=0; t<MAX_SESSIONS && !s; ++t)
+    if(_sessions[t].id && _sessions[t].peer==peer)
+      s=_sessions+t;
+  for(int t=0; t<MAX_SESSIONS && !s; ++t)
+    if(!_sessions[t].id)
+      s=_sessions+t;
+  if(!s) {
+    s=_sessions;
+    for(int t=1; t<MAX_SESSIONS; ++t)
+      if((int32_t)(_sessions[t].lastUse-s->lastUse)<0) // Wrap-safe "older than"
+        s=_sessions+t;
+  }
+
+  // Random, nonzero, unique session ID
+  uint16_t id;
+  bool dup;
+  do {
+    RNG.rand((uint8_t *)&id, sizeof(id));
+    dup=!id;
+    for(int t=0; t<MAX_SESSIONS; ++t)
+      dup|=(_sessions[t].id==id);
+  } while(dup);
+  s->id=id;
+  s->peer=peer;
+  s->rxCtr=0;
+  s->lastUse=++_useCtr;
+  memcpy(s->rxKey, secret, sizeof(s->rxKey));
+  memcpy(s->txKey, secret+32, sizeof(s->txKey));
+  clean(secret);
+  return s;
+}
+
+SessionCache::Session *SessionCache::find(uint16_t id, uint32_t peer)
+{
+  if(!id)
+    return NULL;
+  for(int t=0; t<MAX_SESSIONS; ++t)
+    if(_sessions[t].id==id && _sessions[t].peer==peer)
+      return _sessions+t;
+  return NULL;
+}
+
+void SessionCache::drop(uint16_t id)
+{
+  for(int t=0; t<MAX_SESSIONS; ++t)
+    if(id && _sessions[t].id==id)
+      clean(_sessions[t]);
+}
+
+int SessionCache::count()
+{
+  int cnt=0;
+  for(int t=0; t<MAX_SESSIONS; ++t)
+    if(_sessions[t].id)
+      ++cnt;
+  return cnt;
+}
+
+// Nonce is the big-endian counter, right-aligned: the two directions use different keys
+static void sessionNonce(uint8_t *nonce, uint32_t ctr)
+{
+  memset(nonce, 0, ChaChaPoly::NONCE_SIZE);
+  nonce[8]=ctr>>24;
+  nonce[9]=ctr>>16;
+  nonce[10]=ctr>>8;
+  nonce[11]=ctr;
+}
+
+bool SessionCache::open(Session *s, uint32_t ctr, const uint8_t *ad, size_t adlen, uint8_t *data, size_t len)
+{
+  uint8_t nonce[ChaChaPoly::NONCE_SIZE];
+
+  if(!s || ctr<=s->rxCtr)
+    return true;
+  sessionNonce(nonce, ctr);
+  if(!ChaChaPoly::decrypt(data, len, data+len, ad, adlen, s->rxKey, nonce))
+    return true;
+  s->rxCtr=ctr;
+  s->lastUse=++_useCtr;
+  return false;
+}
+
+void SessionCache::seal(Session *s, uint32_t ctr, const uint8_t *ad, size_t adlen, uint8_t *data, size_t len)
+{
+  uint8_t nonce[ChaChaPoly::NONCE_SIZE];
+
+  sessionNonce(nonce, ctr);
+  ChaChaPoly::encrypt(data, len, data+len, ad, adlen, s->txKey, nonce);
+}
+
+// ****************** ReplayFilter ******************
+
+ReplayFilter::ReplayFilter()
+: _useCtr(0)
+, _tx(0)
+, _txReserved(0)
+{
+  memset(_windows, 0, sizeof(_windows));
+}
+
+bool ReplayFilter::isReplay(uint16_t key, uint32_t sender, uint32_t ctr)
+{
+  if(!ctr)
+    return true; // Counters start from 1
+  for(int t=0; t<WINDOWS; ++t) {
+    Window &w=_windows[t];
+    if(!w.used || w.key!=key || w.sender!=sender)
+      continue;
+    if(ctr>w.top)
+      return false;
+    uint32_t age=w.top-ctr;
+    return age>=WINDOW || ((w.seen>>age)&1);
+  }
+  return false; // No packets accepted yet
+}
+
+void ReplayFilter::accept(uint16_t key, uint32_t sender, uint32_t ctr)
+{
+  Window *w=NULL;
+  for(int t=0; t<WINDOWS && !w; ++t)
+    if(_windows[t].used && _windows[t].key==key && _windows[t].sender==sender)
+      w=_windows+t;
+  for(int t=0; t<WINDOWS && !w; ++t)
+    if(!_windows[t].used)
+      w=_windows+t;
+  if(!w) {
+    // More senders than windows: forgetting the least recently used one is the lesser evil
+    w=_windows;
+    for(int t=1; t<WINDOWS; ++t)
+      if((int32_t)(_windows[t].lastUse-w->lastUse)<0) // Wrap-safe "older than"
+        w=_windows+t;
+  }
+  w->lastUse=++_useCtr;
+  if(!w->used || w->key!=key || w->sender!=sender) {
+    w->used=true;
+    w->sender=sender;
+    w->key=key;
+    w->top=ctr;
+    w->seen=1;
+    w->flashed=false;
+  } else if(ctr>w->top) {
+    uint32_t shift=ctr-w->top;
+    w->seen=(shift>=WINDOW)?0:(w->seen<<shift);
+    w->seen|=1;
+    w->top=ctr;
+  } else {
+    if(w->top-ctr<WINDOW)
+      w->seen|=((uint64_t)1)<<(w->top-ctr);
+    return;
+  }
+  // Before the packet is acted upon: a reset can't make it acceptable again, a power loss only within TX_BLOCK
+  save(!w->flashed || w->top/TX_BLOCK!=w->saved/TX_BLOCK);
+}
+
+void ReplayFilter::forget(uint16_t key)
+{
+  for(int t=0; t<WINDOWS; ++t)
+    if(_windows[t].key==key)
+      _windows[t].used=false;
+  save(true);
+}
+
+/*
+ * Saved windows layout: <'D'> <'W'> <count> {<key:2> <sender:4> <top:4>}* <crc8 of the preceding bytes>
+ * Multi-byte values are big endian (sender as in memory); a loaded window has seen all the counters up to top
+ * The same image is kept in RTC user memory on ESP8266, rounded up to 4-byte blocks
+ */
+static const uint8_t WINDOWS_TAG=2;
+static const int WINDOWS_HDRSIZE=3;
+static const int WINDOWS_RECSIZE=10;
+static const size_t WINDOWS_BLOCKS=(WINDOWS_HDRSIZE+ReplayFilter::WINDOWS*WINDOWS_RECSIZE+1+3)&~3;
+#if defined(ESP8266)
+// The image fits in its 128 bytes of RTC user memory
+static const bool WINDOWS_RTC=DOMOTIC_WINDOWS_RTC>=0 && WINDOWS_BLOCKS<=128;
+#endif
+
+bool ReplayFilter::save(bool flash)
+{
+  uint32_t image[WINDOWS_BLOCKS/4];	// Aligned for RTC memory
+  uint8_t *buff=(uint8_t *)image;
+  size_t pos=WINDOWS_HDRSIZE;
+
+  buff[0]='D';
+  buff[1]='W';
+  for(int t=0; t<WINDOWS; ++t) {
+    const Window &w=_windows[t];
+    if(!w.used)
+      continue;
+    buff[pos++]=w.key>>8;
+    buff[pos++]=w.key;
+    memcpy(buff+pos, &w.sender, 4);
+    pos+=4;
+    for(int b=0; b<4; ++b)
+      buff[pos++]=w.top>>(24-8*b);
+  }
+  buff[2]=(pos-WINDOWS_HDRSIZE)/WINDOWS_RECSIZE;
+  buff[pos]=crypto_crc8(WINDOWS_TAG, buff, pos);
+#if defined(ESP8266)
+  if(WINDOWS_RTC)
+    ESP.rtcUserMemoryWrite(DOMOTIC_WINDOWS_RTC, image, (pos+1+3)&~3);
+#endif
+  if(!flash)
+    return false;
+  if(storageWrite(WINDOWS_PATH, buff, pos+1))
+    return true;
+  for(int t=0; t<WINDOWS; ++t) {
+    _windows[t].flashed=true;
+    _windows[t].saved=_windows[t].top;
+  }
+  return false;
+}
+
+// Windows from a saved image; returns true if it's not valid (windows are left untouched)
+bool ReplayFilter::loadImage(const uint8_t *buff, size_t len)
+{
+  if(len<=WINDOWS_HDRSIZE || 'D'!=buff[0] || 'W'!=buff[1] || buff[2]>WINDOWS
+      || len!=(size_t)(WINDOWS_HDRSIZE+buff[2]*WINDOWS_RECSIZE+1) || crypto_crc8(WINDOWS_TAG, buff, len-1)!=buff[len-1])
+    return true;
+  memset(_windows, 0, sizeof(_windows));
+  for(int t=0; t<buff[2]; ++t) {
+    const uint8_t *p=buff+WINDOWS_HDRSIZE+t*WINDOWS_RECSIZE;
+    Window &w=_windows[t];
+    w.used=true;
+    w.key=(p[0]<<8)|p[1];
+    memcpy(&w.sender, p+2, 4);
+    w.top=((uint32_t)p[6]<<24) | ((uint32_t)p[7]<<16) | (p[8]<<8) | p[9];
+    w.seen=~(uint64_t)0;
+  }
+  return false;
+}
+
+/*
+ * Saved counter layout: <'D'> <'C'> <reserved counter (big endian, 4 bytes)> <crc8 of the preceding bytes>
+ * Counters up to the saved one may have been used before the reboot: start right after it
+ */
+static const uint8_t COUNTER_TAG=1;
+
+bool ReplayFilter::load()
+{
+  uint8_t buff[7];
+  uint32_t image[WINDOWS_BLOCKS/4];	// Aligned for RTC memory
+  uint8_t *win=(uint8_t *)image;
+  size_t len=0;
+
+  // Missing or corrupted windows: only packets authenticated after the last boot are known
+  if(!storageRead(WINDOWS_PATH, win, sizeof(image), len) && !loadImage(win, len)) {
+    for(int t=0; t<WINDOWS; ++t) {
+      _windows[t].flashed=_windows[t].used;
+      _windows[t].saved=_windows[t].top;
+    }
+  }
+#if defined(ESP8266)
+  // The RTC memory copy is never older than the flash one, but it's lost when power goes off
+  Window flash[WINDOWS];
+  memcpy(flash, _windows, sizeof(flash));
+  if(WINDOWS_RTC && ESP.rtcUserMemoryRead(DOMOTIC_WINDOWS_RTC, image, sizeof(image)) && win[2]<=WINDOWS
+      && !loadImage(win, WINDOWS_HDRSIZE+win[2]*WINDOWS_RECSIZE+1)) {
+    for(int t=0; t<WINDOWS; ++t)
+      for(int f=0; f<WINDOWS; ++f)
+        if(_windows[t].used && flash[f].flashed && flash[f].key==_windows[t].key
+            && flash[f].sender==_windows[t].sender) {
+          _windows[t].flashed=true;
+          _windows[t].saved=flash[f].saved;
+        }
+  }
+#endif
+
+  len=0;
+  if(storageRead(COUNTER_PATH, buff, sizeof(buff), len))
+    return true;
+  if(sizeof(buff)!=len || 'D'!=buff[0] || 'C'!=buff[1] || crypto_crc8(COUNTER_TAG, buff, 6)!=buff[6])
+    return true;
+  _tx=_txReserved=((uint32_t)buff[2]<<24) | ((uint32_t)buff[3]<<16) | (buff[4]<<8) | buff[5];
+  return false;
+}
+
+uint32_t ReplayFilter::nextTx()
+{
+  if(_tx>=_txReserved) {
+    // Reserve a new block before using it: one flash write every TX_BLOCK packets
+    uint32_t res=_tx+TX_BLOCK;
+    uint8_t buff[7]={ 'D', 'C', (uint8_t)(res>>24), (uint8_t)(res>>16), (uint8_t)(res>>8), (uint8_t)res, 0 };
+    if(res<_tx)
+      return 0; // Exhausted: keys must be replaced
+    buff[6]=crypto_crc8(COUNTER_TAG, buff, 6);
+    if(storageWrite(COUNTER_PATH, buff, sizeof(buff)))
+      return 0;
+    _txReserved=res;
+  }
+  return ++_tx;
+}
+
+// ****************** VerifyCache ******************
+
+VerifyCache::VerifyCache()
+{
+  memset(_entries, 0, sizeof(_entries));
+}
+
+void VerifyCache::digest(uint8_t out[DIGEST_SIZE], const uint8_t *sig, size_t sigLen, const uint8_t *data, size_t len)
+{
+  SHA512 hash;
+
+  hash.update(sig, sigLen);
+  hash.update(data, len);
+  hash.finalize(out, DIGEST_SIZE);
+}
+
+uint8_t VerifyCache::lookup(uint16_t key, const uint8_t *digest, uint32_t now)
+{
+  for(int t=0; t<ENTRIES; ++t) {
+    Entry &e=_entries[t];
+    if(e.result && e.key==key && now-e.stamp<LIFETIME && !memcmp(e.digest, digest, DIGEST_SIZE))
+      return e.result;
+  }
+  return RES_NONE;
+}
+
+void VerifyCache::store(uint16_t key, const uint8_t *digest, uint8_t result, uint32_t now)
+{
+  Entry *e=NULL;
+  for(int t=0; t<ENTRIES && !e; ++t)
+    if(_entries[t].result && _entries[t].key==key && !memcmp(_entries[t].digest, digest, DIGEST_SIZE))
+      e=_entries+t;
+  if(!e) {
+    // Unused or expired entries first, else the oldest one
+    e=_entries;
+    for(int t=0; t<ENTRIES; ++t) {
+      Entry &c=_entries[t];
+      if(!c.result || now-c.stamp>=LIFETIME) {
+        e=&c;
+        break;
+      }
+      if(now-c.stamp>now-e->stamp)
+        e=&c;
+    }
+    e->key=key;
+    memcpy(e->digest, digest, DIGEST_SIZE);
+  }
+  e->result=result;
+  e->stamp=now;
+}
+
+void VerifyCache::forget(uint16_t key)
+{
+  for(int t=0; t<ENTRIES; ++t)
+    if(_entries[t].key==key)
+      _entries[t].result=RES_NONE;
+}
+
+// ****************** EphemeralPool ******************
+
+EphemeralPool::EphemeralPool()
+: _count(0)
+, _generating(false)
+, _hits(0)
+, _misses(0)
+{
+}
+
+EphemeralPool::~EphemeralPool()
+{
+  clean(_pairs, sizeof(_pairs));
+  clean(&_next, sizeof(_next));
+  if(_generating)
+    Curve25519::dh1Abort(_ctx);
+}
+
+void EphemeralPool::take(uint8_t pub[32], uint8_t priv[32])
+{
+  if(!_count) {
+    ++_misses;
+    Curve25519::dh1(pub, priv);
+    return;
+  }
+  ++_hits;
+  --_count;
+  memcpy(pub, _pairs[_count].pub, 32);
+  memcpy(priv, _pairs[_count].priv, 32);
+  clean(_pairs+_count, sizeof(_pairs[_count]));
+}
+
+bool EphemeralPool::step(uint8_t bits)
+{
+  if(_count==SIZE)
+    return true;
+  if(!_generating) {
+    Curve25519::dh1Start(_ctx, _next.pub, _next.priv);
+    _generating=true;
+  }
+  if(Curve25519::dh1Step(_ctx, bits)) {
+    _generating=false;
+    memcpy(_pairs+_count, &_next, sizeof(_next));
+    clean(&_next, sizeof(_next));
+    ++_count;
+  }
+  return false;
+}
@@ -1,7 +1,7 @@
 /*
  * Methods and definitions for crypto-related ops in Domotic lib
  * Selected files from https://github.com/rweather/arduinolibs/
- * except RNGClass that have been rewritten to wrap ESP8266's TRNG
+ * except RNGClass that have been rewritten as a DRBG seeded by ESP8266's TRNG
  * Some ideas mediated from NaCl https://nacl.cr.yp.to/
  * TODO: check https://github.com/jedisct1/libhydrogen
 */
@@ -12,11 +12,38 @@
 #include "RNG.h"
 #include <crypto/Crypto.h>
 #include <crypto/Ed25519.h>
+#include <crypto/Curve25519.h>
+#include <crypto/ChaChaPoly.h>
+
+// Where the keystore is saved: a file in LittleFS on ESP8266, a file in current directory on host builds
+#define DOMOTIC_KEYSTORE_FILE "/domotic.keys"
+// Same, for the reserved block of counters for sent packets
+#define DOMOTIC_COUNTER_FILE "/domotic.ctr"
+// Same, for the highest counter accepted from every key and sender
+#define DOMOTIC_WINDOWS_FILE "/domotic.rx"
+// Replay windows: one for every Ed25519 key, one for every sender of every HMAC key
+#ifndef DOMOTIC_MAX_WINDOWS
+#define DOMOTIC_MAX_WINDOWS 12
+#endif
+// ESP8266: 4-byte block of RTC user memory where the windows are kept at once (they survive resets but not power
+// losses); they take up to 128 bytes (DOMOTIC_MAX_WINDOWS up to 12). Blocks 0-31 belong to the OTA loader.
+// -1 to keep them only in flash
+#ifndef DOMOTIC_WINDOWS_RTC
+#define DOMOTIC_WINDOWS_RTC 32
+#endif
 
 // Base class for all the keyslots (key instances)
-// must be initialized by calling initialize()
+// must be created by calling initialize()
 class KeySlot {
   public:
+    // Key types, as saved in the keystore
+    enum KeyType : uint8_t {
+      KEY_NONE = 0,
+      KEY_ED25519 = 1,
+      KEY_CURVE25519 = 2,
+      KEY_HMAC = 3,
+    };
+
     union cypherCaps {
       struct {
         uint32_t crypt:1;
@@ -28,15 +55,27 @@ class KeySlot {
       uint32_t intval;
     };
 
-    // Initialize actual key material
+    // Create a keyslot of the requested type and initialize actual key material
     // If blob is NULL, key is initialized from RNGClass (useful for asymmetric keys).
-    static KeySlot& initialize(uint16_t id, const uint8_t *blob, const int blen);
+    // For asymmetric keys blob can be 32 bytes (public key only) or 64 bytes (private key followed by public key)
+    // For symmetric keys blob is the 32-byte secret, optionally followed by its fingerprint (ignored)
+    // Returns NULL for unknown types or malformed blobs, or when generating while the RNG is not healthy()
+    static KeySlot *initialize(uint8_t type, uint16_t id, const uint8_t *blob, const int blen);
 
     // Return the cypher name
     virtual const char *getDescr() = 0;
+    // Return the key type (one of KeyType)
+    virtual uint8_t getType() = 0;
     // Return cypher capabilities
     virtual const union cypherCaps getCaps() { union cypherCaps x; x.intval=0; return x; };
-    virtual uint16_t getID() { return 0; };
+    uint16_t getID() { return _id; };
+    // Length of (binary) signatures made by this key, 0 if it can't sign/verify
+    virtual int getSigLen() { return 0; };
+
+    // Raw key material: public key is always present, private key is NULL for public-only keys
+    const uint8_t *getPublic() { return _pub; };
+    const uint8_t *getPrivate() { return _hasPriv?_priv:NULL; };
+
     // Encrypt/decrypt buffer from src to src+slen in buffer at dst. Sets dlen (>=slen)
     // If dst is NULL, then this method only sets the desired dlen (so the caller can allocate dst)
     // If src and dst overlap result is undefined!
@@ -51,30 +90,303 @@ class KeySlot {
     // if fast is true, only a format check is performed, no actual crypto. If format is OK, returns false
     virtual bool verify(const uint8_t *src, const int slen, const uint8_t *sig, int *sigLen, bool fast) { return true; };
 
+    // Compute the shared secret with peer's public key: needs the private key
+    // Returns true in case of error (unsupported, public-only key or weak peer key)
+    virtual bool keyExchange(uint8_t *shared, const uint8_t *peerPub) { return true; };
+
 /*
     // Key exchange only uses local secret key, local public key and peer's public key
     // The initiator sends the first (and only) packet that is then used by target to decrypt the rest of the message
     virtual bool kexInitiator() =0;
     virtual bool kexTarget() =0;
 */
-    ~KeySlot();
+    virtual ~KeySlot();
   protected:
-    KeySlot();
+    explicit KeySlot(uint16_t id);
+
+    uint16_t _id;
+    bool _hasPriv;
+    uint8_t _priv[32];
+    uint8_t _pub[32];
   private:
+    // Obey the rule-of-three: keys must not be copied around
+    KeySlot(const KeySlot &src) = delete;
+    KeySlot &operator=(const KeySlot &src) = delete;
 };
 
-/*
-class Ed25519Full: public KeySlot
+// Signing keys
+class Ed25519Slot: public KeySlot
 {
   public:
-    Ed25519
-}
+    virtual const char *getDescr() override { return "Ed25519"; };
+    virtual uint8_t getType() override { return KEY_ED25519; };
+    virtual const union cypherCaps getCaps() override;
+    virtual int getSigLen() override { return 64; };
+
+    virtual bool sign(const uint8_t *src, const int slen, uint8_t *dst, int *dlen) override;
+    virtual bool verify(const uint8_t *src, const int slen, const uint8_t *sig, int *sigLen, bool fast) override;
 
-class Ed25519VerifyOnly: public Key
+  protected:
+    explicit Ed25519Slot(uint16_t id) : KeySlot(id) {};
+    friend class KeySlot;
+};
+
+// Key exchange keys
+class Curve25519Slot: public KeySlot
 {
   public:
-    Ed25519
-}
-*/
+    virtual const char *getDescr() override { return "Curve25519"; };
+    virtual uint8_t getType() override { return KEY_CURVE25519; };
+    virtual const union cypherCaps getCaps() override;
+
+    virtual bool keyExchange(uint8_t *shared, const uint8_t *peerPub) override;
+
+  protected:
+    explicit Curve25519Slot(uint16_t id) : KeySlot(id) {};
+    friend class KeySlot;
+};
+
+// Symmetric (group) keys: truncated HMAC-SHA512, cheap enough for every packet
+// The "public key" is a fingerprint of the secret (first half of its SHA512), so it can be listed safely
+class HmacSlot: public KeySlot
+{
+  public:
+    static const int MAC_LEN=16;
+
+    virtual const char *getDescr() override { return "HMAC-SHA512"; };
+    virtual uint8_t getType() override { return KEY_HMAC; };
+    virtual const union cypherCaps getCaps() override;
+    virtual int getSigLen() override { return MAC_LEN; };
+
+    virtual bool sign(const uint8_t *src, const int slen, uint8_t *dst, int *dlen) override;
+    virtual bool verify(const uint8_t *src, const int slen, const uint8_t *sig, int *sigLen, bool fast) override;
+    // MAC of the sender's IPv4 address (4 bytes, as in the packet header) followed by src: a key can be shared by
+    // many senders, and a packet replayed from another address doesn't verify
+    bool signFrom(const uint8_t sender[4], const uint8_t *src, const int slen, uint8_t *dst);
+    bool verifyFrom(const uint8_t sender[4], const uint8_t *src, const int slen, const uint8_t *sig); // Returns true if bad
+
+  protected:
+    explicit HmacSlot(uint16_t id) : KeySlot(id) {};
+    friend class KeySlot;
+};
+
+// Fixed-size table of keyslots, indexed by key ID
+// Lookup by ID is O(1) (open addressing on a table twice the size of the keystore)
+class KeyStore
+{
+  public:
+    static const int MAX_SLOTS=8;
+
+    KeyStore();
+    ~KeyStore();
+
+    // Number of keys in the store
+    int count() { return _count; };
+    // Access keys by position (used for listing); returns NULL if pos is out of range
+    KeySlot *at(int pos) { return (pos>=0 && pos<_count)?_slots[pos]:NULL; };
+    // Access keys by ID; returns NULL if ID is unknown
+    KeySlot *find(uint16_t id);
+
+    // Add a key to the store (the store takes ownership and will delete it)
+    // Returns true in case of error (NULL key, store full or duplicate ID): in this case the key is deleted
+    bool add(KeySlot *k);
+    // Remove (and destroy) a key; returns true if ID is unknown
+    bool remove(uint16_t id);
+
+    // Persistent storage. Both return true in case of error.
+    // load() replaces current contents only if the saved copy is valid
+    bool load();
+    bool save();
+
+  private:
+    static const int BUCKETS=2*MAX_SLOTS; // Must be a power of 2
+    static const uint8_t FILE_VERSION=1;
+
+    static int bucket(uint16_t id) { return (id ^ (id>>4) ^ (id>>8)) & (BUCKETS-1); };
+    void reindex();
+
+    KeySlot *_slots[MAX_SLOTS];
+    int8_t _index[BUCKETS];	// Position in _slots or -1 if bucket is empty
+    uint8_t _count;
+
+    // Obey the rule-of-three: KeyStore must not be copied
+    KeyStore(const KeyStore &src) = delete;
+    KeyStore &operator=(const KeyStore &src) = delete;
+};
+
+// Replay protection for authenticated (signed or MAC'd) packets
+// Authenticated data starts with a counter that the sender increments for every packet: for every key and
+// sender a window remembers the highest counter accepted and which of the previous WINDOW ones were seen.
+// Each node counts on its own, so HMAC keys shared by a group need a window per sender (its address, which
+// the MAC covers); an Ed25519 key has a single signer, so sender is 0. When all windows are taken the least
+// recently used one is reused: size DOMOTIC_MAX_WINDOWS for the keys and senders actually in use.
+// The check only needs the parsed header, so stale and replayed packets are dropped before any public-key work.
+// The highest counter of every window is kept in RTC memory whenever it grows, but it's written to flash only when
+// it crosses a TX_BLOCK boundary (as it does when the sender reboots) or the window is new: a reset keeps the
+// exact tops, while after a power loss (or on host builds) up to TX_BLOCK-1 packets a sender sent before the last
+// flash write can be replayed.
+class ReplayFilter
+{
+  public:
+    static const int WINDOW=64;	// Max reordering tolerated, in packets
+    static const uint32_t TX_BLOCK=256;	// Sent counters reserved by every save: a reboot skips at most this many
+
+    ReplayFilter();
+
+    static const int WINDOWS=DOMOTIC_MAX_WINDOWS;
+
+    // True if ctr for key from sender is too old or was already accepted: packet must be dropped
+    bool isReplay(uint16_t key, uint32_t sender, uint32_t ctr);
+    // Record ctr for key from sender: call only after the packet has been authenticated
+    void accept(uint16_t key, uint32_t sender, uint32_t ctr);
+    // Forget the windows of a key (f.e. when the key is replaced)
+    void forget(uint16_t key);
+    // Save the highest counter of every window to RTC memory and, if flash, to flash; returns true in case of error
+    bool save(bool flash);
+
+    // Counter for the next sent packet, never reused across reboots; 0 if it can't be persisted
+    uint32_t nextTx();
+    // Load the saved counter reservation and windows; returns true in case of error (counting restarts from 1)
+    bool load();
+
+  private:
+    struct Window {
+      uint32_t sender;
+      uint16_t key;
+      bool used;
+      bool flashed;	// saved is the top written to flash
+      uint32_t top;	// Highest accepted counter
+      uint32_t saved;
+      uint64_t seen;	// bit n set: counter top-n was accepted
+      uint32_t lastUse;	// _useCtr when last accepted
+    };
+    Window _windows[WINDOWS];
+    uint32_t _useCtr;
+    uint32_t _tx, _txReserved;
+
+    bool loadImage(const uint8_t *buff, size_t len);
+};
+
+// Results of recent signature verifications, keyed by a digest of signature and signed data:
+// copies of a packet get the same result without repeating the public-key work.
+// A packet being verified is marked pending, so copies arriving meanwhile can be dropped
+class VerifyCache
+{
+  public:
+    static const int ENTRIES=8;
+    static const int DIGEST_SIZE=16;	// Truncated SHA-512
+    static const uint32_t LIFETIME=60000;	// ms: older entries are ignored
+
+    enum Result : uint8_t {
+      RES_NONE = 0,	// Not in cache
+      RES_PENDING = 1,
+      RES_GOOD = 2,
+      RES_BAD = 3
+    };
+
+    VerifyCache();
+
+    static void digest(uint8_t out[DIGEST_SIZE], const uint8_t *sig, size_t sigLen, const uint8_t *data, size_t len);
+    // now is millis()
+    uint8_t lookup(uint16_t key, const uint8_t *digest, uint32_t now);
+    // Add or update an entry, replacing the oldest one if needed
+    void store(uint16_t key, const uint8_t *digest, uint8_t result, uint32_t now);
+    // Drop all results for key (f.e. when the key is replaced)
+    void forget(uint16_t key);
+
+  private:
+    struct Entry {
+      uint16_t key;
+      uint8_t result;	// RES_NONE if unused
+      uint32_t stamp;	// millis() when stored
+      uint8_t digest[DIGEST_SIZE];
+    };
+    Entry _entries[ENTRIES];
+};
+
+// Ephemeral Curve25519 keypairs generated in advance, a few ladder bits at a time, when the node is idle:
+// a key exchange then only pays for dh2(). Keypairs are wiped from the pool when taken
+class EphemeralPool
+{
+  public:
+    static const int SIZE=2;
+
+    EphemeralPool();
+    ~EphemeralPool();
+
+    // Get a keypair, as generated by Curve25519::dh1(): if the pool is empty it's generated now (slowly)
+    void take(uint8_t pub[32], uint8_t priv[32]);
+    // Advance the generation of the next keypair by (at most) bits ladder steps
+    // Returns true if the pool is full: there's nothing to do
+    bool step(uint8_t bits);
+
+    int count() { return _count; };
+    uint32_t hits() { return _hits; };	// take() served from the pool
+    uint32_t misses() { return _misses; };	// take() had to generate a keypair
+
+  private:
+    struct Pair {
+      uint8_t pub[32];
+      uint8_t priv[32];
+    };
+    Pair _pairs[SIZE];
+    uint8_t _count;
+    bool _generating;	// _ctx is writing to _next
+    Curve25519::DH1Context _ctx;
+    Pair _next;
+    uint32_t _hits, _misses;
+
+    // Obey the rule-of-three: keys must not be copied around
+    EphemeralPool(const EphemeralPool &src) = delete;
+    EphemeralPool &operator=(const EphemeralPool &src) = delete;
+};
+
+// Symmetric sessions for encrypted packets, at most one per peer
+// Public-key work is only done by establish(): packets in the session just cost ChaCha20-Poly1305
+class SessionCache
+{
+  public:
+    static const int MAX_SESSIONS=4;
+    static const int TAG_SIZE=ChaChaPoly::TAG_SIZE;
+
+    struct Session {
+      uint16_t id;	// 0 if the slot is free
+      uint32_t peer;	// IPv4 address of the peer
+      uint32_t rxCtr;	// Highest counter received: counters must always increase
+      uint32_t lastUse;	// For LRU replacement
+      uint8_t rxKey[32];	// Peer to node
+      uint8_t txKey[32];	// Node to peer
+    };
+
+    SessionCache();
+    ~SessionCache();
+
+    // Create a session from the peer's ephemeral public key, the node's key exchange key k
+    // and a node ephemeral keypair (as generated by Curve25519::dh1(); ephPriv gets destroyed)
+    // Replaces the previous session of the same peer or, if the cache is full, the least recently used one
+    // Returns NULL in case of error, or if the RNG is not healthy()
+    Session *establish(uint32_t peer, KeySlot *k, const uint8_t *peerEph, uint8_t *ephPriv, const uint8_t *ephPub);
+    // Find a session by ID; returns NULL if unknown, expired or belonging to another peer
+    Session *find(uint16_t id, uint32_t peer);
+    // Forget a session
+    void drop(uint16_t id);
+    // Number of active sessions
+    int count();
+
+    // Check and decrypt in place len bytes at data, followed by TAG_SIZE bytes of tag
+    // ad (associated data) is authenticated but not encrypted
+    // Returns true in case of error (replayed counter or bad tag): data is then left untouched
+    bool open(Session *s, uint32_t ctr, const uint8_t *ad, size_t adlen, uint8_t *data, size_t len);
+    // Encrypt in place len bytes at data and append TAG_SIZE bytes of tag
+    void seal(Session *s, uint32_t ctr, const uint8_t *ad, size_t adlen, uint8_t *data, size_t len);
+
+  private:
+    Session _sessions[MAX_SESSIONS];
+    uint32_t _useCtr;
+
+    // Obey the rule-of-three: sessions must not be copied around
+    SessionCache(const SessionCache &src) = delete;
+    SessionCache &operator=(const SessionCache &src) = delete;
+};
 
 extern RNGClass RNG;
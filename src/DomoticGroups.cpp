@@ -0,0 +1,64 @@
+#include "DomoticGroups.h"
+
+#include <stdlib.h>
+
+GroupIndex::GroupIndex()
+: _entries(NULL)
+, _size(0)
+, _count(0)
+{
+}
+
+GroupIndex::~GroupIndex()
+{
+  free(_entries);
+}
+
+bool GroupIndex::reserve(int size)
+{
+  free(_entries);
+  _count=0;
+  _entries=(Entry *)calloc(size, sizeof(Entry));
+  _size=_entries?size:0;
+  return !_entries;
+}
+
+bool GroupIndex::add(uint16_t group, uint8_t kind, uint8_t line)
+{
+  if(_count==_size)
+    return true;
+  _entries[_count].group=group;
+  _entries[_count].kind=kind;
+  _entries[_count].line=line;
+  ++_count;
+  return false;
+}
+
+// Insertion sort: the index is small and only rebuilt when maps or rules change
+void GroupIndex::sort()
+{
+  for(int t=1; t<_count; ++t) {
+    Entry e=_entries[t];
+    int p=t;
+    while(p>0 && _entries[p-1].group>e.group) {
+      _entries[p]=_entries[p-1];
+      --p;
+    }
+    _entries[p]=e;
+  }
+}
+
+int GroupIndex::find(uint16_t group)
+{
+  int lo=0, hi=_count;
+
+  // Lower bound of group
+  while(lo<hi) {
+    int mid=(lo+hi)/2;
+    if(_entries[mid].group<group)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return (lo<_count && _entries[lo].group==group)?lo:-1;
+}
@@ -0,0 +1,49 @@
+/*
+ * Index of the multicast groups a node cares about
+ * Updates for other groups are dropped as soon as their group is parsed: on a busy network most of them are
+ * meant for other nodes. Entries are sorted by group, so a lookup is a binary search.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class GroupIndex
+{
+  public:
+    // Why a group is in the index
+    enum Kind : uint8_t {
+      KIND_SUB = 0,	// Explicit subscription: updates only go to processNotification()
+      KIND_DOUT,	// Digital output line mapped to the group: follows digital input updates
+      KIND_AOUT,	// Analog output line mapped to the group: follows analog input updates
+      KIND_RULE	// Group rules (register 0x24)
+    };
+
+    struct Entry {
+      uint16_t group;
+      uint8_t kind;
+      uint8_t line;	// Output line, for KIND_DOUT and KIND_AOUT
+    };
+
+    GroupIndex();
+    ~GroupIndex();
+    // Obey the rule-of-three: the index owns its entries
+    GroupIndex(const GroupIndex &src) = delete;
+    GroupIndex &operator=(const GroupIndex &src) = delete;
+
+    // Make room for size entries, dropping current ones; returns true in case of error
+    bool reserve(int size);
+    // Rebuild: clear(), add() every entry, then sort()
+    void clear() { _count=0; };
+    bool add(uint16_t group, uint8_t kind, uint8_t line=0); // Returns true if full
+    void sort();
+
+    // First entry for group (the others for the same group follow it), or -1
+    int find(uint16_t group);
+    const Entry &at(int i) { return _entries[i]; };
+    int count() { return _count; };
+
+  private:
+    Entry *_entries;
+    int _size, _count;
+};
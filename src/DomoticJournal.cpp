@@ -0,0 +1,54 @@
+#include "DomoticJournal.h"
+#include "RNG.h"
+
+#include <stdio.h>
+
+UpdateJournal::UpdateJournal()
+: _head(0)
+, _count(0)
+, _last(0)
+{
+}
+
+void UpdateJournal::begin()
+{
+  RNG.rand((uint8_t *)&_last, sizeof(_last));
+  _head=_count=0;
+}
+
+uint16_t UpdateJournal::add(char dir, char type, uint16_t group, uint16_t val)
+{
+  Event &e=_events[_head];
+
+  e.dir=dir;
+  e.type=type;
+  e.group=group;
+  e.val=val;
+  _head=(_head+1)%SIZE;
+  if(_count<SIZE)
+    ++_count;
+  return ++_last;
+}
+
+char UpdateJournal::since(uint16_t since, char *buff, int maxlen, int &len)
+{
+  uint16_t missed=_last-since;	// Events after since
+  char rv='.';
+
+  len=0;
+  buff[0]=0;
+  if(missed>_count) {
+    rv='G';
+    missed=_count;
+  }
+  for(uint16_t seq=_last-missed+1; seq!=(uint16_t)(_last+1); ++seq) {
+    if(len+EVENT_LEN>maxlen)
+      return 'G'==rv?rv:'+';
+    const Event &e=_events[(_head+SIZE-(uint16_t)(_last-seq)-1)%SIZE];
+    if('A'==e.type)
+      len+=sprintf(buff+len, "%04X%c%c%04X%04X", seq, e.dir, e.type, e.group, e.val);
+    else
+      len+=sprintf(buff+len, "%04X%c%c%04X%c", seq, e.dir, e.type, e.group, e.val?'1':'0');
+  }
+  return rv;
+}
@@ -0,0 +1,48 @@
+/*
+ * Journal of the last multicast updates sent by this node (register 0x27)
+ * Each update carries its sequence number: a controller that sees a hole in the sequence can ask for the
+ * missed events with a single request instead of polling every line again.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Updates kept for controllers catching up
+#ifndef DOMOTIC_JOURNAL_SIZE
+#define DOMOTIC_JOURNAL_SIZE 32
+#endif
+
+class UpdateJournal
+{
+  public:
+    static const int SIZE=DOMOTIC_JOURNAL_SIZE;
+    static const int EVENT_LEN=14;	// Longest formatted event: <seq:WordHex> <'I'|'O'> <'A'> <group:WordHex> <value:WordHex>
+
+    UpdateJournal();
+
+    // Sequence numbers start from a random value at every boot, so a controller can tell a reboot from a
+    // few missed updates
+    void begin();
+    // Record an event ('I'|'O', 'A'|'D'), returning its sequence number
+    uint16_t add(char dir, char type, uint16_t group, uint16_t val);
+    // Sequence number of the last event, and of the oldest one still kept
+    uint16_t last() { return _last; };
+    uint16_t oldest() { return _last-_count+1; };
+
+    // Events after since, formatted as <seq:WordHex> <'I'|'O'> {<'D'> <group:WordHex> <'0'|'1'> | <'A'> <group:WordHex> <value:WordHex>}
+    // Writes at most maxlen characters (plus terminator) to buff, setting len
+    // Returns 'G' if some events after since are not in the journal anymore (or since is from another boot),
+    // '+' if more events follow (ask again from the last one returned), '.' if all of them fit
+    char since(uint16_t since, char *buff, int maxlen, int &len);
+
+  private:
+    struct Event {
+      char dir, type;
+      uint16_t group;
+      uint16_t val;
+    };
+    Event _events[SIZE];	// Ring buffer: _events[_head] is the next to be written
+    int _head, _count;
+    uint16_t _last;
+};
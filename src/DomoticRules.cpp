@@ -0,0 +1,192 @@
+#include "DomoticRules.h"
+#include "DomoticStorage.h"
+
+#include "crypto/Crypto.h"
+#include <stdio.h>
+#include <string.h>
+#define RULES_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_RULES_FILE)
+
+RuleTable::RuleTable()
+: _count(0)
+{
+  memset(_rules, 0, sizeof(_rules));
+}
+
+const RuleTable::Rule *RuleTable::at(int slot)
+{
+  if(slot<0 || slot>=MAX_RULES || SRC_NONE==_rules[slot].source)
+    return NULL;
+  return _rules+slot;
+}
+
+bool RuleTable::set(int slot, const Rule *r)
+{
+  if(slot<0 || slot>=MAX_RULES)
+    return true;
+  if(r)
+    _rules[slot]=*r;
+  else
+    memset(_rules+slot, 0, sizeof(_rules[slot]));
+  reindex();
+  return false;
+}
+
+// Insertion sort: the table is tiny and only changes on register writes
+void RuleTable::reindex()
+{
+  _count=0;
+  for(int s=0; s<MAX_RULES; ++s) {
+    if(SRC_NONE==_rules[s].source)
+      continue;
+    uint32_t k=key(_rules[s].source, _rules[s].src);
+    int p=_count++;
+    while(p>0 && key(_rules[_index[p-1]].source, _rules[_index[p-1]].src)>k) {
+      _index[p]=_index[p-1];
+      --p;
+    }
+    _index[p]=s;
+  }
+}
+
+int RuleTable::match(uint8_t source, uint16_t src, bool value, uint8_t *slots, int max)
+{
+  uint32_t k=key(source, src);
+  int lo=0, hi=_count;
+  int n=0;
+
+  // Lower bound of k
+  while(lo<hi) {
+    int mid=(lo+hi)/2;
+    if(key(_rules[_index[mid]].source, _rules[_index[mid]].src)<k)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  for(; lo<_count && n<max; ++lo) {
+    const Rule &r=_rules[_index[lo]];
+    if(key(r.source, r.src)!=k)
+      break;
+    if(EDGE_BOTH==r.edge || (value?EDGE_RISE:EDGE_FALL)==r.edge)
+      slots[n++]=_index[lo];
+  }
+  return n;
+}
+
+static int hexval(uint8_t c)
+{
+  if(c>='0' && c<='9') return c-'0';
+  if(c>='A' && c<='F') return c-'A'+10;
+  if(c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+// Parse n hex digits; returns true in case of error
+static bool parseHex(const uint8_t *txt, int n, uint16_t &out)
+{
+  out=0;
+  for(int t=0; t<n; ++t) {
+    int v=hexval(txt[t]);
+    if(v<0)
+      return true;
+    out=(out<<4)|v;
+  }
+  return false;
+}
+
+bool RuleTable::parse(const uint8_t *txt, Rule &r)
+{
+  uint16_t v;
+
+  memset(&r, 0, sizeof(r));
+  if(SRC_LINE!=txt[0] && SRC_GROUP!=txt[0])
+    return true;
+  r.source=txt[0];
+  if(parseHex(txt+1, 4, r.src))
+    return true;
+  if(EDGE_RISE!=txt[5] && EDGE_FALL!=txt[5] && EDGE_BOTH!=txt[5])
+    return true;
+  r.edge=txt[5];
+  if(ACT_OFF!=txt[6] && ACT_ON!=txt[6] && ACT_TOGGLE!=txt[6] && ACT_PULSE!=txt[6] && ACT_TIMER!=txt[6])
+    return true;
+  r.action=txt[6];
+  if(parseHex(txt+7, 2, v))
+    return true;
+  r.out=v;
+  if(ACT_PULSE==r.action && (parseHex(txt+9, 4, r.pulse) || !r.pulse))
+    return true;
+  return false;
+}
+
+int RuleTable::format(char *buff, const Rule &r)
+{
+  int len=sprintf(buff, "%c%04X%c%c%02X", r.source, r.src, r.edge, r.action, r.out);
+  if(ACT_PULSE==r.action)
+    len+=sprintf(buff+len, "%04X", r.pulse);
+  return len;
+}
+
+/*
+ * Saved rules layout: <'D'> <'R'> <version> <count> {<slot> <source> <edge> <action> <out> <src:2> <pulse:2>}* <crc8>
+ * Multi-byte values are big endian
+ */
+static const uint8_t RULES_VERSION=1;
+static const int RULES_HDRSIZE=4;
+static const int RULES_RECSIZE=9;
+
+bool RuleTable::load()
+{
+  uint8_t buff[RULES_HDRSIZE+MAX_RULES*RULES_RECSIZE+1];
+  Rule loaded[MAX_RULES];
+  size_t len=0;
+
+  if(storageRead(RULES_PATH, buff, sizeof(buff), len))
+    return true;
+  if(len<RULES_HDRSIZE+1 || 'D'!=buff[0] || 'R'!=buff[1] || RULES_VERSION!=buff[2] || buff[3]>MAX_RULES
+      || len!=(size_t)(RULES_HDRSIZE+buff[3]*RULES_RECSIZE+1) || crypto_crc8(RULES_VERSION, buff, len-1)!=buff[len-1])
+    return true;
+
+  memset(loaded, 0, sizeof(loaded));
+  for(int t=0; t<buff[3]; ++t) {
+    const uint8_t *p=buff+RULES_HDRSIZE+t*RULES_RECSIZE;
+    if(p[0]>=MAX_RULES)
+      return true;
+    Rule &r=loaded[p[0]];
+    r.source=p[1];
+    r.edge=p[2];
+    r.action=p[3];
+    r.out=p[4];
+    r.src=(p[5]<<8)|p[6];
+    r.pulse=(p[7]<<8)|p[8];
+  }
+  memcpy(_rules, loaded, sizeof(_rules));
+  reindex();
+  return false;
+}
+
+bool RuleTable::save()
+{
+  uint8_t buff[RULES_HDRSIZE+MAX_RULES*RULES_RECSIZE+1];
+  size_t pos=RULES_HDRSIZE;
+
+  buff[0]='D';
+  buff[1]='R';
+  buff[2]=RULES_VERSION;
+  buff[3]=_count;
+  for(int s=0; s<MAX_RULES; ++s) {
+    const Rule &r=_rules[s];
+    if(SRC_NONE==r.source)
+      continue;
+    buff[pos++]=s;
+    buff[pos++]=r.source;
+    buff[pos++]=r.edge;
+    buff[pos++]=r.action;
+    buff[pos++]=r.out;
+    buff[pos++]=r.src>>8;
+    buff[pos++]=r.src;
+    buff[pos++]=r.pulse>>8;
+    buff[pos++]=r.pulse;
+  }
+  buff[pos]=crypto_crc8(RULES_VERSION, buff, pos);
+  ++pos;
+  return storageWrite(RULES_PATH, buff, pos);
+}
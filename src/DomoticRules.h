@@ -0,0 +1,75 @@
+/*
+ * Local input-to-output rules (register 0x24)
+ * A rule reacts to an edge of a digital input with an action on a local digital output, without
+ * waiting for the controller: switches keep driving their lights when the network or the controller is down.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Where rules are saved (see DomoticStorage.h)
+#define DOMOTIC_RULES_FILE "/domotic.rules"
+
+class RuleTable
+{
+  public:
+    static const int MAX_RULES=16;
+
+    enum Source : uint8_t {
+      SRC_NONE = 0,	// Unused slot
+      SRC_LINE = 'L',	// Local digital input, by line number
+      SRC_GROUP = 'G'	// Digital input update for a group, local or authenticated from the network
+    };
+    enum Edge : uint8_t {
+      EDGE_RISE = 'R',
+      EDGE_FALL = 'F',
+      EDGE_BOTH = 'B'
+    };
+    enum Action : uint8_t {
+      ACT_OFF = '0',
+      ACT_ON = '1',
+      ACT_TOGGLE = 'T',
+      ACT_PULSE = 'P',	// On, then off after pulse ms
+      ACT_TIMER = 'S'	// (Re)start timer out (register 0x25)
+    };
+
+    struct Rule {
+      uint8_t source;
+      uint8_t edge;
+      uint8_t action;
+      uint8_t out;	// Local digital output line, or timer for ACT_TIMER
+      uint16_t src;	// Input line or group
+      uint16_t pulse;	// ms, only for ACT_PULSE
+    };
+
+    RuleTable();
+
+    // Slot contents; NULL if slot is out of range or unused
+    const Rule *at(int slot);
+    // Replace (or, with NULL, clear) the rule in slot; returns true in case of error
+    bool set(int slot, const Rule *r);
+    int count() { return _count; };
+
+    // Slots of the rules triggered by value of an input: at most max, in slot order
+    // Uses the index sorted by source: only the matching rules are looked at
+    int match(uint8_t source, uint16_t src, bool value, uint8_t *slots, int max);
+
+    // Text form used in register 0x24:
+    //   Rule := <'L'|'G'> <src:WordHex> <'R'|'F'|'B'> <'0'|'1'|'T'|'P'|'S'> <out:ByteHex> [<pulse:WordHex>]
+    // parse() returns true if txt is malformed; format() returns the number of characters written (at most 14 + terminator)
+    static bool parse(const uint8_t *txt, Rule &r);
+    static int format(char *buff, const Rule &r);
+
+    // Returns true in case of error; load() replaces current rules only if the saved copy is valid
+    bool load();
+    bool save();
+
+  private:
+    Rule _rules[MAX_RULES];
+    uint8_t _index[MAX_RULES];	// Used slots, sorted by (source, src)
+    uint8_t _count;
+
+    static uint32_t key(uint8_t source, uint16_t src) { return ((uint32_t)source<<16)|src; };
+    void reindex();
+};
@@ -0,0 +1,285 @@
+#include "DomoticStorage.h"
+
+#include "crypto/Crypto.h"
+#if defined(ESP8266)
+#include <LittleFS.h>
+#else
+#include <stdio.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#define LOG_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_LOG_FILE)
+
+/*
+ * Log layout: <'D'> <'L'> <version> {Record}*
+ *  Record := <'R'> <namelen> <name> <len:2> <data> <crc8 of the preceding bytes of the record>
+ * Multi-byte values are big endian; a later record for the same name replaces the earlier ones
+ */
+static const uint8_t LOG_VERSION=1;
+static const int LOG_HDRSIZE=3;
+static const int REC_OVERHEAD=1+1+2+1;
+
+struct LogEntry {
+  char name[DOMOTIC_LOG_NAMELEN+1];	// Empty if unused
+  uint8_t *data;
+  uint16_t len;
+};
+static LogEntry logFiles[DOMOTIC_LOG_FILES];
+static bool logLoaded=false;
+static size_t logSize=0;	// Bytes up to the end of the last valid record
+static bool logTorn=false;	// Something follows the last valid record: compact before appending
+
+// Minimal file access, the same on LittleFS and on host
+class LogFile
+{
+  public:
+    LogFile(const char *path, const char *mode)
+    {
+#if defined(ESP8266)
+      if(LittleFS.begin())
+        _f=LittleFS.open(path, mode);
+#else
+      char m[3]={ mode[0], 'b', 0 };
+      _f=fopen(path, m);
+#endif
+    };
+    ~LogFile()
+    {
+#if defined(ESP8266)
+      if(_f)
+        _f.close();
+#else
+      if(_f)
+        fclose(_f);
+#endif
+    };
+    // Not copyable: a copy would close the file twice
+    LogFile(const LogFile &src) = delete;
+    LogFile &operator=(const LogFile &src) = delete;
+
+    bool ok() { return _f?true:false; };
+    size_t read(uint8_t *buff, size_t len)
+    {
+#if defined(ESP8266)
+      return _f.read(buff, len);
+#else
+      return fread(buff, 1, len, _f);
+#endif
+    };
+    bool write(const uint8_t *buff, size_t len) // Returns true in case of error
+    {
+#if defined(ESP8266)
+      return _f.write(buff, len)!=len;
+#else
+      return fwrite(buff, 1, len, _f)!=len;
+#endif
+    };
+    bool close() // Returns true in case of error
+    {
+#if defined(ESP8266)
+      _f.close();
+      return false;
+#else
+      bool err=(0!=fclose(_f));
+      _f=NULL;
+      return err;
+#endif
+    };
+
+  private:
+#if defined(ESP8266)
+    File _f;
+#else
+    FILE *_f=NULL;
+#endif
+};
+
+static bool removeFile(const char *path)
+{
+#if defined(ESP8266)
+  return LittleFS.begin() && LittleFS.remove(path);
+#else
+  return 0==remove(path);
+#endif
+}
+
+// Replaces to atomically: there's always either the old or the new file
+static bool renameFile(const char *from, const char *to) // Returns true in case of error
+{
+#if defined(ESP8266)
+  return !LittleFS.rename(from, to);
+#else
+  return 0!=rename(from, to);
+#endif
+}
+
+// crypto_crc8() continued over more data
+static uint8_t crcMore(uint8_t crc, const void *data, size_t len)
+{
+  return crypto_crc8(0xFF^crc, data, len);
+}
+
+static LogEntry *findEntry(const char *name, bool create)
+{
+  LogEntry *unused=NULL;
+
+  for(int t=0; t<DOMOTIC_LOG_FILES; ++t) {
+    if(!strcmp(logFiles[t].name, name))
+      return logFiles+t;
+    if(!unused && !logFiles[t].name[0])
+      unused=logFiles+t;
+  }
+  if(!create || !unused || strlen(name)>DOMOTIC_LOG_NAMELEN)
+    return NULL;
+  strcpy(unused->name, name);
+  unused->data=NULL;
+  unused->len=0;
+  return unused;
+}
+
+// Replace the contents of e; returns true if there's no memory
+static bool setEntry(LogEntry *e, const uint8_t *buff, size_t len)
+{
+  uint8_t *data=(uint8_t *)malloc(len?len:1);
+
+  if(!data)
+    return true;
+  memcpy(data, buff, len);
+  if(e->data) {
+    clean(e->data, e->len); // It could hold keys
+    free(e->data);
+  }
+  e->data=data;
+  e->len=len;
+  return false;
+}
+
+static bool writeRecord(LogFile &f, const LogEntry *e)
+{
+  uint8_t hdr[2+DOMOTIC_LOG_NAMELEN+2];
+  size_t n=strlen(e->name);
+  uint8_t crc;
+
+  hdr[0]='R';
+  hdr[1]=n;
+  memcpy(hdr+2, e->name, n);
+  hdr[2+n]=e->len>>8;
+  hdr[3+n]=e->len;
+  crc=crcMore(crypto_crc8(LOG_VERSION, hdr, 4+n), e->data, e->len);
+  return f.write(hdr, 4+n) || f.write(e->data, e->len) || f.write(&crc, 1);
+}
+
+bool storageBegin()
+{
+  uint8_t hdr[2+DOMOTIC_LOG_NAMELEN+2];
+  char name[DOMOTIC_LOG_NAMELEN+1];
+
+  if(logLoaded)
+    return false;
+  logLoaded=true;
+  logSize=0;
+  logTorn=false;
+
+  LogFile f(LOG_PATH, "r");
+  if(!f.ok()) {
+    // No log yet (the first write creates it), or a compaction was cut short: use its complete new log
+    if(renameFile(LOG_PATH ".new", LOG_PATH))
+      return true;
+    logLoaded=false;
+    return storageBegin();
+  }
+  if(LOG_HDRSIZE!=f.read(hdr, LOG_HDRSIZE) || 'D'!=hdr[0] || 'L'!=hdr[1] || LOG_VERSION!=hdr[2]) {
+    logTorn=true;
+    return true;
+  }
+  logSize=LOG_HDRSIZE;
+  for(;;) {
+    size_t n=f.read(hdr, 2);
+    if(!n)
+      break; // Clean end
+    if(2!=n || 'R'!=hdr[0] || !hdr[1] || hdr[1]>DOMOTIC_LOG_NAMELEN || f.read(hdr+2, hdr[1]+2)!=(size_t)hdr[1]+2) {
+      logTorn=true;
+      break;
+    }
+    n=hdr[1];
+    size_t len=(hdr[2+n]<<8)|hdr[3+n];
+    uint8_t *data=(uint8_t *)malloc(len+1);
+    if(!data || f.read(data, len+1)!=len+1
+        || crcMore(crypto_crc8(LOG_VERSION, hdr, 4+n), data, len)!=data[len]) {
+      free(data);
+      logTorn=true;
+      break;
+    }
+    memcpy(name, hdr+2, n);
+    name[n]=0;
+    LogEntry *e=findEntry(name, true);
+    if(!e || setEntry(e, data, len))
+      logTorn=true; // Can't be kept: it would be lost at the next compaction anyway
+    clean(data, len);
+    free(data);
+    logSize+=REC_OVERHEAD+n+len;
+  }
+  return false;
+}
+
+bool storageRead(const char *path, uint8_t *buff, size_t maxlen, size_t &len)
+{
+  storageBegin();
+  LogEntry *e=findEntry(path, false);
+  if(e) {
+    len=e->len<maxlen?e->len:maxlen;
+    memcpy(buff, e->data, len);
+    return false;
+  }
+
+  LogFile f(path, "r");
+  if(!f.ok())
+    return true;
+  len=f.read(buff, maxlen);
+  return false;
+}
+
+bool storageWrite(const char *path, const uint8_t *buff, size_t len)
+{
+  storageBegin();
+  LogEntry *e=findEntry(path, true);
+  if(!e || len>0xFFFF || setEntry(e, buff, len))
+    return true;
+
+  size_t rec=REC_OVERHEAD+strlen(path)+len;
+  if(logTorn || !logSize || logSize+rec>DOMOTIC_LOG_MAX) {
+    if(storageCompact())
+      return true;
+  } else {
+    LogFile f(LOG_PATH, "a");
+    if(!f.ok() || writeRecord(f, e) || f.close())
+      return true;
+    logSize+=rec;
+  }
+  removeFile(path); // Copy from before the log, if any
+  return false;
+}
+
+bool storageCompact()
+{
+  uint8_t hdr[LOG_HDRSIZE]={ 'D', 'L', LOG_VERSION };
+  size_t size=LOG_HDRSIZE;
+
+  storageBegin();
+  LogFile f(LOG_PATH ".new", "w");
+  if(!f.ok() || f.write(hdr, sizeof(hdr)))
+    return true;
+  for(int t=0; t<DOMOTIC_LOG_FILES; ++t) {
+    const LogEntry *e=logFiles+t;
+    if(!e->name[0])
+      continue;
+    if(writeRecord(f, e))
+      return true;
+    size+=REC_OVERHEAD+strlen(e->name)+e->len;
+  }
+  if(f.close() || renameFile(LOG_PATH ".new", LOG_PATH))
+    return true;
+  logSize=size;
+  logTorn=false;
+  return false;
+}
@@ -0,0 +1,39 @@
+/*
+ * Small files in flash (LittleFS on ESP8266, current directory on host builds)
+ * All files are records appended to one log: saving a file writes only its new contents, reading the log
+ * at boot is a single sequential scan and the latest copy of every file is then served from RAM.
+ * When the log grows past DOMOTIC_LOG_MAX it is compacted, keeping only the latest records.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Path of a library file: names are absolute in LittleFS, relative to current directory on host
+#if defined(ESP8266)
+#define DOMOTIC_STORAGE_PATH(name) name
+#else
+#define DOMOTIC_STORAGE_PATH(name) "." name
+#endif
+
+// The log and its limits
+#define DOMOTIC_LOG_FILE "/domotic.log"
+#ifndef DOMOTIC_LOG_MAX
+#define DOMOTIC_LOG_MAX 8192	// Bytes
+#endif
+#ifndef DOMOTIC_LOG_FILES
+#define DOMOTIC_LOG_FILES 12
+#endif
+#define DOMOTIC_LOG_NAMELEN 23	// Longest path
+
+// Load the log, once: the other functions call it as needed; returns true if the log can't be read
+// A log damaged by a power loss while writing is valid up to its last complete record
+bool storageBegin();
+// Read up to maxlen bytes of path into buff, setting len; returns true in case of error (f.e. missing file)
+// Files saved before the log existed are read directly (they move to the log when they are saved again)
+bool storageRead(const char *path, uint8_t *buff, size_t maxlen, size_t &len);
+// Replace contents of path with len bytes from buff; returns true in case of error
+bool storageWrite(const char *path, const uint8_t *buff, size_t len);
+// Rewrite the log with only the latest record of every file (f.e. to drop old copies of secrets)
+// The new log is complete before it replaces the old one, so a power loss can't destroy both
+bool storageCompact();
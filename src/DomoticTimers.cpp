@@ -0,0 +1,273 @@
+#include "DomoticTimers.h"
+#include "DomoticStorage.h"
+
+#include "crypto/Crypto.h"
+#include <stdio.h>
+#include <string.h>
+#define TIMERS_PATH DOMOTIC_STORAGE_PATH(DOMOTIC_TIMERS_FILE)
+
+TimerWheel::TimerWheel()
+: _tick(0)
+, _last(0)
+, _count(0)
+{
+  for(int t=0; t<MAX_ENTRIES; ++t) {
+    _entries[t].expiry=0;
+    _entries[t].prev=_entries[t].next=NONE;
+    _entries[t].list=NONE;
+  }
+  for(int l=0; l<=LIST_EXPIRED; ++l)
+    _heads[l]=NONE;
+}
+
+void TimerWheel::link(uint16_t id, uint16_t list)
+{
+  Entry &e=_entries[id];
+  e.list=list;
+  e.prev=NONE;
+  e.next=_heads[list];
+  if(NONE!=e.next)
+    _entries[e.next].prev=id;
+  _heads[list]=id;
+}
+
+void TimerWheel::unlink(uint16_t id)
+{
+  Entry &e=_entries[id];
+  if(NONE!=e.prev)
+    _entries[e.prev].next=e.next;
+  else
+    _heads[e.list]=e.next;
+  if(NONE!=e.next)
+    _entries[e.next].prev=e.prev;
+  e.list=NONE;
+}
+
+// Lowest level whose higher bits match the current tick: its slot for expiry is always ahead of the
+// current one, so the entry is cascaded (or expires) exactly when that slot comes due
+void TimerWheel::insert(uint16_t id)
+{
+  uint64_t e=_entries[id].expiry;
+
+  if(e<=_tick) {
+    link(id, LIST_EXPIRED);
+    return;
+  }
+  for(int l=0; l<LEVELS; ++l) {
+    if((e>>(BITS*(l+1)))==(_tick>>(BITS*(l+1)))) {
+      link(id, l*SLOTS+((e>>(BITS*l))&(SLOTS-1)));
+      return;
+    }
+  }
+  link(id, LIST_OVERFLOW);
+}
+
+void TimerWheel::cascade(uint16_t list)
+{
+  uint16_t id=_heads[list];
+
+  _heads[list]=NONE;
+  while(NONE!=id) {
+    uint16_t next=_entries[id].next;
+    insert(id);
+    id=next;
+  }
+}
+
+void TimerWheel::tick()
+{
+  ++_tick;
+  // Higher levels first: their entries can land in the lower level slots that are due now
+  if(!(_tick&((((uint64_t)1)<<(BITS*LEVELS))-1)))
+    cascade(LIST_OVERFLOW);
+  for(int l=LEVELS-1; l>0; --l) {
+    if(!(_tick&((((uint64_t)1)<<(BITS*l))-1)))
+      cascade(l*SLOTS+((_tick>>(BITS*l))&(SLOTS-1)));
+  }
+  cascade(_tick&(SLOTS-1)); // Everything in it expires now
+}
+
+void TimerWheel::start(uint16_t id, uint64_t delay, bool again)
+{
+  if(id>=MAX_ENTRIES)
+    return;
+
+  Entry &e=_entries[id];
+  uint64_t from=_tick;
+  if(again && e.expiry+delay>_tick)
+    from=e.expiry; // No drift; if late by more than a period, missed expirations are skipped
+  if(NONE!=e.list)
+    unlink(id);
+  else
+    ++_count;
+  e.expiry=from+delay;
+  insert(id);
+}
+
+void TimerWheel::stop(uint16_t id)
+{
+  if(!active(id))
+    return;
+  unlink(id);
+  --_count;
+}
+
+uint16_t TimerWheel::poll(unsigned long now)
+{
+  unsigned long elapsed=now-_last;
+
+  _last=now;
+  if(!_count) {
+    _tick+=elapsed; // Nothing to expire: skip ahead
+  } else {
+    while(elapsed--)
+      tick();
+  }
+
+  uint16_t id=_heads[LIST_EXPIRED];
+  if(NONE!=id) {
+    unlink(id);
+    --_count;
+  }
+  return id;
+}
+
+TimerTable::TimerTable()
+{
+  for(int t=0; t<MAX_TIMERS; ++t)
+    set(t, NULL);
+}
+
+const TimerTable::Timer *TimerTable::at(int slot)
+{
+  if(slot<0 || slot>=MAX_TIMERS)
+    return NULL;
+  return _timers+slot;
+}
+
+bool TimerTable::set(int slot, const Timer *t)
+{
+  if(slot<0 || slot>=MAX_TIMERS)
+    return true;
+  if(t) {
+    _timers[slot]=*t;
+  } else {
+    _timers[slot].interval=0;
+    _timers[slot].out=0;
+    _timers[slot].start=ACT_NONE;
+    _timers[slot].expire=ACT_NONE;
+  }
+  return false;
+}
+
+uint64_t TimerTable::ms(uint16_t interval)
+{
+  uint64_t count=interval&0x0FFF;
+
+  if(interval&INT_RESERVED)
+    return 0;
+  switch((interval>>13)&3) {
+    case UNIT_S:
+      return count*1000;
+    case UNIT_MIN:
+      return count*60000;
+    case UNIT_H:
+      return count*3600000;
+  }
+  return count;
+}
+
+static bool isAction(uint8_t c)
+{
+  return TimerTable::ACT_NONE==c || TimerTable::ACT_OFF==c || TimerTable::ACT_ON==c || TimerTable::ACT_TOGGLE==c;
+}
+
+static int hexval(uint8_t c)
+{
+  if(c>='0' && c<='9') return c-'0';
+  if(c>='A' && c<='F') return c-'A'+10;
+  if(c>='a' && c<='f') return c-'a'+10;
+  return -1;
+}
+
+bool TimerTable::parse(const uint8_t *txt, Timer &t)
+{
+  int hi=hexval(txt[0]);
+  int lo=hi<0?-1:hexval(txt[1]);
+
+  if(lo<0 || !isAction(txt[2]) || !isAction(txt[3]))
+    return true;
+  t.out=(hi<<4)|lo;
+  t.start=txt[2];
+  t.expire=txt[3];
+  return false;
+}
+
+int TimerTable::format(char *buff, const Timer &t)
+{
+  return sprintf(buff, "%02X%c%c", t.out, t.start, t.expire);
+}
+
+/*
+ * Saved timers layout: <'D'> <'T'> <version> <count> {<slot> <interval:2> <out> <start> <expire>}* <crc8>
+ * Only configured slots (interval or an action set) are saved; multi-byte values are big endian
+ */
+static const uint8_t TIMERS_VERSION=1;
+static const int TIMERS_HDRSIZE=4;
+static const int TIMERS_RECSIZE=6;
+
+bool TimerTable::load()
+{
+  uint8_t buff[TIMERS_HDRSIZE+MAX_TIMERS*TIMERS_RECSIZE+1];
+  Timer loaded[MAX_TIMERS];
+  size_t len=0;
+
+  if(storageRead(TIMERS_PATH, buff, sizeof(buff), len))
+    return true;
+  if(len<TIMERS_HDRSIZE+1 || 'D'!=buff[0] || 'T'!=buff[1] || TIMERS_VERSION!=buff[2] || buff[3]>MAX_TIMERS
+      || len!=(size_t)(TIMERS_HDRSIZE+buff[3]*TIMERS_RECSIZE+1) || crypto_crc8(TIMERS_VERSION, buff, len-1)!=buff[len-1])
+    return true;
+
+  memcpy(loaded, _timers, sizeof(loaded));
+  for(int t=0; t<MAX_TIMERS; ++t)
+    set(t, NULL);
+  for(int t=0; t<buff[3]; ++t) {
+    const uint8_t *p=buff+TIMERS_HDRSIZE+t*TIMERS_RECSIZE;
+    if(p[0]>=MAX_TIMERS || !isAction(p[4]) || !isAction(p[5])) {
+      memcpy(_timers, loaded, sizeof(_timers));
+      return true;
+    }
+    Timer &r=_timers[p[0]];
+    r.interval=(p[1]<<8)|p[2];
+    r.out=p[3];
+    r.start=p[4];
+    r.expire=p[5];
+  }
+  return false;
+}
+
+bool TimerTable::save()
+{
+  uint8_t buff[TIMERS_HDRSIZE+MAX_TIMERS*TIMERS_RECSIZE+1];
+  size_t pos=TIMERS_HDRSIZE;
+
+  buff[0]='D';
+  buff[1]='T';
+  buff[2]=TIMERS_VERSION;
+  buff[3]=0;
+  for(int s=0; s<MAX_TIMERS; ++s) {
+    const Timer &t=_timers[s];
+    if(!t.interval && ACT_NONE==t.start && ACT_NONE==t.expire)
+      continue;
+    buff[pos++]=s;
+    buff[pos++]=t.interval>>8;
+    buff[pos++]=t.interval;
+    buff[pos++]=t.out;
+    buff[pos++]=t.start;
+    buff[pos++]=t.expire;
+    ++buff[3];
+  }
+  buff[pos]=crypto_crc8(TIMERS_VERSION, buff, pos);
+  ++pos;
+  return storageWrite(TIMERS_PATH, buff, pos);
+}
@@ -0,0 +1,121 @@
+/*
+ * On-node timers (registers 0x25 and 0x26) and delayed writes of digital outputs
+ * TimerWheel schedules them all: starting, stopping and expiring a timer take constant time, however
+ * many are active, so the library can run staircase lights or irrigation cycles without the controller.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// User timers (registers 0x25/0x26), at most 255
+#ifndef DOMOTIC_MAX_TIMERS
+#define DOMOTIC_MAX_TIMERS 32
+#endif
+// Local digital outputs (lines 0..n-1) that can have a pending delayed or pulsed write
+#ifndef DOMOTIC_MAX_DELAYED
+#define DOMOTIC_MAX_DELAYED 32
+#endif
+
+// Where timers are saved (see DomoticStorage.h)
+#define DOMOTIC_TIMERS_FILE "/domotic.timers"
+
+/*
+ * Hierarchical timing wheel with 1ms ticks: LEVELS wheels of SLOTS lists each, level n covering
+ * SLOTS^(n+1) ticks; later expirations wait in an overflow list. Entries move to a lower level only when
+ * the higher level slot they're in comes due, so each tick costs O(1) (plus the entries that expire).
+ */
+class TimerWheel
+{
+  public:
+    static const int MAX_ENTRIES=DOMOTIC_MAX_TIMERS+DOMOTIC_MAX_DELAYED;
+    static const uint16_t NONE=0xFFFF;
+
+    TimerWheel();
+
+    // (Re)arm id to expire delay ms from the last poll() (or from its last expiration, if again)
+    void start(uint16_t id, uint64_t delay, bool again=false);
+    void stop(uint16_t id);
+    bool active(uint16_t id) { return id<MAX_ENTRIES && NONE!=_entries[id].list; };
+    int count() { return _count; };
+
+    // Advance to now (millis()) and return the first expired entry, or NONE
+    // Call again until it returns NONE: each entry is returned once per expiration
+    uint16_t poll(unsigned long now);
+
+  private:
+    static const int BITS=6;
+    static const int SLOTS=1<<BITS;
+    static const int LEVELS=4;
+    static const uint16_t LIST_OVERFLOW=LEVELS*SLOTS;	// List indexes after the wheels
+    static const uint16_t LIST_EXPIRED=LIST_OVERFLOW+1;
+    struct Entry {
+      uint64_t expiry;	// Tick
+      uint16_t prev, next;
+      uint16_t list;	// NONE if not active
+    };
+    Entry _entries[MAX_ENTRIES];
+    uint16_t _heads[LIST_EXPIRED+1];
+    uint64_t _tick;	// Ticks since begin
+    unsigned long _last;	// millis() at _tick
+    uint16_t _count;	// Active entries, including expired ones not yet returned by poll()
+
+    void link(uint16_t id, uint16_t list);
+    void unlink(uint16_t id);
+    void insert(uint16_t id); // Link id in the list for its expiry
+    void cascade(uint16_t list); // Reinsert all entries of list
+    void tick();
+};
+
+// Configuration of user timers, as seen in registers 0x25 (actions) and 0x26 (intervals)
+class TimerTable
+{
+  public:
+    static const int MAX_TIMERS=DOMOTIC_MAX_TIMERS;
+
+    // Interval word (register 0x26): <astable:1> <unit:2> <reserved:1> <count:12>
+    static const uint16_t INT_ASTABLE=0x8000;
+    static const uint16_t INT_RESERVED=0x1000;
+    enum Unit : uint8_t {
+      UNIT_MS = 0,
+      UNIT_S = 1,
+      UNIT_MIN = 2,
+      UNIT_H = 3
+    };
+    // Output action, at start and at expiration
+    enum Action : uint8_t {
+      ACT_NONE = '-',
+      ACT_OFF = '0',
+      ACT_ON = '1',
+      ACT_TOGGLE = 'T'
+    };
+
+    struct Timer {
+      uint16_t interval;	// 0: timer unused
+      uint8_t out;	// Local digital output line
+      uint8_t start;	// Action
+      uint8_t expire;	// Action
+    };
+
+    TimerTable();
+
+    // Slot contents (interval 0 if unused); NULL if slot is out of range
+    const Timer *at(int slot);
+    // Replace (or, with NULL, clear) slot; returns true in case of error
+    bool set(int slot, const Timer *t);
+
+    // ms in an interval word; 0 if it is malformed or 0
+    static uint64_t ms(uint16_t interval);
+
+    // Text form of the action used in register 0x25: <out:ByteHex> <start:Action> <expire:Action>
+    // parse() returns true if txt is malformed; format() returns the number of characters written (4 + terminator)
+    static bool parse(const uint8_t *txt, Timer &t);
+    static int format(char *buff, const Timer &t);
+
+    // Returns true in case of error; load() replaces current timers only if the saved copy is valid
+    bool load();
+    bool save();
+
+  private:
+    Timer _timers[MAX_TIMERS];
+};
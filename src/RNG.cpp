@@ -0,0 +1,118 @@
+#include "RNG.h"
+
+#include "crypto/Crypto.h"
+#include "crypto/ChaChaPoly.h"
+#include "crypto/SHA512.h"
+#include <string.h>
+#if !defined(ESP8266) && defined(__linux__)
+#include <sys/random.h>
+#endif
+
+RNGClass RNG=RNGClass();
+
+uint8_t RNGClass::_key[32];
+uint8_t RNGClass::_buffer[RNGClass::BUFFER_SIZE];
+size_t RNGClass::_pos=RNGClass::BUFFER_SIZE;
+uint32_t RNGClass::_untilReseed=0;
+uint8_t RNGClass::_pool[64];
+bool RNGClass::_healthy=true;
+
+// Consecutive identical bytes that make the TRNG fail the repetition count test (SP 800-90B 4.4.1):
+// false positive rate below 2^-20 even if it only gave 1 bit of entropy per byte
+#define RNG_RCT_CUTOFF 21
+
+bool RNGClass::readSource(uint8_t *data, size_t len)
+{
+#if defined(ESP8266)
+  uint8_t last=0;
+  int repeat=0;
+  bool failed=false;
+
+  for(size_t p=0; p<len; ++p) {
+    data[p]=*((volatile uint8_t*)0x3FF20E44);
+    if(p && data[p]==last) {
+      if(++repeat>=RNG_RCT_CUTOFF-1)
+        failed=true;
+    } else {
+      repeat=0;
+    }
+    last=data[p];
+  }
+  return failed;
+#elif defined(__linux__)
+  size_t got=0;
+  while(got<len) {
+    ssize_t rv=getrandom(data+got, len-got, 0);
+    if(rv<=0)
+      return true;
+    got+=rv;
+  }
+  return false;
+#else
+  // No known entropy source: only stirred data gets in, and keys are refused
+  memset(data, 0, len);
+  return true;
+#endif
+}
+
+// New key from the current one, stirred data and fresh entropy
+void RNGClass::reseed()
+{
+  uint8_t seed[SEED_SIZE];
+  uint8_t h[64];
+  SHA512 hash;
+
+  _healthy=!readSource(seed, sizeof(seed));
+  hash.update(_key, sizeof(_key));
+  hash.update(_pool, sizeof(_pool));
+  hash.update(seed, sizeof(seed));
+  hash.finalize(h, sizeof(h));
+  memcpy(_key, h, sizeof(_key));
+  clean(h);
+  clean(seed);
+  clean(_pool);
+  _pos=BUFFER_SIZE; // Discard keystream generated with the old key
+  _untilReseed=RESEED_BYTES;
+}
+
+// Generate BUFFER_SIZE bytes of keystream; the first 32 become the next key
+void RNGClass::refill()
+{
+  static const uint8_t nonce[ChaChaPoly::NONCE_SIZE]={ 0 };	// Key is never reused
+
+  for(uint32_t b=0; b<BUFFER_SIZE/64; ++b)
+    ChaChaPoly::block(_buffer+64*b, _key, b, nonce);
+  memcpy(_key, _buffer, sizeof(_key));
+  clean(_buffer, sizeof(_key));
+  _pos=sizeof(_key);
+}
+
+void RNGClass::rand(uint8_t *data, size_t len)
+{
+  while(len) {
+    if(!_untilReseed)
+      reseed();
+    if(_pos==BUFFER_SIZE)
+      refill();
+    size_t n=BUFFER_SIZE-_pos;
+    if(n>len)
+      n=len;
+    if(n>_untilReseed)
+      n=_untilReseed;
+    memcpy(data, _buffer+_pos, n);
+    clean(_buffer+_pos, n);
+    _pos+=n;
+    _untilReseed-=n;
+    data+=n;
+    len-=n;
+  }
+}
+
+void RNGClass::stir(const uint8_t *data, size_t len)
+{
+  SHA512 hash;
+
+  hash.update(_pool, sizeof(_pool));
+  hash.update(data, len);
+  hash.finalize(_pool, sizeof(_pool));
+}
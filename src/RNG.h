@@ -1,4 +1,6 @@
-// Replaces the one in arduinolibs, uses the TRNG in ESP8266
+// Replaces the one in arduinolibs: a ChaCha20 DRBG seeded from the TRNG in ESP8266
+// (or getrandom() on Linux host builds, so key generation works in tests too)
+// Other targets have no entropy source: healthy() stays false, so no keys can be generated there
 #pragma once
 
 #include <stddef.h>
@@ -6,11 +8,30 @@
 
 class RNGClass {
   public:
-    static void rand(uint8_t *data, size_t len) {
-      for(size_t p=0; p<len; ++p) {
-        data[p]=*((volatile uint8_t*)0x3FF20E44);
-      }
-    }
+    // Fill data with len random bytes
+    static void rand(uint8_t *data, size_t len);
+    // Mix extra (even low quality) entropy into the state: it's hashed into the next reseed
+    static void stir(const uint8_t *data, size_t len);
+    // False if the entropy source failed its health test at the last reseed (output is still
+    // unpredictable if it ever got a good seed, but new entropy is not being added)
+    // Key generation and key exchange are refused meanwhile
+    static bool healthy() { return _healthy; };
+
+  private:
+    static const size_t BUFFER_SIZE=4*64;	// Keystream generated at once: 4 ChaCha20 blocks
+    static const uint32_t RESEED_BYTES=16384;	// Output between reseeds
+    static const int SEED_SIZE=64;	// Bytes read from the entropy source at every reseed
+
+    static void reseed();
+    static void refill();
+    static bool readSource(uint8_t *data, size_t len); // Returns true if health test failed
+
+    static uint8_t _key[32];	// Replaced at every refill: past output can't be recovered
+    static uint8_t _buffer[BUFFER_SIZE];	// Served bytes are wiped
+    static size_t _pos;	// Next unused byte in _buffer
+    static uint32_t _untilReseed;	// Output bytes left before the next reseed; 0 if never seeded
+    static uint8_t _pool[64];	// Stirred entropy, waiting for the next reseed
+    static bool _healthy;
 };
 
 extern RNGClass RNG;
@@ -27,7 +27,14 @@
 #include <stddef.h>
 
 // Define exactly one of these to 1 to set the size of the basic limb type.
-#if defined(__AVR__) || defined(ESP8266)
+#if defined(BIGNUMBER_LIMB)
+// Forced by the build (e.g. -DBIGNUMBER_LIMB=16), to compare limb sizes
+// on the same host.
+#define BIGNUMBER_LIMB_8BIT  (BIGNUMBER_LIMB == 8)
+#define BIGNUMBER_LIMB_16BIT (BIGNUMBER_LIMB == 16)
+#define BIGNUMBER_LIMB_32BIT (BIGNUMBER_LIMB == 32)
+#define BIGNUMBER_LIMB_64BIT (BIGNUMBER_LIMB == 64)
+#elif defined(__AVR__) || defined(ESP8266)
 // 16-bit limbs seem to give the best performance on 8-bit AVR micros.
 // They also seem to give better performance on ESP8266 as well.
 #define BIGNUMBER_LIMB_8BIT  0
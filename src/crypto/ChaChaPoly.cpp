@@ -0,0 +1,296 @@
+/*
+ * ChaCha20-Poly1305 AEAD (RFC 8439).
+ *
+ * Poly1305 uses 26-bit limbs with 32x32->64 bit products, which is the
+ * cheapest layout on 32-bit CPUs without a wide multiplier.  The AEAD
+ * construction only ever feeds whole 16-byte blocks to Poly1305 (every
+ * field is zero-padded), so no partial-block handling is needed.
+ */
+
+#include "ChaChaPoly.h"
+#include "Crypto.h"
+#include <string.h>
+
+/**
+ * \class ChaChaPoly ChaChaPoly.h <ChaChaPoly.h>
+ * \brief ChaCha20-Poly1305 authenticated encryption with associated data.
+ *
+ * Reference: <a href="https://tools.ietf.org/html/rfc8439">RFC 8439</a>
+ */
+
+#define CHACHA_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = CHACHA_ROTL(d, 16); \
+        c += d; b ^= c; b = CHACHA_ROTL(b, 12); \
+        a += b; d ^= a; d = CHACHA_ROTL(d, 8); \
+        c += d; b ^= c; b = CHACHA_ROTL(b, 7); \
+    } while (0)
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    return ((uint32_t)p[0]) | (((uint32_t)p[1]) << 8) |
+           (((uint32_t)p[2]) << 16) | (((uint32_t)p[3]) << 24);
+}
+
+static inline void store32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * \brief Computes a ChaCha20 keystream block.
+ *
+ * \param output The 64 bytes of keystream.
+ * \param key The 256-bit key.
+ * \param counter The 32-bit block counter.
+ * \param nonce The 96-bit nonce.
+ */
+void ChaChaPoly::block(uint8_t output[64], const uint8_t key[32],
+                       uint32_t counter, const uint8_t nonce[12])
+{
+    uint32_t input[16];
+    uint32_t x[16];
+    uint8_t posn;
+
+    input[0] = 0x61707865;  // "expand 32-byte k"
+    input[1] = 0x3320646E;
+    input[2] = 0x79622D32;
+    input[3] = 0x6B206574;
+    for (posn = 0; posn < 8; ++posn)
+        input[4 + posn] = load32(key + 4 * posn);
+    input[12] = counter;
+    input[13] = load32(nonce);
+    input[14] = load32(nonce + 4);
+    input[15] = load32(nonce + 8);
+
+    memcpy(x, input, sizeof(x));
+    for (posn = 0; posn < 10; ++posn) {
+        CHACHA_QR(x[0], x[4], x[8], x[12]);
+        CHACHA_QR(x[1], x[5], x[9], x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8], x[13]);
+        CHACHA_QR(x[3], x[4], x[9], x[14]);
+    }
+    for (posn = 0; posn < 16; ++posn)
+        store32(output + 4 * posn, x[posn] + input[posn]);
+
+    clean(input);
+    clean(x);
+}
+
+/**
+ * \brief XORs data with the ChaCha20 keystream, starting at block 1.
+ */
+void ChaChaPoly::crypt(uint8_t *data, size_t len, const uint8_t key[32],
+                       const uint8_t nonce[12])
+{
+    uint8_t stream[64];
+    uint32_t counter = 1;   // Block 0 is the Poly1305 key
+
+    while (len > 0) {
+        size_t size = (len < 64) ? len : 64;
+        block(stream, key, counter++, nonce);
+        for (size_t posn = 0; posn < size; ++posn)
+            data[posn] ^= stream[posn];
+        data += size;
+        len -= size;
+    }
+    clean(stream);
+}
+
+namespace {
+
+// Poly1305 accumulator, r and s in 26-bit limbs.
+struct Poly1305
+{
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+
+    void init(const uint8_t key[32])
+    {
+        r[0] = (load32(key + 0)) & 0x3FFFFFF;
+        r[1] = (load32(key + 3) >> 2) & 0x3FFFF03;
+        r[2] = (load32(key + 6) >> 4) & 0x3FFC0FF;
+        r[3] = (load32(key + 9) >> 6) & 0x3F03FFF;
+        r[4] = (load32(key + 12) >> 8) & 0x00FFFFF;
+        memset(h, 0, sizeof(h));
+        for (uint8_t posn = 0; posn < 4; ++posn)
+            pad[posn] = load32(key + 16 + 4 * posn);
+    }
+
+    // Process len bytes, zero-padding the last block to 16 bytes.
+    void update(const uint8_t *data, size_t len)
+    {
+        uint8_t last[16];
+        while (len > 0) {
+            const uint8_t *m = data;
+            if (len < 16) {
+                memcpy(last, data, len);
+                memset(last + len, 0, 16 - len);
+                m = last;
+                len = 16;
+            }
+            processBlock(m);
+            data += 16;
+            len -= 16;
+        }
+    }
+
+    void processBlock(const uint8_t m[16])
+    {
+        uint32_t s1 = r[1] * 5;
+        uint32_t s2 = r[2] * 5;
+        uint32_t s3 = r[3] * 5;
+        uint32_t s4 = r[4] * 5;
+        uint64_t d0, d1, d2, d3, d4;
+        uint32_t c;
+
+        h[0] += (load32(m + 0)) & 0x3FFFFFF;
+        h[1] += (load32(m + 3) >> 2) & 0x3FFFFFF;
+        h[2] += (load32(m + 6) >> 4) & 0x3FFFFFF;
+        h[3] += (load32(m + 9) >> 6) & 0x3FFFFFF;
+        h[4] += (load32(m + 12) >> 8) | (1UL << 24);
+
+        d0 = (uint64_t)h[0] * r[0] + (uint64_t)h[1] * s4 + (uint64_t)h[2] * s3 +
+             (uint64_t)h[3] * s2 + (uint64_t)h[4] * s1;
+        d1 = (uint64_t)h[0] * r[1] + (uint64_t)h[1] * r[0] + (uint64_t)h[2] * s4 +
+             (uint64_t)h[3] * s3 + (uint64_t)h[4] * s2;
+        d2 = (uint64_t)h[0] * r[2] + (uint64_t)h[1] * r[1] + (uint64_t)h[2] * r[0] +
+             (uint64_t)h[3] * s4 + (uint64_t)h[4] * s3;
+        d3 = (uint64_t)h[0] * r[3] + (uint64_t)h[1] * r[2] + (uint64_t)h[2] * r[1] +
+             (uint64_t)h[3] * r[0] + (uint64_t)h[4] * s4;
+        d4 = (uint64_t)h[0] * r[4] + (uint64_t)h[1] * r[3] + (uint64_t)h[2] * r[2] +
+             (uint64_t)h[3] * r[1] + (uint64_t)h[4] * r[0];
+
+        c = (uint32_t)(d0 >> 26); h[0] = (uint32_t)d0 & 0x3FFFFFF;
+        d1 += c; c = (uint32_t)(d1 >> 26); h[1] = (uint32_t)d1 & 0x3FFFFFF;
+        d2 += c; c = (uint32_t)(d2 >> 26); h[2] = (uint32_t)d2 & 0x3FFFFFF;
+        d3 += c; c = (uint32_t)(d3 >> 26); h[3] = (uint32_t)d3 & 0x3FFFFFF;
+        d4 += c; c = (uint32_t)(d4 >> 26); h[4] = (uint32_t)d4 & 0x3FFFFFF;
+        h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3FFFFFF;
+        h[1] += c;
+    }
+
+    void finish(uint8_t tag[16])
+    {
+        uint32_t g[5];
+        uint32_t c, mask;
+        uint64_t f;
+
+        // Full carry, then compute h - p and keep it if it's not negative
+        c = h[1] >> 26; h[1] &= 0x3FFFFFF;
+        h[2] += c; c = h[2] >> 26; h[2] &= 0x3FFFFFF;
+        h[3] += c; c = h[3] >> 26; h[3] &= 0x3FFFFFF;
+        h[4] += c; c = h[4] >> 26; h[4] &= 0x3FFFFFF;
+        h[0] += c * 5; c = h[0] >> 26; h[0] &= 0x3FFFFFF;
+        h[1] += c;
+
+        g[0] = h[0] + 5; c = g[0] >> 26; g[0] &= 0x3FFFFFF;
+        g[1] = h[1] + c; c = g[1] >> 26; g[1] &= 0x3FFFFFF;
+        g[2] = h[2] + c; c = g[2] >> 26; g[2] &= 0x3FFFFFF;
+        g[3] = h[3] + c; c = g[3] >> 26; g[3] &= 0x3FFFFFF;
+        g[4] = h[4] + c - (1UL << 26);
+
+        mask = (g[4] >> 31) - 1;    // All ones if h >= p
+        for (uint8_t posn = 0; posn < 5; ++posn)
+            h[posn] = (h[posn] & ~mask) | (g[posn] & mask);
+
+        // h = (h + s) % 2^128
+        uint32_t out[4];
+        out[0] = h[0] | (h[1] << 26);
+        out[1] = (h[1] >> 6) | (h[2] << 20);
+        out[2] = (h[2] >> 12) | (h[3] << 14);
+        out[3] = (h[3] >> 18) | (h[4] << 8);
+        f = 0;
+        for (uint8_t posn = 0; posn < 4; ++posn) {
+            f += (uint64_t)out[posn] + pad[posn];
+            store32(tag + 4 * posn, (uint32_t)f);
+            f >>= 32;
+        }
+        clean(g);
+        clean(out);
+    }
+};
+
+} // namespace
+
+/**
+ * \brief Computes the Poly1305 tag over the associated data and the ciphertext.
+ */
+void ChaChaPoly::authenticate(uint8_t tag[16], const uint8_t *data, size_t len,
+                              const uint8_t *ad, size_t adLen,
+                              const uint8_t key[32], const uint8_t nonce[12])
+{
+    uint8_t polyKey[64];
+    uint8_t lens[16];
+    Poly1305 poly;
+
+    block(polyKey, key, 0, nonce);
+    poly.init(polyKey);
+    poly.update(ad, adLen);
+    poly.update(data, len);
+    for (uint8_t posn = 0; posn < 8; ++posn) {
+        lens[posn] = (uint8_t)(((uint64_t)adLen) >> (8 * posn));
+        lens[8 + posn] = (uint8_t)(((uint64_t)len) >> (8 * posn));
+    }
+    poly.update(lens, sizeof(lens));
+    poly.finish(tag);
+
+    clean(polyKey);
+    clean(poly);
+}
+
+/**
+ * \brief Encrypts and authenticates a buffer in place.
+ *
+ * \param data The plaintext on entry, the ciphertext on exit.
+ * \param len Number of bytes in \a data.
+ * \param tag Receives the 16-byte authentication tag.
+ * \param ad Associated data, authenticated but not encrypted (can be NULL
+ * if \a adLen is zero).
+ * \param adLen Number of bytes of associated data.
+ * \param key The 256-bit key.
+ * \param nonce The 96-bit nonce: it must never be reused with the same key.
+ */
+void ChaChaPoly::encrypt(uint8_t *data, size_t len, uint8_t tag[16],
+                         const uint8_t *ad, size_t adLen,
+                         const uint8_t key[32], const uint8_t nonce[12])
+{
+    crypt(data, len, key, nonce);
+    authenticate(tag, data, len, ad, adLen, key, nonce);
+}
+
+/**
+ * \brief Checks and decrypts a buffer in place.
+ *
+ * \param data The ciphertext on entry, the plaintext on exit.
+ * \param len Number of bytes in \a data.
+ * \param tag The 16-byte authentication tag received with the ciphertext.
+ * \param ad Associated data, as passed to encrypt().
+ * \param adLen Number of bytes of associated data.
+ * \param key The 256-bit key.
+ * \param nonce The 96-bit nonce.
+ *
+ * \return Returns true if the tag is valid.  The tag is checked before
+ * decrypting: if it's invalid \a data is left untouched.
+ */
+bool ChaChaPoly::decrypt(uint8_t *data, size_t len, const uint8_t tag[16],
+                         const uint8_t *ad, size_t adLen,
+                         const uint8_t key[32], const uint8_t nonce[12])
+{
+    uint8_t check[16];
+    authenticate(check, data, len, ad, adLen, key, nonce);
+    bool ok = secure_compare(check, tag, sizeof(check));
+    clean(check);
+    if (ok)
+        crypt(data, len, key, nonce);
+    return ok;
+}
@@ -0,0 +1,39 @@
+/*
+ * ChaCha20-Poly1305 AEAD as specified in RFC 8439.
+ * One-shot interface working in place, sized for small packets.
+ */
+
+#ifndef CRYPTO_CHACHAPOLY_h
+#define CRYPTO_CHACHAPOLY_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+class ChaChaPoly
+{
+public:
+    static const size_t KEY_SIZE = 32;
+    static const size_t NONCE_SIZE = 12;
+    static const size_t TAG_SIZE = 16;
+
+    static void encrypt(uint8_t *data, size_t len, uint8_t tag[16],
+                        const uint8_t *ad, size_t adLen,
+                        const uint8_t key[32], const uint8_t nonce[12]);
+    static bool decrypt(uint8_t *data, size_t len, const uint8_t tag[16],
+                        const uint8_t *ad, size_t adLen,
+                        const uint8_t key[32], const uint8_t nonce[12]);
+
+    static void block(uint8_t output[64], const uint8_t key[32],
+                      uint32_t counter, const uint8_t nonce[12]);
+
+private:
+    ChaChaPoly() {}
+
+    static void crypt(uint8_t *data, size_t len, const uint8_t key[32],
+                      const uint8_t nonce[12]);
+    static void authenticate(uint8_t tag[16], const uint8_t *data, size_t len,
+                             const uint8_t *ad, size_t adLen,
+                             const uint8_t key[32], const uint8_t nonce[12]);
+};
+
+#endif
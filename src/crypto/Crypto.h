@@ -36,6 +36,8 @@ inline void clean(T &var)
 
 bool secure_compare(const void *data1, const void *data2, size_t len);
 
+uint8_t crypto_crc8(uint8_t tag, const void *data, unsigned size);
+
 #if defined(ESP8266)
 extern "C" void system_soft_wdt_feed(void);
 #define crypto_feed_watchdog() system_soft_wdt_feed()
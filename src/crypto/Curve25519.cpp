@@ -84,18 +84,8 @@ bool Curve25519::eval(uint8_t result[32], const uint8_t s[32], const uint8_t x[3
     limb_t x_3[NUM_LIMBS_256BIT];
     limb_t z_2[NUM_LIMBS_256BIT];
     limb_t z_3[NUM_LIMBS_256BIT];
-    limb_t A[NUM_LIMBS_256BIT];
-    limb_t B[NUM_LIMBS_256BIT];
-    limb_t C[NUM_LIMBS_256BIT];
-    limb_t D[NUM_LIMBS_256BIT];
-    limb_t E[NUM_LIMBS_256BIT];
-    limb_t AA[NUM_LIMBS_256BIT];
-    limb_t BB[NUM_LIMBS_256BIT];
-    limb_t DA[NUM_LIMBS_256BIT];
-    limb_t CB[NUM_LIMBS_256BIT];
     uint8_t mask;
     uint8_t sposn;
-    uint8_t select;
     uint8_t swap;
     bool retval;
 
@@ -119,19 +109,63 @@ bool Curve25519::eval(uint8_t result[32], const uint8_t s[32], const uint8_t x[3
     // report the failure at the end.
     retval = (bool)(reduceQuick(x_1) & 0x01);
 
-    // Initialize the other temporary variables.
-    memset(x_2, 0, sizeof(x_2));        // x_2 = 1
-    x_2[0] = 1;
-    memset(z_2, 0, sizeof(z_2));        // z_2 = 0
-    memcpy(x_3, x_1, sizeof(x_1));      // x_3 = x
-    memcpy(z_3, x_2, sizeof(x_2));      // z_3 = 1
-
     // Iterate over all 255 bits of "s" from the highest to the lowest.
-    // We ignore the high bit of the 256-bit representation of "s".
+    ladderInit(x_2, x_3, z_2, z_3, x_1);
     mask = 0x40;
     sposn = 31;
     swap = 0;
-    for (uint8_t t = 255; t > 0; --t) {
+    ladder(x_2, x_3, z_2, z_3, x_1, s, mask, sposn, swap, 255);
+    ladderFinish(result, x_2, x_3, z_2, z_3, swap);
+
+    // Clean up and exit.
+    clean(x_1);
+    clean(x_2);
+    clean(x_3);
+    clean(z_2);
+    clean(z_3);
+    return retval;
+}
+
+/** @cond */
+
+/**
+ * \brief Initializes the Montgomery ladder for eval().
+ */
+void Curve25519::ladderInit(limb_t *x_2, limb_t *x_3, limb_t *z_2,
+                            limb_t *z_3, const limb_t *x_1)
+{
+    memset(x_2, 0, NUM_LIMBS_256BIT * sizeof(limb_t));  // x_2 = 1
+    x_2[0] = 1;
+    memset(z_2, 0, NUM_LIMBS_256BIT * sizeof(limb_t));  // z_2 = 0
+    memcpy(x_3, x_1, NUM_LIMBS_256BIT * sizeof(limb_t)); // x_3 = x
+    memcpy(z_3, x_2, NUM_LIMBS_256BIT * sizeof(limb_t)); // z_3 = 1
+}
+
+/**
+ * \brief Processes the next \a bits bits of \a s in the Montgomery ladder.
+ *
+ * \a mask, \a sposn and \a swap carry the position in \a s and the
+ * pending swap between calls: they start at 0x40, 31 and 0, since
+ * the high bit of the 256-bit representation of "s" is ignored.
+ * All 255 bits must be processed before calling ladderFinish().
+ */
+void Curve25519::ladder(limb_t *x_2, limb_t *x_3, limb_t *z_2, limb_t *z_3,
+                        const limb_t *x_1, const uint8_t s[32],
+                        uint8_t &mask, uint8_t &sposn, uint8_t &swap,
+                        uint8_t bits)
+{
+    limb_t A[NUM_LIMBS_256BIT];
+    limb_t B[NUM_LIMBS_256BIT];
+    limb_t C[NUM_LIMBS_256BIT];
+    limb_t D[NUM_LIMBS_256BIT];
+    limb_t E[NUM_LIMBS_256BIT];
+    limb_t AA[NUM_LIMBS_256BIT];
+    limb_t BB[NUM_LIMBS_256BIT];
+    limb_t DA[NUM_LIMBS_256BIT];
+    limb_t CB[NUM_LIMBS_256BIT];
+    uint8_t select;
+
+    for (; bits > 0; --bits) {
         // Conditional swaps on entry to this bit but only if we
         // didn't swap on the previous bit.
         select = s[sposn] & mask;
@@ -170,6 +204,25 @@ bool Curve25519::eval(uint8_t result[32], const uint8_t s[32], const uint8_t x[3
         }
     }
 
+    clean(A);
+    clean(B);
+    clean(C);
+    clean(D);
+    clean(E);
+    clean(AA);
+    clean(BB);
+    clean(DA);
+    clean(CB);
+}
+
+/**
+ * \brief Computes the result of the Montgomery ladder.
+ *
+ * \a z_3 is used as a temporary.
+ */
+void Curve25519::ladderFinish(uint8_t result[32], limb_t *x_2, limb_t *x_3,
+                              limb_t *z_2, limb_t *z_3, uint8_t swap)
+{
     // Final conditional swaps.
     cswap(swap, x_2, x_3);
     cswap(swap, z_2, z_3);
@@ -180,25 +233,10 @@ bool Curve25519::eval(uint8_t result[32], const uint8_t s[32], const uint8_t x[3
 
     // Pack the result into the return array.
     BigNumberUtil::packLE(result, 32, x_2, NUM_LIMBS_256BIT);
-
-    // Clean up and exit.
-    clean(x_1);
-    clean(x_2);
-    clean(x_3);
-    clean(z_2);
-    clean(z_3);
-    clean(A);
-    clean(B);
-    clean(C);
-    clean(D);
-    clean(E);
-    clean(AA);
-    clean(BB);
-    clean(DA);
-    clean(CB);
-    return retval;
 }
 
+/** @endcond */
+
 /**
  * \brief Performs phase 1 of a Diffie-Hellman key exchange using Curve25519.
  *
@@ -244,25 +282,94 @@ bool Curve25519::eval(uint8_t result[32], const uint8_t s[32], const uint8_t x[3
  */
 void Curve25519::dh1(uint8_t k[32], uint8_t f[32])
 {
-    do {
-        // Generate a random "f" value and then adjust the value to make
-        // it valid as an "s" value for eval().  According to the specification
-        // we need to mask off the 3 right-most bits of f[0], mask off the
-        // left-most bit of f[31], and set the second to left-most bit of f[31].
-        RNG.rand(f, 32);
-        f[0] &= 0xF8;
-        f[31] = (f[31] & 0x7F) | 0x40;
-
-        // Evaluate the curve function: k = Curve25519::eval(f, 9).
-        // We pass NULL to eval() to indicate the value 9.  There is no
-        // need to check the return value from eval() because we know
-        // that 9 is a valid field element.
-        eval(k, f, 0);
-
-        // If "k" is weak for contributory behaviour then reject it,
-        // generate another "f" value, and try again.  This case is
-        // highly unlikely but we still perform the check just in case.
-    } while (isWeakPoint(k));
+    DH1Context ctx;
+    dh1Start(ctx, k, f);
+    while (!dh1Step(ctx, 255))
+        ;
+}
+
+/**
+ * \brief Starts phase 1 of a Diffie-Hellman key exchange in time slices.
+ *
+ * \param ctx The key generation context.
+ * \param k The key value to send to the other party, written when dh1Step()
+ * returns true.
+ * \param f The generated secret value for this party, as for dh1().
+ *
+ * Only the random "f" value is generated here: the scalar multiplication
+ * is left to dh1Step().  Both buffers must stay valid until dh1Step()
+ * returns true or dh1Abort() is called.
+ *
+ * \sa dh1Step(), dh1Abort(), dh1()
+ */
+void Curve25519::dh1Start(DH1Context &ctx, uint8_t k[32], uint8_t f[32])
+{
+    // Generate a random "f" value and then adjust the value to make
+    // it valid as an "s" value for eval().  According to the specification
+    // we need to mask off the 3 right-most bits of f[0], mask off the
+    // left-most bit of f[31], and set the second to left-most bit of f[31].
+    RNG.rand(f, 32);
+    f[0] &= 0xF8;
+    f[31] = (f[31] & 0x7F) | 0x40;
+
+    // Evaluate the curve function: k = Curve25519::eval(f, 9).
+    // There is no need to check the range of x_1 because we know
+    // that 9 is a valid field element.
+    memset(ctx.x_1, 0, sizeof(ctx.x_1));
+    ctx.x_1[0] = 9;
+    ladderInit(ctx.x_2, ctx.x_3, ctx.z_2, ctx.z_3, ctx.x_1);
+    ctx.mask = 0x40;
+    ctx.sposn = 31;
+    ctx.swap = 0;
+    ctx.left = 255;
+    ctx.k = k;
+    ctx.f = f;
+}
+
+/**
+ * \brief Continues a key generation started by dh1Start().
+ *
+ * \param ctx The key generation context.
+ * \param bits Maximum number of bits of the scalar multiplication to
+ * process in this call.  The final inversion is performed in a call
+ * of its own.
+ *
+ * \return Returns true when "k" and "f" have been written (the context
+ * is then cleaned), false if more calls are needed.
+ *
+ * \sa dh1Start()
+ */
+bool Curve25519::dh1Step(DH1Context &ctx, uint8_t bits)
+{
+    if (ctx.left) {
+        if (bits > ctx.left)
+            bits = ctx.left;
+        ladder(ctx.x_2, ctx.x_3, ctx.z_2, ctx.z_3, ctx.x_1, ctx.f,
+               ctx.mask, ctx.sposn, ctx.swap, bits);
+        ctx.left -= bits;
+        return false;
+    }
+    ladderFinish(ctx.k, ctx.x_2, ctx.x_3, ctx.z_2, ctx.z_3, ctx.swap);
+
+    // If "k" is weak for contributory behaviour then reject it,
+    // generate another "f" value, and try again.  This case is
+    // highly unlikely but we still perform the check just in case.
+    if (isWeakPoint(ctx.k)) {
+        dh1Start(ctx, ctx.k, ctx.f);
+        return false;
+    }
+    dh1Abort(ctx);
+    return true;
+}
+
+/**
+ * \brief Aborts a key generation started by dh1Start(), cleaning the context.
+ *
+ * The "f" value is not cleaned: it belongs to the caller.
+ */
+void Curve25519::dh1Abort(DH1Context &ctx)
+{
+    clean(&ctx, sizeof(ctx));
 }
 
 /**
@@ -35,6 +35,26 @@ public:
     static void dh1(uint8_t k[32], uint8_t f[32]);
     static bool dh2(uint8_t k[32], uint8_t f[32]);
 
+    // State of a time-sliced dh1(): see dh1Start() and dh1Step().
+    struct DH1Context
+    {
+        limb_t x_1[32 / sizeof(limb_t)];
+        limb_t x_2[32 / sizeof(limb_t)];
+        limb_t x_3[32 / sizeof(limb_t)];
+        limb_t z_2[32 / sizeof(limb_t)];
+        limb_t z_3[32 / sizeof(limb_t)];
+        uint8_t mask;
+        uint8_t sposn;
+        uint8_t swap;
+        uint8_t left;
+        uint8_t *k;
+        uint8_t *f;
+    };
+
+    static void dh1Start(DH1Context &ctx, uint8_t k[32], uint8_t f[32]);
+    static bool dh1Step(DH1Context &ctx, uint8_t bits);
+    static void dh1Abort(DH1Context &ctx);
+
 #if defined(TEST_CURVE25519_FIELD_OPS)
 public:
 #else
@@ -42,6 +62,15 @@ private:
 #endif
     static uint8_t isWeakPoint(const uint8_t k[32]);
 
+    static void ladderInit(limb_t *x_2, limb_t *x_3, limb_t *z_2,
+                           limb_t *z_3, const limb_t *x_1);
+    static void ladder(limb_t *x_2, limb_t *x_3, limb_t *z_2, limb_t *z_3,
+                       const limb_t *x_1, const uint8_t s[32],
+                       uint8_t &mask, uint8_t &sposn, uint8_t &swap,
+                       uint8_t bits);
+    static void ladderFinish(uint8_t result[32], limb_t *x_2, limb_t *x_3,
+                             limb_t *z_2, limb_t *z_3, uint8_t swap);
+
     static void reduce(limb_t *result, limb_t *x, uint8_t size);
     static limb_t reduceQuick(limb_t *x);
 
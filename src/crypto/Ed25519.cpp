@@ -127,50 +127,154 @@ static limb_t const numQ[NUM_LIMBS_256BIT] PROGMEM = {
 void Ed25519::sign(uint8_t signature[64], const uint8_t privateKey[32],
                    const uint8_t publicKey[32], const void *message, size_t len)
 {
-    SHA512 hash;
-    uint8_t *buf = (uint8_t *)(hash.state.w); // Reuse hash buffer to save memory.
-    limb_t a[NUM_LIMBS_256BIT];
-    limb_t r[NUM_LIMBS_256BIT];
-    limb_t k[NUM_LIMBS_256BIT];
+    SignContext ctx;
+    signStart(ctx, signature, privateKey, publicKey, message, len);
+    while (!signStep(ctx, 255))
+        ;
+}
+
+/** @cond */
+
+// Phases of a time-sliced signature.
+enum {
+    SIGN_MUL,       // Computing rB, a few bits at a time
+    SIGN_ENCODE,    // Encoding rB as R
+    SIGN_FINISH,    // Computing s
+    SIGN_DONE
+};
+
+/** @endcond */
+
+/**
+ * \brief Starts signing a message in time slices.
+ *
+ * \param ctx The signing context.
+ * \param signature The signature value, written when signStep() returns true.
+ * \param privateKey The private key to use to sign the message.
+ * \param publicKey The public key corresponding to \a privateKey.
+ * \param message Points to the message to be signed.
+ * \param len The length of the \a message to be signed.
+ *
+ * Only the hashing of the private key and of the message are performed
+ * here: the costly scalar multiplication is left to signStep().
+ * All the buffers (except \a privateKey) must stay valid until signStep()
+ * returns true or signAbort() is called.
+ *
+ * \sa signStep(), signAbort(), sign()
+ */
+void Ed25519::signStart(SignContext &ctx, uint8_t signature[64],
+                        const uint8_t privateKey[32],
+                        const uint8_t publicKey[32], const void *message,
+                        size_t len)
+{
+    uint8_t *buf = (uint8_t *)(ctx.hash.state.w); // Reuse hash buffer to save memory.
     limb_t t[NUM_LIMBS_512BIT + 1];
-    Point rB;
 
     // Derive the secret scalar a and the message prefix from the private key.
-    deriveKeys(&hash, a, privateKey);
+    deriveKeys(&ctx.hash, ctx.a, privateKey);
 
     // Hash the prefix and the message to derive r.
-    hash.reset();
-    hash.update(buf + 32, 32);
-    hash.update(message, len);
-    hash.finalize(buf, 0);
-    reduceQFromBuffer(r, buf, t);
+    ctx.hash.reset();
+    ctx.hash.update(buf + 32, 32);
+    ctx.hash.update(message, len);
+    ctx.hash.finalize(buf, 0);
+    reduceQFromBuffer(ctx.r, buf, t);
+    clean(t);
 
-    // Encode rB into the first half of the signature buffer as R.
-    mul(rB, r);
-    encodePoint(signature, rB);
+    // Prepare for rB = r * B.
+    memset(&ctx.rB, 0, sizeof(Point));
+    ctx.rB.y[0] = 1;
+    ctx.rB.z[0] = 1;
+    memcpy_P(ctx.P.x, numBx, sizeof(ctx.P.x));
+    memcpy_P(ctx.P.y, numBy, sizeof(ctx.P.y));
+    memcpy_P(ctx.P.z, numBz, sizeof(ctx.P.z));
+    memcpy_P(ctx.P.t, numBt, sizeof(ctx.P.t));
+    ctx.mask = 1;
+    ctx.sposn = 0;
+    ctx.left = 255;
+    ctx.phase = SIGN_MUL;
+
+    ctx.signature = signature;
+    ctx.publicKey = publicKey;
+    ctx.message = message;
+    ctx.len = len;
+}
 
-    // Hash R, A, and the message to get k.
-    hash.reset();
-    hash.update(signature, 32); // R
-    hash.update(publicKey, 32); // A
-    hash.update(message, len);
-    hash.finalize(buf, 0);
-    reduceQFromBuffer(k, buf, t);
+/**
+ * \brief Continues a signature started by signStart().
+ *
+ * \param ctx The signing context.
+ * \param bits Maximum number of bits of the scalar multiplication to
+ * process in this call.  Encoding the point and computing the final
+ * value are performed in calls of their own.
+ *
+ * \return Returns true when the signature has been written (the context
+ * is then cleaned), false if more calls are needed.
+ *
+ * \sa signStart()
+ */
+bool Ed25519::signStep(SignContext &ctx, uint8_t bits)
+{
+    switch (ctx.phase) {
+    case SIGN_MUL:
+        if (bits > ctx.left)
+            bits = ctx.left;
+        mulBits(ctx.rB, ctx.r, ctx.P, true, ctx.mask, ctx.sposn, bits);
+        ctx.left -= bits;
+        if (!ctx.left)
+            ctx.phase = SIGN_ENCODE;
+        return false;
 
-    // Compute s = (r + k * a) mod q.
-    Curve25519::mulNoReduce(t, k, a);
-    t[NUM_LIMBS_512BIT] = 0;
-    reduceQ(t, t);
-    BigNumberUtil::add(t, t, r, NUM_LIMBS_256BIT);
-    BigNumberUtil::reduceQuick_P(t, t, numQ, NUM_LIMBS_256BIT);
-    BigNumberUtil::packLE(signature + 32, 32, t, NUM_LIMBS_256BIT);
+    case SIGN_ENCODE:
+        // Encode rB into the first half of the signature buffer as R.
+        encodePoint(ctx.signature, ctx.rB);
+        ctx.phase = SIGN_FINISH;
+        return false;
 
-    // Clean up.
-    clean(a);
-    clean(r);
-    clean(k);
-    clean(t);
-    clean(rB);
+    case SIGN_FINISH: {
+        uint8_t *buf = (uint8_t *)(ctx.hash.state.w);
+        limb_t k[NUM_LIMBS_256BIT];
+        limb_t t[NUM_LIMBS_512BIT + 1];
+
+        // Hash R, A, and the message to get k.
+        ctx.hash.reset();
+        ctx.hash.update(ctx.signature, 32); // R
+        ctx.hash.update(ctx.publicKey, 32); // A
+        ctx.hash.update(ctx.message, ctx.len);
+        ctx.hash.finalize(buf, 0);
+        reduceQFromBuffer(k, buf, t);
+
+        // Compute s = (r + k * a) mod q.
+        Curve25519::mulNoReduce(t, k, ctx.a);
+        t[NUM_LIMBS_512BIT] = 0;
+        reduceQ(t, t);
+        BigNumberUtil::add(t, t, ctx.r, NUM_LIMBS_256BIT);
+        BigNumberUtil::reduceQuick_P(t, t, numQ, NUM_LIMBS_256BIT);
+        BigNumberUtil::packLE(ctx.signature + 32, 32, t, NUM_LIMBS_256BIT);
+
+        clean(k);
+        clean(t);
+        signAbort(ctx);
+        return true; }
+
+    default:
+        return true;
+    }
+}
+
+/**
+ * \brief Cleans a signing context, abandoning the signature in progress.
+ *
+ * \param ctx The signing context.
+ */
+void Ed25519::signAbort(SignContext &ctx)
+{
+    ctx.hash.clear();
+    clean(ctx.a);
+    clean(ctx.r);
+    clean(ctx.rB);
+    clean(ctx.P);
+    ctx.phase = SIGN_DONE;
 }
 
 /**
@@ -188,44 +292,167 @@ void Ed25519::sign(uint8_t signature[64], const uint8_t privateKey[32],
  */
 bool Ed25519::verify(const uint8_t signature[64], const uint8_t publicKey[32],
                      const void *message, size_t len)
+{
+    VerifyContext ctx;
+    verifyStart(ctx, signature, publicKey, message, len);
+    while (!verifyStep(ctx, 255))
+        ;
+    return verifyResult(ctx);
+}
+
+/** @cond */
+
+// Phases of a time-sliced verification.
+enum {
+    VERIFY_DECODE_A,    // Decoding the public key
+    VERIFY_DECODE_R,    // Decoding the R component of the signature
+    VERIFY_MUL_SB,      // Computing s * B, a few bits at a time
+    VERIFY_MUL_KA,      // Computing k * A, a few bits at a time
+    VERIFY_FINISH,      // Comparing s * B and R + k * A
+    VERIFY_DONE
+};
+
+/** @endcond */
+
+/**
+ * \brief Starts verifying a signature in time slices.
+ *
+ * \param ctx The verification context.
+ * \param signature The signature value to be verified.
+ * \param publicKey The public key to use to verify the signature.
+ * \param message The message whose signature is to be verified.
+ * \param len The length of the \a message to be verified.
+ *
+ * Only the hashing of the message is performed here: point decoding and
+ * the scalar multiplications are left to verifyStep().  The context keeps
+ * copies of everything it needs, so the buffers can be reused as soon as
+ * this function returns.
+ *
+ * \sa verifyStep(), verifyResult(), verify()
+ */
+void Ed25519::verifyStart(VerifyContext &ctx, const uint8_t signature[64],
+                          const uint8_t publicKey[32], const void *message,
+                          size_t len)
 {
     SHA512 hash;
-    Point A;
-    Point R;
-    Point sB;
-    Point kA;
     uint8_t *k = (uint8_t *)(hash.state.w); // Reuse hash buffer to save memory.
-    bool result = false;
-
-    // Decode the public key and the R component of the signature.
-    if (decodePoint(A, publicKey) && decodePoint(R, signature)) {
-        // Reconstruct the k value from the signing step.
-        hash.reset();
-        hash.update(signature, 32);
-        hash.update(publicKey, 32);
-        hash.update(message, len);
-        hash.finalize(k, 0);
-
-        // Calculate s * B.  The s value is stored temporarily in kA.t.
-        BigNumberUtil::unpackLE(kA.t, NUM_LIMBS_256BIT, signature + 32, 32);
-        mul(sB, kA.t, false);
-
-        // Calculate R + k * A.  We don't need sB.t in equal() below,
-        // so we reuse that as a temporary buffer when reducing k.
-        reduceQFromBuffer(sB.t, k, kA.x);
-        mul(kA, sB.t, A, false);
-        add(R, kA);
 
+    // Reconstruct the k value from the signing step.  kA.x is used
+    // as a temporary buffer when reducing k.
+    hash.reset();
+    hash.update(signature, 32);
+    hash.update(publicKey, 32);
+    hash.update(message, len);
+    hash.finalize(k, 0);
+    reduceQFromBuffer(ctx.k, k, ctx.kA.x);
+
+    BigNumberUtil::unpackLE(ctx.s, NUM_LIMBS_256BIT, signature + 32, 32);
+    memcpy(ctx.encA, publicKey, 32);
+    memcpy(ctx.encR, signature, 32);
+    ctx.result = false;
+    ctx.phase = VERIFY_DECODE_A;
+}
+
+/**
+ * \brief Continues a verification started by verifyStart().
+ *
+ * \param ctx The verification context.
+ * \param bits Maximum number of bits of the scalar multiplications to
+ * process in this call.  Decoding the points and the final comparison
+ * are performed in calls of their own.
+ *
+ * \return Returns true when the result is available from verifyResult(),
+ * false if more calls are needed.
+ *
+ * \sa verifyStart()
+ */
+bool Ed25519::verifyStep(VerifyContext &ctx, uint8_t bits)
+{
+    switch (ctx.phase) {
+    case VERIFY_DECODE_A:
+        // Decode the public key.
+        if (!decodePoint(ctx.A, ctx.encA)) {
+            verifyAbort(ctx);
+            return true;
+        }
+        ctx.phase = VERIFY_DECODE_R;
+        return false;
+
+    case VERIFY_DECODE_R:
+        // Decode the R component of the signature.
+        if (!decodePoint(ctx.R, ctx.encR)) {
+            verifyAbort(ctx);
+            return true;
+        }
+
+        // Prepare for s * B, using kA as the doubled point.
+        memset(&ctx.sB, 0, sizeof(Point));
+        ctx.sB.y[0] = 1;
+        ctx.sB.z[0] = 1;
+        memcpy_P(ctx.kA.x, numBx, sizeof(ctx.kA.x));
+        memcpy_P(ctx.kA.y, numBy, sizeof(ctx.kA.y));
+        memcpy_P(ctx.kA.z, numBz, sizeof(ctx.kA.z));
+        memcpy_P(ctx.kA.t, numBt, sizeof(ctx.kA.t));
+        ctx.mask = 1;
+        ctx.sposn = 0;
+        ctx.left = 255;
+        ctx.phase = VERIFY_MUL_SB;
+        return false;
+
+    case VERIFY_MUL_SB:
+        if (bits > ctx.left)
+            bits = ctx.left;
+        mulBits(ctx.sB, ctx.s, ctx.kA, false, ctx.mask, ctx.sposn, bits);
+        ctx.left -= bits;
+        if (!ctx.left) {
+            // Prepare for k * A: A is consumed as the doubled point.
+            memset(&ctx.kA, 0, sizeof(Point));
+            ctx.kA.y[0] = 1;
+            ctx.kA.z[0] = 1;
+            ctx.mask = 1;
+            ctx.sposn = 0;
+            ctx.left = 255;
+            ctx.phase = VERIFY_MUL_KA;
+        }
+        return false;
+
+    case VERIFY_MUL_KA:
+        if (bits > ctx.left)
+            bits = ctx.left;
+        mulBits(ctx.kA, ctx.k, ctx.A, false, ctx.mask, ctx.sposn, bits);
+        ctx.left -= bits;
+        if (!ctx.left)
+            ctx.phase = VERIFY_FINISH;
+        return false;
+
+    case VERIFY_FINISH: {
         // Compare s * B and R + k * A for equality.
-        result = equal(sB, R);
+        add(ctx.R, ctx.kA);
+        bool result = equal(ctx.sB, ctx.R);
+        verifyAbort(ctx);
+        ctx.result = result;
+        return true; }
+
+    default:
+        return true;
     }
+}
 
-    // Clean up and exit.
-    clean(A);
-    clean(R);
-    clean(sB);
-    clean(kA);
-    return result;
+/**
+ * \brief Cleans a verification context.
+ *
+ * \param ctx The verification context.
+ *
+ * After this call verifyResult() returns false.
+ */
+void Ed25519::verifyAbort(VerifyContext &ctx)
+{
+    clean(ctx.A);
+    clean(ctx.R);
+    clean(ctx.sB);
+    clean(ctx.kA);
+    ctx.result = false;
+    ctx.phase = VERIFY_DONE;
 }
 
 /**
@@ -351,13 +578,8 @@ void Ed25519::reduceQ(limb_t *result, limb_t *r)
  */
 void Ed25519::mul(Point &result, const limb_t *s, Point &p, bool constTime)
 {
-    Point q;
-    limb_t A[NUM_LIMBS_256BIT];
-    limb_t B[NUM_LIMBS_256BIT];
-    limb_t C[NUM_LIMBS_256BIT];
-    limb_t D[NUM_LIMBS_256BIT];
-    limb_t mask, select;
-    uint8_t sposn, t;
+    limb_t mask;
+    uint8_t sposn;
 
     // Initialize the result to (0, 1, 1, 0).
     memset(&result, 0, sizeof(Point));
@@ -367,7 +589,38 @@ void Ed25519::mul(Point &result, const limb_t *s, Point &p, bool constTime)
     // Iterate over the 255 bits of "s" to calculate "s * p".
     mask = 1;
     sposn = 0;
-    for (t = 255; t > 0; --t) {
+    mulBits(result, s, p, constTime, mask, sposn, 255);
+}
+
+/**
+ * \brief Performs some iterations of the multiplication of a value by
+ * a curve point.
+ *
+ * \param result The partial result of the multiplication.
+ * \param s The value, which must be NUM_LIMBS_256BIT limbs in size.
+ * \param p The curve point, doubled once per processed bit.
+ * \param constTime Set to true if the evaluation must be constant-time
+ * because \a s is a secret value.
+ * \param mask Mask of the next bit of \a s to process, updated on exit.
+ * \param sposn Limb of \a s holding the next bit, updated on exit.
+ * \param bits Number of bits to process.
+ *
+ * The multiplication starts with \a result set to (0, 1, 1, 0),
+ * \a mask set to 1 and \a sposn set to 0, and is complete after
+ * 255 bits have been processed.
+ */
+void Ed25519::mulBits(Point &result, const limb_t *s, Point &p, bool constTime,
+                      limb_t &mask, uint8_t &sposn, uint8_t bits)
+{
+    Point q;
+    limb_t A[NUM_LIMBS_256BIT];
+    limb_t B[NUM_LIMBS_256BIT];
+    limb_t C[NUM_LIMBS_256BIT];
+    limb_t D[NUM_LIMBS_256BIT];
+    limb_t select;
+    uint8_t t;
+
+    for (t = bits; t > 0; --t) {
         // Add p to the result to produce q.  The specification refers
         // to temporary variables A to H.  We can dispense with E to H
         // by using B, D, q.z, and q.t to hold those values temporarily.
@@ -52,10 +52,65 @@ private:
         limb_t t[32 / sizeof(limb_t)];
     };
 
+public:
+    // State of a time-sliced signature: see signStart() and signStep().
+    struct SignContext
+    {
+        SHA512 hash;
+        limb_t a[32 / sizeof(limb_t)];
+        limb_t r[32 / sizeof(limb_t)];
+        Point rB;
+        Point P;
+        limb_t mask;
+        uint8_t sposn;
+        uint8_t left;
+        uint8_t phase;
+        uint8_t *signature;
+        const uint8_t *publicKey;
+        const void *message;
+        size_t len;
+    };
+
+    static void signStart(SignContext &ctx, uint8_t signature[64],
+                          const uint8_t privateKey[32],
+                          const uint8_t publicKey[32], const void *message,
+                          size_t len);
+    static bool signStep(SignContext &ctx, uint8_t bits);
+    static void signAbort(SignContext &ctx);
+
+    // State of a time-sliced verification: see verifyStart() and verifyStep().
+    struct VerifyContext
+    {
+        Point A;
+        Point R;
+        Point sB;
+        Point kA;
+        limb_t k[32 / sizeof(limb_t)];
+        limb_t s[32 / sizeof(limb_t)];
+        uint8_t encA[32];
+        uint8_t encR[32];
+        limb_t mask;
+        uint8_t sposn;
+        uint8_t left;
+        uint8_t phase;
+        bool result;
+    };
+
+    static void verifyStart(VerifyContext &ctx, const uint8_t signature[64],
+                            const uint8_t publicKey[32], const void *message,
+                            size_t len);
+    static bool verifyStep(VerifyContext &ctx, uint8_t bits);
+    static bool verifyResult(const VerifyContext &ctx) { return ctx.result; }
+    static void verifyAbort(VerifyContext &ctx);
+
+private:
+
     static void reduceQFromBuffer(limb_t *result, const uint8_t buf[64], limb_t *temp);
     static void reduceQ(limb_t *result, limb_t *r);
 
     static void mul(Point &result, const limb_t *s, Point &p, bool constTime = true);
+    static void mulBits(Point &result, const limb_t *s, Point &p, bool constTime,
+                        limb_t &mask, uint8_t &sposn, uint8_t bits);
     static void mul(Point &result, const limb_t *s, bool constTime = true);
 
     static void add(Point &p, const Point &q);
@@ -0,0 +1,389 @@
+/*
+ * Multi-buffer SHA-512.
+ *
+ * Each SIMD lane runs the SHA-512 compression function on a different
+ * message: SSE2 gives 2 lanes, AVX2 gives 4.  As soon as a lane finishes
+ * its message it is refilled with the next one from the batch, so
+ * messages of different lengths keep all the lanes busy.  The lane code
+ * is written once with GCC vector extensions and instantiated inside
+ * functions compiled for the right instruction set; the implementation
+ * is picked at runtime from the CPU features.
+ *
+ * Non-x86 targets (and x86 CPUs without SSE2) use the plain SHA512 class.
+ */
+
+#include "SHA512MB.h"
+#include "SHA512.h"
+#include "Crypto.h"
+#include "utility/EndianUtil.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA512MB_X86 1
+#endif
+
+/**
+ * \class SHA512MB SHA512MB.h <SHA512MB.h>
+ * \brief Multi-buffer SHA-512 for hashing batches of independent messages.
+ *
+ * \sa SHA512
+ */
+
+namespace {
+
+// A batch being hashed: messages are handed out to the lanes in order.
+struct Batch
+{
+    uint8_t *hashes;
+    const void *const *data;
+    const size_t *lens;
+    size_t count;
+    size_t next;
+};
+
+#if defined(SHA512MB_X86)
+
+// One message in flight inside a lane.
+struct Stream
+{
+    const uint8_t *data;
+    size_t len;
+    size_t blocks;  // Including the padding
+    size_t block;   // Next block to compress
+    uint8_t *out;   // NULL if the lane is idle
+};
+
+// Attach the next message of the batch to a stream; false when the batch is exhausted.
+bool nextStream(Batch &b, Stream &s)
+{
+    if (b.next >= b.count) {
+        s.out = 0;
+        return false;
+    }
+    s.data = (const uint8_t *)b.data[b.next];
+    s.len = b.lens[b.next];
+    s.blocks = (s.len + 17 + 127) / 128;
+    s.block = 0;
+    s.out = b.hashes + 64 * b.next;
+    ++b.next;
+    return true;
+}
+
+typedef uint64_t v2u64 __attribute__((vector_size(16)));
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+const uint64_t hashStart[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL,
+    0xA54FF53A5F1D36F1ULL, 0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL,
+    0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+};
+
+const uint64_t k[80] = {
+    0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL,
+    0xE9B5DBA58189DBBCULL, 0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL,
+    0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL, 0xD807AA98A3030242ULL,
+    0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+    0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL,
+    0xC19BF174CF692694ULL, 0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL,
+    0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL, 0x2DE92C6F592B0275ULL,
+    0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+    0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL,
+    0xBF597FC7BEEF0EE4ULL, 0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL,
+    0x06CA6351E003826FULL, 0x142929670A0E6E70ULL, 0x27B70A8546D22FFCULL,
+    0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+    0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL,
+    0x92722C851482353BULL, 0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL,
+    0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL, 0xD192E819D6EF5218ULL,
+    0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+    0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL,
+    0x34B0BCB5E19B48A8ULL, 0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL,
+    0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL, 0x748F82EE5DEFB2FCULL,
+    0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+    0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL,
+    0xC67178F2E372532BULL, 0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL,
+    0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL, 0x06F067AA72176FBAULL,
+    0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+    0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL,
+    0x431D67C49C100D4CULL, 0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL,
+    0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+// The helpers below are always inlined so that they get compiled with
+// the instruction set of the lane-specific entry points.
+#define SHA512MB_INLINE inline __attribute__((always_inline))
+
+// A macro rather than a function: returning 256-bit vectors by value
+// from a function not compiled for AVX triggers ABI warnings.
+#define SHA512MB_ROR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+// Compress one block per lane: h[8] is the state and w[16] the
+// message block (host byte order), one 64-bit element per lane.
+template <typename V>
+SHA512MB_INLINE void compress(V *h, V *w)
+{
+    V a = h[0];
+    V b = h[1];
+    V c = h[2];
+    V d = h[3];
+    V e = h[4];
+    V f = h[5];
+    V g = h[6];
+    V hh = h[7];
+    V temp1, temp2;
+
+    for (uint8_t index = 0; index < 80; ++index) {
+        if (index >= 16) {
+            V w2 = w[(index - 2) & 15];
+            V w15 = w[(index - 15) & 15];
+            w[index & 15] += (SHA512MB_ROR(w2, 19) ^ SHA512MB_ROR(w2, 61) ^ (w2 >> 6)) +
+                             w[(index - 7) & 15] +
+                             (SHA512MB_ROR(w15, 1) ^ SHA512MB_ROR(w15, 8) ^ (w15 >> 7));
+        }
+        temp1 = hh + k[index] + w[index & 15] +
+                (SHA512MB_ROR(e, 14) ^ SHA512MB_ROR(e, 18) ^ SHA512MB_ROR(e, 41)) + ((e & f) ^ ((~e) & g));
+        temp2 = (SHA512MB_ROR(a, 28) ^ SHA512MB_ROR(a, 34) ^ SHA512MB_ROR(a, 39)) +
+                ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+}
+
+// Build the next (possibly padding) block of a stream, in host byte order.
+SHA512MB_INLINE void fetchBlock(const Stream &s, uint64_t *w)
+{
+    size_t off = s.block * 128;
+    uint8_t buf[128];
+
+    if (off + 128 <= s.len) {
+        memcpy(buf, s.data + off, 128);
+    } else {
+        size_t n = (s.len > off) ? (s.len - off) : 0;
+        if (n)
+            memcpy(buf, s.data + off, n);
+        memset(buf + n, 0, 128 - n);
+        if (s.len >= off)
+            buf[n] = 0x80;
+        if (s.block == s.blocks - 1) {
+            uint64_t bitsHigh = htobe64(((uint64_t)s.len) >> 61);
+            uint64_t bitsLow = htobe64(((uint64_t)s.len) << 3);
+            memcpy(buf + 112, &bitsHigh, 8);
+            memcpy(buf + 120, &bitsLow, 8);
+        }
+    }
+    memcpy(w, buf, 128);
+    for (uint8_t index = 0; index < 16; ++index)
+        w[index] = be64toh(w[index]);
+}
+
+template <unsigned N>
+SHA512MB_INLINE void finishStream(const Stream &s, uint64_t (*st)[N], unsigned lane)
+{
+    uint64_t out[8];
+    for (uint8_t index = 0; index < 8; ++index)
+        out[index] = htobe64(st[index][lane]);
+    memcpy(s.out, out, 64);
+}
+
+template <typename V, unsigned N>
+SHA512MB_INLINE void hashLanes(Batch &b)
+{
+    Stream s[N];
+    uint64_t st[8][N] __attribute__((aligned(32)));
+    uint64_t w[16][N] __attribute__((aligned(32)));
+    uint64_t blk[16];
+    V hv[8], wv[16];
+    unsigned active = 0;
+
+    memset(w, 0, sizeof(w));
+    for (unsigned lane = 0; lane < N; ++lane) {
+        if (nextStream(b, s[lane]))
+            ++active;
+        for (uint8_t index = 0; index < 8; ++index)
+            st[index][lane] = hashStart[index];
+    }
+
+    while (active) {
+        // A single message left: no point in running the other lanes idle.
+        if (N > 1 && active == 1 && b.next == b.count)
+            break;
+
+        // Idle lanes hash whatever is left over; their state is thrown away.
+        for (unsigned lane = 0; lane < N; ++lane) {
+            if (!s[lane].out)
+                continue;
+            fetchBlock(s[lane], blk);
+            for (uint8_t index = 0; index < 16; ++index)
+                w[index][lane] = blk[index];
+        }
+        memcpy(hv, st, sizeof(hv));
+        memcpy(wv, w, sizeof(wv));
+        compress(hv, wv);
+        memcpy(st, hv, sizeof(st));
+
+        for (unsigned lane = 0; lane < N; ++lane) {
+            if (!s[lane].out || ++(s[lane].block) < s[lane].blocks)
+                continue;
+            finishStream<N>(s[lane], st, lane);
+            if (nextStream(b, s[lane])) {
+                for (uint8_t index = 0; index < 8; ++index)
+                    st[index][lane] = hashStart[index];
+            } else {
+                --active;
+            }
+        }
+    }
+
+    // Finish the last message one block at a time.
+    for (unsigned lane = 0; active && lane < N; ++lane) {
+        if (!s[lane].out)
+            continue;
+        uint64_t h[8];
+        for (uint8_t index = 0; index < 8; ++index)
+            h[index] = st[index][lane];
+        for (; s[lane].block < s[lane].blocks; ++(s[lane].block)) {
+            fetchBlock(s[lane], blk);
+            compress(h, blk);
+        }
+        for (uint8_t index = 0; index < 8; ++index)
+            st[index][lane] = h[index];
+        finishStream<N>(s[lane], st, lane);
+        clean(h);
+    }
+
+    clean(w);
+    clean(wv);
+    clean(blk);
+}
+
+__attribute__((target("sse2"))) void hashSSE2(Batch &b)
+{
+    hashLanes<v2u64, 2>(b);
+}
+
+__attribute__((target("avx2"))) void hashAVX2(Batch &b)
+{
+    hashLanes<v4u64, 4>(b);
+}
+
+#undef SHA512MB_ROR
+
+#endif // SHA512MB_X86
+
+void hashScalar(Batch &b)
+{
+    SHA512 sha;
+    for (; b.next < b.count; ++b.next) {
+        sha.reset();
+        sha.update(b.data[b.next], b.lens[b.next]);
+        sha.finalize(b.hashes + 64 * b.next, 64);
+    }
+}
+
+// Widest implementation the CPU can run.
+uint8_t detectLanes()
+{
+#if defined(SHA512MB_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return 4;
+    if (__builtin_cpu_supports("sse2"))
+        return 2;
+#endif
+    return 1;
+}
+
+uint8_t selectedLanes = 0;
+
+} // namespace
+
+/**
+ * \brief Hashes a batch of independent messages.
+ *
+ * \param hashes Buffer of 64 * \a count bytes that receives the hashes,
+ * one after the other in the same order as the messages.
+ * \param data Array of \a count pointers to the messages.
+ * \param lens Array of \a count message lengths, in bytes.
+ * \param count Number of messages in the batch.
+ *
+ * Every hash is the same that SHA512::finalize() would return for
+ * the corresponding message.  Messages of different lengths can be
+ * mixed freely; callers that need the hash of R || A || M must
+ * concatenate the parts first.
+ */
+void SHA512MB::hash(uint8_t *hashes, const void *const *data,
+                    const size_t *lens, size_t count)
+{
+    Batch b;
+    b.hashes = hashes;
+    b.data = data;
+    b.lens = lens;
+    b.count = count;
+    b.next = 0;
+
+    switch (lanes()) {
+#if defined(SHA512MB_X86)
+    case 4:
+        hashAVX2(b);
+        break;
+    case 2:
+        hashSSE2(b);
+        break;
+#endif
+    default:
+        hashScalar(b);
+        break;
+    }
+}
+
+/**
+ * \brief Returns the number of messages hashed in parallel by hash().
+ *
+ * 4 with AVX2, 2 with SSE2 and 1 when falling back to the SHA512 class.
+ * Unless overridden by setLanes() this is detected on first use.
+ */
+uint8_t SHA512MB::lanes()
+{
+    if (!selectedLanes)
+        selectedLanes = detectLanes();
+    return selectedLanes;
+}
+
+/**
+ * \brief Overrides the implementation picked by the CPU dispatch.
+ *
+ * \param lanes Requested number of lanes (1, 2 or 4), or 0 to go back
+ * to automatic detection.
+ * \return The number of lanes actually selected: requests the CPU
+ * can't satisfy are lowered to the widest supported implementation.
+ *
+ * Mostly useful to compare implementations in benchmarks and tests.
+ */
+uint8_t SHA512MB::setLanes(uint8_t lanes)
+{
+    uint8_t best = detectLanes();
+    if (!lanes || lanes > best)
+        lanes = best;
+    else if (lanes >= 4)
+        lanes = 4;
+    else if (lanes >= 2)
+        lanes = 2;
+    else
+        lanes = 1;
+    selectedLanes = lanes;
+    return lanes;
+}
@@ -0,0 +1,28 @@
+/*
+ * Multi-buffer SHA-512: hashes several independent messages at once,
+ * one message per SIMD lane. Meant for gateways that have to hash
+ * R || A || M for a whole batch of signed packets.
+ *
+ * Results are identical to SHA512::finalize() on the same input.
+ */
+
+#ifndef CRYPTO_SHA512MB_h
+#define CRYPTO_SHA512MB_h
+
+#include <inttypes.h>
+#include <stddef.h>
+
+class SHA512MB
+{
+public:
+    static void hash(uint8_t *hashes, const void *const *data,
+                     const size_t *lens, size_t count);
+
+    static uint8_t lanes();
+    static uint8_t setLanes(uint8_t lanes);
+
+private:
+    SHA512MB() {}
+};
+
+#endif